@@ -0,0 +1,184 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSBatchRegistration_h
+#define itkANTSBatchRegistration_h
+
+#include "itkANTSRegistration.h"
+
+#include <mutex>
+
+namespace itk
+{
+
+/** \class ANTSBatchRegistration
+ *
+ * \brief Registers many moving images to one fixed image, running several registrations concurrently.
+ *
+ * The fixed image is converted to the internal pixel type only once, and shared by all the registrations.
+ * Registration parameters are configured on the object returned by GetModifiableRegistrationSettings().
+ * A checkpoint file name set there is given to the i-th registration with ".i" before its extension.
+ *
+ * The fixed mask is likewise wrapped into a spatial object once, and shared.
+ *
+ * Registrations run in NumberOfConcurrentRegistrations worker threads. The ANTs helper has no per-registration
+ * thread setting: the parallel sections of every registration use ITK's global default number of threads.
+ * With the Pool or TBB multithreader, these sections share one pool, so at most the pool's threads
+ * plus the worker threads are busy. With the Platform multithreader, each section starts its own threads,
+ * so the registrations run one at a time by default; a larger NumberOfConcurrentRegistrations then
+ * oversubscribes the machine.
+ *
+ * For each moving image, there are two outputs: forward transform at index 2*i,
+ * and inverse transform at index 2*i+1. Like in ANTSRegistration, inverses are computed on first access,
+ * unless ComputeInverseTransform is off in the registration settings.
+ *
+ * \ingroup ANTsWasm
+ * \ingroup Registration
+ *
+ */
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType = double>
+class ANTSBatchRegistration : public ProcessObject
+{
+public:
+  ITK_DISALLOW_COPY_AND_MOVE(ANTSBatchRegistration);
+
+  static constexpr unsigned int ImageDimension = TFixedImage::ImageDimension;
+
+  using FixedImageType = TFixedImage;
+  using MovingImageType = TMovingImage;
+  using ParametersValueType = TParametersValueType;
+
+  /** Type used to configure the registrations. Its inputs are ignored. */
+  using RegistrationSettingsType = ANTSRegistration<FixedImageType, MovingImageType, ParametersValueType>;
+  using LabelImageType = typename RegistrationSettingsType::LabelImageType;
+  using OutputTransformType = typename RegistrationSettingsType::OutputTransformType;
+  using DecoratedOutputTransformType = typename RegistrationSettingsType::DecoratedOutputTransformType;
+
+  /** Standard class aliases. */
+  using Self = ANTSBatchRegistration<FixedImageType, MovingImageType, ParametersValueType>;
+  using Superclass = ProcessObject;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Run-time type information. */
+  itkTypeMacro(ANTSBatchRegistration, ProcessObject);
+
+  /** Standard New macro. */
+  itkNewMacro(Self);
+
+  /** Set/get the fixed image, shared by all the registrations. */
+  virtual void
+  SetFixedImage(const FixedImageType * image);
+  virtual const FixedImageType *
+  GetFixedImage() const;
+
+  /** Set/get the fixed image's mask, shared by all the registrations. */
+  virtual void
+  SetFixedMask(const LabelImageType * mask);
+  virtual const LabelImageType *
+  GetFixedMask() const;
+
+  /** Set/get the i-th moving image. */
+  virtual void
+  SetMovingImage(unsigned int i, const MovingImageType * image);
+  virtual const MovingImageType *
+  GetMovingImage(unsigned int i) const;
+
+  /** Appends a moving image to the list of images to register. */
+  virtual void
+  AddMovingImage(const MovingImageType * image)
+  {
+    this->SetMovingImage(this->GetNumberOfMovingImages(), image);
+  }
+
+  /** Returns the number of moving images. */
+  unsigned int
+  GetNumberOfMovingImages() const;
+
+  /** Parameters (type of transform, metrics, iterations etc) used for every registration. */
+  itkGetModifiableObjectMacro(RegistrationSettings, RegistrationSettingsType);
+
+  /** Set/Get how many registrations run at the same time.
+   * Zero (default) means ANTSRegistration::GetDefaultNumberOfConcurrentRegistrations(): one with the Platform
+   * multithreader, and otherwise half of ITK's global default number of threads, and at least one. */
+  itkSetMacro(NumberOfConcurrentRegistrations, unsigned int);
+  itkGetConstMacro(NumberOfConcurrentRegistrations, unsigned int);
+
+  /** Returns the forward transform for the i-th moving image. */
+  virtual const OutputTransformType *
+  GetForwardTransform(unsigned int i) const
+  {
+    return this->GetOutput(2 * i)->Get();
+  }
+
+  /** Returns the inverse transform for the i-th moving image, if available. It is computed on first access,
+   * and several threads may call it at the same time, but not while Update() runs. */
+  virtual const OutputTransformType *
+  GetInverseTransform(unsigned int i) const
+  {
+    return this->GetOutput(2 * i + 1)->Get();
+  }
+
+  using DataObjectPointerArraySizeType = ProcessObject::DataObjectPointerArraySizeType;
+
+  virtual DecoratedOutputTransformType *
+  GetOutput(DataObjectPointerArraySizeType i);
+  virtual const DecoratedOutputTransformType *
+  GetOutput(DataObjectPointerArraySizeType i) const;
+
+protected:
+  ANTSBatchRegistration();
+  ~ANTSBatchRegistration() override = default;
+
+  /** Registrations use the internal pixel type for the fixed image, so it is converted only once. */
+  using InternalImageType = typename ::ants::RegistrationHelper<TParametersValueType, ImageDimension>::ImageType;
+  using RegistrationType = ANTSRegistration<InternalImageType, MovingImageType, ParametersValueType>;
+  using MaskSpatialObjectType = typename RegistrationType::MaskSpatialObjectType;
+
+  using Superclass::MakeOutput;
+  DataObjectPointer MakeOutput(DataObjectPointerArraySizeType) override;
+
+  void
+  PrintSelf(std::ostream & os, Indent indent) const override;
+
+  void
+  GenerateData() override;
+
+  /** Computes the inverse of the i-th forward transform, if it was requested and not computed yet. */
+  virtual void
+  UpdateInverseTransform(unsigned int i) const;
+
+  /** Registers the i-th moving image, and sets the corresponding outputs. */
+  virtual void
+  RegisterMovingImage(unsigned int i, const InternalImageType * fixedImage, MaskSpatialObjectType * fixedMask);
+
+  unsigned int m_NumberOfConcurrentRegistrations{ 0 };
+
+  typename RegistrationSettingsType::Pointer m_RegistrationSettings{ RegistrationSettingsType::New() };
+
+  /** Forward transforms whose inverse has not been computed yet, one per moving image. */
+  mutable std::vector<typename OutputTransformType::ConstPointer> m_ForwardTransformsToInvert;
+  /** Serializes the lazy inversions done by the const getters. */
+  mutable std::mutex m_InverseTransformsMutex;
+};
+} // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#  include "itkANTSBatchRegistration.hxx"
+#endif
+
+#endif // itkANTSBatchRegistration
@@ -0,0 +1,334 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSBatchRegistration_hxx
+#define itkANTSBatchRegistration_hxx
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "itkANTSBatchRegistration.h"
+
+namespace itk
+{
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::ANTSBatchRegistration()
+{
+  ProcessObject::SetNumberOfRequiredInputs(2);
+  ProcessObject::SetNumberOfRequiredOutputs(0);
+  ProcessObject::SetNumberOfIndexedOutputs(0);
+
+  SetPrimaryInputName("FixedImage");
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::PrintSelf(std::ostream & os,
+                                                                                  Indent         indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "NumberOfMovingImages: " << this->GetNumberOfMovingImages() << std::endl;
+  os << indent << "NumberOfConcurrentRegistrations: " << this->m_NumberOfConcurrentRegistrations << std::endl;
+  os << indent << "RegistrationSettings: " << std::endl;
+  this->m_RegistrationSettings->Print(os, indent.GetNextIndent());
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::SetFixedImage(const FixedImageType * image)
+{
+  if (image != this->GetFixedImage())
+  {
+    this->ProcessObject::SetNthInput(0, const_cast<FixedImageType *>(image));
+    this->Modified();
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetFixedImage() const
+  -> const FixedImageType *
+{
+  return static_cast<const FixedImageType *>(this->ProcessObject::GetInput(0));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::SetFixedMask(const LabelImageType * mask)
+{
+  if (mask != this->GetFixedMask())
+  {
+    this->ProcessObject::SetInput("FixedMask", const_cast<LabelImageType *>(mask));
+    this->Modified();
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetFixedMask() const
+  -> const LabelImageType *
+{
+  return static_cast<const LabelImageType *>(this->ProcessObject::GetInput("FixedMask"));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::SetMovingImage(unsigned int            i,
+                                                                                       const MovingImageType * image)
+{
+  // moving images come after the fixed image
+  this->ProcessObject::SetNthInput(i + 1, const_cast<MovingImageType *>(image));
+
+  // two outputs per moving image: forward and inverse transform
+  const DataObjectPointerArraySizeType numberOfOutputs = 2 * this->GetNumberOfMovingImages();
+  if (this->GetNumberOfIndexedOutputs() < numberOfOutputs)
+  {
+    for (DataObjectPointerArraySizeType o = this->GetNumberOfIndexedOutputs(); o < numberOfOutputs; ++o)
+    {
+      this->ProcessObject::SetNthOutput(o, this->MakeOutput(o));
+    }
+  }
+  this->Modified();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetMovingImage(unsigned int i) const
+  -> const MovingImageType *
+{
+  return static_cast<const MovingImageType *>(this->ProcessObject::GetInput(i + 1));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+unsigned int
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetNumberOfMovingImages() const
+{
+  const DataObjectPointerArraySizeType numberOfInputs = this->GetNumberOfIndexedInputs();
+  return numberOfInputs > 0 ? numberOfInputs - 1 : 0;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetOutput(DataObjectPointerArraySizeType i)
+  -> DecoratedOutputTransformType *
+{
+  if (i % 2 == 1)
+  {
+    this->UpdateInverseTransform(i / 2);
+  }
+  return static_cast<DecoratedOutputTransformType *>(this->ProcessObject::GetOutput(i));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetOutput(
+  DataObjectPointerArraySizeType i) const -> const DecoratedOutputTransformType *
+{
+  if (i % 2 == 1)
+  {
+    this->UpdateInverseTransform(i / 2);
+  }
+  return static_cast<const DecoratedOutputTransformType *>(this->ProcessObject::GetOutput(i));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeOutput(DataObjectPointerArraySizeType)
+  -> DataObjectPointer
+{
+  typename DecoratedOutputTransformType::Pointer decoratedOutputTransform = DecoratedOutputTransformType::New();
+  decoratedOutputTransform->Set(OutputTransformType::New());
+  return decoratedOutputTransform;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::UpdateInverseTransform(unsigned int i) const
+{
+  const std::lock_guard<std::mutex> lock(m_InverseTransformsMutex);
+  if (i >= m_ForwardTransformsToInvert.size() || m_ForwardTransformsToInvert[i].IsNull())
+  {
+    return;
+  }
+  typename OutputTransformType::ConstPointer forwardTransform = m_ForwardTransformsToInvert[i];
+  m_ForwardTransformsToInvert[i] = nullptr;
+
+  typename OutputTransformType::Pointer inverseTransform = OutputTransformType::New();
+  auto *                                decoratedInverseTransform =
+    static_cast<DecoratedOutputTransformType *>(const_cast<DataObject *>(this->ProcessObject::GetOutput(2 * i + 1)));
+  if (forwardTransform->GetInverse(inverseTransform))
+  {
+    decoratedInverseTransform->Set(inverseTransform);
+  }
+  else
+  {
+    decoratedInverseTransform->Set(nullptr);
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::RegisterMovingImage(
+  unsigned int              i,
+  const InternalImageType * fixedImage,
+  MaskSpatialObjectType *   fixedMask)
+{
+  typename RegistrationType::Pointer registration = RegistrationType::New();
+  registration->CopyParameters(m_RegistrationSettings.GetPointer());
+  const std::string checkpointFileName = m_RegistrationSettings->GetCheckpointFileName();
+  if (!checkpointFileName.empty()) // each registration has its own checkpoint
+  {
+    registration->SetCheckpointFileName(
+      RegistrationType::MakeCheckpointFileName(checkpointFileName, std::to_string(i)));
+  }
+  registration->SetFixedImage(fixedImage); // internal pixel type, so it is not copied again
+  registration->SetFixedMask(this->GetFixedMask());
+  registration->SetFixedMaskSpatialObject(fixedMask); // wraps the fixed mask, so it is not wrapped again
+  registration->SetMovingImage(this->GetMovingImage(i));
+  const typename RegistrationSettingsType::DecoratedInitialTransformType * initialTransform =
+    m_RegistrationSettings->GetInitialTransformInput();
+  if (initialTransform != nullptr)
+  {
+    registration->SetInitialTransformInput(initialTransform);
+  }
+  const typename RegistrationSettingsType::DecoratedInitialTransformType * warmStartTransform =
+    m_RegistrationSettings->GetWarmStartTransformInput();
+  if (warmStartTransform != nullptr)
+  {
+    registration->SetWarmStartTransformInput(warmStartTransform);
+  }
+  registration->Update();
+
+  this->GetOutput(2 * i)->Set(registration->GetForwardTransform());
+  this->GetOutput(2 * i + 1)->Set(nullptr);
+  if (registration->GetComputeInverseTransform())
+  {
+    m_ForwardTransformsToInvert[i] = registration->GetForwardTransform(); // inverted on first access
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSBatchRegistration<TFixedImage, TMovingImage, TParametersValueType>::GenerateData()
+{
+  const unsigned int numberOfMovingImages = this->GetNumberOfMovingImages();
+  for (unsigned int i = 0; i < numberOfMovingImages; ++i)
+  {
+    if (this->GetMovingImage(i) == nullptr)
+    {
+      itkExceptionMacro(<< "Moving image " << i << " is not set.");
+    }
+  }
+
+  // Each worker only writes its own elements, so the vector is sized before starting them
+  m_ForwardTransformsToInvert.assign(numberOfMovingImages, nullptr);
+
+  this->UpdateProgress(0.01);
+
+  // The fixed-side work is done once: all the registrations share this image and the mask below
+  const typename InternalImageType::Pointer fixedImage =
+    RegistrationType::CastImageToInternalType(this->GetFixedImage());
+
+  const typename MaskSpatialObjectType::Pointer fixedMask =
+    RegistrationType::MakeMaskSpatialObject(this->GetFixedMask());
+
+  unsigned int numberOfWorkers = m_NumberOfConcurrentRegistrations;
+  if (numberOfWorkers == 0)
+  {
+    numberOfWorkers = RegistrationType::GetDefaultNumberOfConcurrentRegistrations();
+  }
+  numberOfWorkers = std::min(numberOfWorkers, numberOfMovingImages);
+
+  // Workers are plain threads, so the registrations' own parallel sections
+  // can use ITK's thread pool without waiting on a pool thread.
+  std::atomic<unsigned int> nextImage{ 0 };
+  std::atomic<unsigned int> finishedImages{ 0 };
+  std::atomic<bool>         failed{ false };
+  std::mutex                progressMutex;
+  std::exception_ptr        firstError;
+
+  auto worker = [&]() {
+    for (unsigned int i = nextImage++; i < numberOfMovingImages; i = nextImage++)
+    {
+      if (failed || this->GetAbortGenerateData())
+      {
+        return;
+      }
+      try
+      {
+        this->RegisterMovingImage(i, fixedImage, fixedMask);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        if (!failed)
+        {
+          firstError = std::current_exception();
+          failed = true;
+        }
+        return;
+      }
+      std::lock_guard<std::mutex> lock(progressMutex);
+      this->UpdateProgress(0.01f + 0.99f * (++finishedImages) / numberOfMovingImages);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(numberOfWorkers);
+  for (unsigned int w = 0; w < numberOfWorkers; ++w)
+  {
+    workers.emplace_back(worker);
+  }
+  for (auto & w : workers)
+  {
+    w.join();
+  }
+
+  if (firstError)
+  {
+    std::rethrow_exception(firstError);
+  }
+  if (this->GetAbortGenerateData())
+  {
+    ProcessAborted e(__FILE__, __LINE__);
+    e.SetDescription("Batch registration aborted.");
+    throw e;
+  }
+
+  this->UpdateProgress(1.0);
+}
+
+} // end namespace itk
+
+#endif // itkANTSBatchRegistration_hxx
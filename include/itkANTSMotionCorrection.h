@@ -0,0 +1,242 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSMotionCorrection_h
+#define itkANTSMotionCorrection_h
+
+#include "itkANTSRegistration.h"
+
+namespace itk
+{
+
+/** \class ANTSMotionCorrection
+ *
+ * \brief Registers every volume of a time series (e.g. fMRI or DWI) to a reference volume.
+ *
+ * The last dimension of the input image is time. The reference is either set explicitly,
+ * or it is the volume at ReferenceVolumeIndex. It is converted to the internal pixel type once,
+ * and shared by all the registrations. Registration parameters are configured on the object
+ * returned by GetModifiableRegistrationSettings(); the default type of transform is "Rigid".
+ * A checkpoint file name set there is given to the registration of volume i with ".i" before its extension.
+ *
+ * Volumes are copied out of the series one at a time, in their own pixel type, by the worker
+ * which registers them, so the series is never duplicated as a whole. With NumberOfVolumesPerChunk,
+ * only that many volumes of the series are requested from the upstream pipeline at a time,
+ * which allows streaming the series from a reader.
+ *
+ * The reference mask is likewise wrapped into a spatial object once, and shared.
+ *
+ * Registrations run in NumberOfConcurrentRegistrations worker threads, and their parallel sections
+ * use ITK's global default number of threads, as in ANTSBatchRegistration. With WarmStart, each worker
+ * registers a contiguous range of volumes in order, and each registration continues from the previous volume's result
+ * (see ANTSRegistration::SetWarmStartTransform(), and WarmStartLevelsToSkip in the settings).
+ *
+ * Output i is the forward transform of volume i, which maps points of the reference into the volume.
+ * GetMotionParameters() summarizes the linear part of each transform as rotation angles,
+ * a translation of the reference's center and the framewise displacement.
+ *
+ * \ingroup ANTsWasm
+ * \ingroup Registration
+ *
+ */
+template <typename TTimeSeriesImage, typename TParametersValueType = double>
+class ANTSMotionCorrection : public ProcessObject
+{
+public:
+  ITK_DISALLOW_COPY_AND_MOVE(ANTSMotionCorrection);
+
+  static constexpr unsigned int TimeSeriesDimension = TTimeSeriesImage::ImageDimension;
+  static constexpr unsigned int ImageDimension = TimeSeriesDimension - 1;
+
+  using TimeSeriesImageType = TTimeSeriesImage;
+  using PixelType = typename TimeSeriesImageType::PixelType;
+  using VolumeImageType = Image<PixelType, ImageDimension>;
+  using ParametersValueType = TParametersValueType;
+
+  /** Type used to configure the registrations. Its inputs are ignored. */
+  using RegistrationSettingsType = ANTSRegistration<VolumeImageType, VolumeImageType, ParametersValueType>;
+  using LabelImageType = typename RegistrationSettingsType::LabelImageType;
+  using OutputTransformType = typename RegistrationSettingsType::OutputTransformType;
+  using DecoratedOutputTransformType = typename RegistrationSettingsType::DecoratedOutputTransformType;
+
+  /** Motion of one volume relative to the reference. */
+  struct VolumeMotion
+  {
+    std::vector<double>            Angles;                        // radians: one in 2D; about x, y and z in 3D
+    Vector<double, ImageDimension> Translation;                   // displacement of the reference's center
+    double                         FramewiseDisplacement{ 0.0 }; // relative to the previous volume
+    double                         FinalMetricValue{ std::numeric_limits<double>::quiet_NaN() };
+  };
+  using MotionParametersType = std::vector<VolumeMotion>;
+
+  /** Standard class aliases. */
+  using Self = ANTSMotionCorrection<TimeSeriesImageType, ParametersValueType>;
+  using Superclass = ProcessObject;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Run-time type information. */
+  itkTypeMacro(ANTSMotionCorrection, ProcessObject);
+
+  /** Standard New macro. */
+  itkNewMacro(Self);
+
+  /** Set/get the time series. Its last dimension is time. */
+  virtual void
+  SetInput(const TimeSeriesImageType * image);
+  virtual const TimeSeriesImageType *
+  GetInput() const;
+
+  /** Set/get the reference volume. If not set, the volume at ReferenceVolumeIndex is used. */
+  virtual void
+  SetReferenceImage(const VolumeImageType * image);
+  virtual const VolumeImageType *
+  GetReferenceImage() const;
+
+  /** Set/get the reference's mask, shared by all the registrations. */
+  virtual void
+  SetReferenceMask(const LabelImageType * mask);
+  virtual const LabelImageType *
+  GetReferenceMask() const;
+
+  /** Set/Get the index of the volume used as the reference when no reference image is set. */
+  itkSetMacro(ReferenceVolumeIndex, unsigned int);
+  itkGetConstMacro(ReferenceVolumeIndex, unsigned int);
+
+  /** Parameters (type of transform, metrics, iterations etc) used for every registration. */
+  itkGetModifiableObjectMacro(RegistrationSettings, RegistrationSettingsType);
+
+  /** Set/Get how many registrations run at the same time.
+   * Zero (default) means ANTSRegistration::GetDefaultNumberOfConcurrentRegistrations().
+   * See ANTSBatchRegistration for how concurrent registrations share ITK's threads. */
+  itkSetMacro(NumberOfConcurrentRegistrations, unsigned int);
+  itkGetConstMacro(NumberOfConcurrentRegistrations, unsigned int);
+
+  /** Set/Get whether each registration starts from the result of the previous volume.
+   * Head motion is smooth in time, so this shortens the registrations. Default is off. */
+  itkSetMacro(WarmStart, bool);
+  itkGetConstMacro(WarmStart, bool);
+  itkBooleanMacro(WarmStart);
+
+  /** Set/Get how many volumes are requested from the upstream pipeline at a time.
+   * Zero (default) requests the whole series at once. */
+  itkSetMacro(NumberOfVolumesPerChunk, unsigned int);
+  itkGetConstMacro(NumberOfVolumesPerChunk, unsigned int);
+
+  /** Returns the number of volumes in the time series. */
+  unsigned int
+  GetNumberOfVolumes() const;
+
+  /** Returns the forward transform of the i-th volume. */
+  virtual const OutputTransformType *
+  GetForwardTransform(unsigned int i) const
+  {
+    return this->GetOutput(i)->Get();
+  }
+
+  /** Returns the motion of each volume, computed by the last Update(). */
+  virtual const MotionParametersType &
+  GetMotionParameters() const
+  {
+    return m_MotionParameters;
+  }
+
+  /** Returns the motion parameters formatted as CSV, one line per volume. Convenient from Python. */
+  virtual std::string
+  GetMotionParametersCSV() const;
+
+  using DataObjectPointerArraySizeType = ProcessObject::DataObjectPointerArraySizeType;
+
+  virtual DecoratedOutputTransformType *
+  GetOutput(DataObjectPointerArraySizeType i);
+  virtual const DecoratedOutputTransformType *
+  GetOutput(DataObjectPointerArraySizeType i) const;
+
+protected:
+  ANTSMotionCorrection();
+  ~ANTSMotionCorrection() override = default;
+
+  /** Registrations use the internal pixel type for the reference, so it is converted only once. */
+  using InternalImageType = typename ::ants::RegistrationHelper<TParametersValueType, ImageDimension>::ImageType;
+  using RegistrationType = ANTSRegistration<InternalImageType, VolumeImageType, ParametersValueType>;
+  using InitialTransformType = typename RegistrationType::InitialTransformType;
+  using MaskSpatialObjectType = typename RegistrationType::MaskSpatialObjectType;
+  using MatrixType = Matrix<double, ImageDimension, ImageDimension>;
+  using PointType = Point<double, ImageDimension>;
+  using VectorType = Vector<double, ImageDimension>;
+
+  using Superclass::MakeOutput;
+  DataObjectPointer MakeOutput(DataObjectPointerArraySizeType) override;
+
+  void
+  PrintSelf(std::ostream & os, Indent indent) const override;
+
+  /** Creates one output per volume. */
+  void
+  GenerateOutputInformation() override;
+
+  /** Only the first chunk of the series is requested, the others are requested by GenerateData(). */
+  void
+  GenerateInputRequestedRegion() override;
+
+  void
+  GenerateData() override;
+
+  /** Makes sure the given volumes of the series are buffered, updating the upstream pipeline if needed. */
+  virtual void
+  RequestVolumes(unsigned int first, unsigned int count);
+
+  /** Copies the i-th volume out of the series. */
+  virtual typename VolumeImageType::Pointer
+  ExtractVolume(unsigned int i) const;
+
+  /** Registers the i-th volume, and sets the corresponding output.
+   * Without a warm-start transform, the settings' initial transform is used. */
+  virtual void
+  RegisterVolume(unsigned int                 i,
+                 const InternalImageType *    referenceImage,
+                 MaskSpatialObjectType *      referenceMask,
+                 const InitialTransformType * warmStartTransform);
+
+  /** Computes the matrix and translation of the linear part of a transform around the given center.
+   * For a non-linear transform, this is its linearization at the center. */
+  static void
+  ComputeLinearPart(const OutputTransformType * transform,
+                    const PointType &           center,
+                    MatrixType &                matrix,
+                    VectorType &                translation);
+
+  /** Fills the motion parameters from the forward transforms, around the reference's center. */
+  virtual void
+  ComputeMotionParameters(const PointType & center);
+
+  unsigned int m_ReferenceVolumeIndex{ 0 };
+  unsigned int m_NumberOfConcurrentRegistrations{ 0 };
+  bool         m_WarmStart{ false };
+  unsigned int m_NumberOfVolumesPerChunk{ 0 };
+
+  typename RegistrationSettingsType::Pointer m_RegistrationSettings{ RegistrationSettingsType::New() };
+
+  MotionParametersType m_MotionParameters;
+};
+} // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#  include "itkANTSMotionCorrection.hxx"
+#endif
+
+#endif // itkANTSMotionCorrection
@@ -0,0 +1,592 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSMotionCorrection_hxx
+#define itkANTSMotionCorrection_hxx
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "itkEuler2DTransform.h"
+#include "itkEuler3DTransform.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkANTSMotionCorrection.h"
+#include "vnl/algo/vnl_determinant.h"
+#include "vnl/algo/vnl_svd.h"
+
+namespace itk
+{
+template <typename TTimeSeriesImage, typename TParametersValueType>
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::ANTSMotionCorrection()
+{
+  static_assert(TimeSeriesDimension >= 3, "The time series must have at least two spatial dimensions.");
+
+  ProcessObject::SetNumberOfRequiredInputs(1);
+  ProcessObject::SetNumberOfRequiredOutputs(0);
+  ProcessObject::SetNumberOfIndexedOutputs(0);
+
+  SetPrimaryInputName("TimeSeries");
+  AddOptionalInputName("ReferenceImage");
+  AddOptionalInputName("ReferenceMask");
+
+  m_RegistrationSettings->SetTypeOfTransform("Rigid");
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::PrintSelf(std::ostream & os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "NumberOfVolumes: " << this->GetNumberOfVolumes() << std::endl;
+  os << indent << "ReferenceVolumeIndex: " << this->m_ReferenceVolumeIndex << std::endl;
+  os << indent << "NumberOfConcurrentRegistrations: " << this->m_NumberOfConcurrentRegistrations << std::endl;
+  os << indent << "WarmStart: " << (this->m_WarmStart ? "On" : "Off") << std::endl;
+  os << indent << "NumberOfVolumesPerChunk: " << this->m_NumberOfVolumesPerChunk << std::endl;
+  os << indent << "RegistrationSettings: " << std::endl;
+  this->m_RegistrationSettings->Print(os, indent.GetNextIndent());
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::SetInput(const TimeSeriesImageType * image)
+{
+  if (image != this->GetInput())
+  {
+    this->ProcessObject::SetNthInput(0, const_cast<TimeSeriesImageType *>(image));
+    this->Modified();
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetInput() const -> const TimeSeriesImageType *
+{
+  return static_cast<const TimeSeriesImageType *>(this->ProcessObject::GetInput(0));
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::SetReferenceImage(const VolumeImageType * image)
+{
+  if (image != this->GetReferenceImage())
+  {
+    this->ProcessObject::SetInput("ReferenceImage", const_cast<VolumeImageType *>(image));
+    this->Modified();
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetReferenceImage() const -> const VolumeImageType *
+{
+  return static_cast<const VolumeImageType *>(this->ProcessObject::GetInput("ReferenceImage"));
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::SetReferenceMask(const LabelImageType * mask)
+{
+  if (mask != this->GetReferenceMask())
+  {
+    this->ProcessObject::SetInput("ReferenceMask", const_cast<LabelImageType *>(mask));
+    this->Modified();
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetReferenceMask() const -> const LabelImageType *
+{
+  return static_cast<const LabelImageType *>(this->ProcessObject::GetInput("ReferenceMask"));
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+unsigned int
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetNumberOfVolumes() const
+{
+  const TimeSeriesImageType * series = this->GetInput();
+  return series != nullptr ? series->GetLargestPossibleRegion().GetSize(ImageDimension) : 0;
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetOutput(DataObjectPointerArraySizeType i)
+  -> DecoratedOutputTransformType *
+{
+  return static_cast<DecoratedOutputTransformType *>(this->ProcessObject::GetOutput(i));
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetOutput(DataObjectPointerArraySizeType i) const
+  -> const DecoratedOutputTransformType *
+{
+  return static_cast<const DecoratedOutputTransformType *>(this->ProcessObject::GetOutput(i));
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::MakeOutput(DataObjectPointerArraySizeType)
+  -> DataObjectPointer
+{
+  typename DecoratedOutputTransformType::Pointer decoratedOutputTransform = DecoratedOutputTransformType::New();
+  decoratedOutputTransform->Set(OutputTransformType::New());
+  return decoratedOutputTransform;
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+std::string
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GetMotionParametersCSV() const
+{
+  std::ostringstream os;
+  os.precision(12);
+  os << "volume";
+  if constexpr (ImageDimension == 2)
+  {
+    os << ",angle";
+  }
+  else if constexpr (ImageDimension == 3)
+  {
+    os << ",angleX,angleY,angleZ";
+  }
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    os << ",translation" << d;
+  }
+  os << ",framewiseDisplacement,finalMetricValue\n";
+
+  for (std::size_t i = 0; i < m_MotionParameters.size(); ++i)
+  {
+    const VolumeMotion & motion = m_MotionParameters[i];
+    os << i;
+    for (double angle : motion.Angles)
+    {
+      os << "," << angle;
+    }
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      os << "," << motion.Translation[d];
+    }
+    os << "," << motion.FramewiseDisplacement << ",";
+    if (motion.FinalMetricValue == motion.FinalMetricValue) // empty when not available
+    {
+      os << motion.FinalMetricValue;
+    }
+    os << "\n";
+  }
+  return os.str();
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  const unsigned int numberOfVolumes = this->GetNumberOfVolumes();
+  if (numberOfVolumes == 0)
+  {
+    itkExceptionMacro(<< "The time series has no volumes.");
+  }
+  const DataObjectPointerArraySizeType numberOfOutputs = this->GetNumberOfIndexedOutputs();
+  this->SetNumberOfIndexedOutputs(numberOfVolumes);
+  for (DataObjectPointerArraySizeType o = numberOfOutputs; o < numberOfVolumes; ++o)
+  {
+    this->ProcessObject::SetNthOutput(o, this->MakeOutput(o));
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  auto * series = const_cast<TimeSeriesImageType *>(this->GetInput());
+  if (series != nullptr && m_NumberOfVolumesPerChunk > 0)
+  {
+    typename TimeSeriesImageType::RegionType region = series->GetLargestPossibleRegion();
+    region.SetSize(ImageDimension, std::min<SizeValueType>(m_NumberOfVolumesPerChunk, region.GetSize(ImageDimension)));
+    series->SetRequestedRegion(region);
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::RequestVolumes(unsigned int first, unsigned int count)
+{
+  auto * series = const_cast<TimeSeriesImageType *>(this->GetInput());
+  typename TimeSeriesImageType::RegionType region = series->GetLargestPossibleRegion();
+  region.SetIndex(ImageDimension, region.GetIndex(ImageDimension) + first);
+  region.SetSize(ImageDimension, count);
+  if (series->GetBufferedRegion().IsInside(region))
+  {
+    return;
+  }
+  series->SetRequestedRegion(region);
+  series->PropagateRequestedRegion();
+  series->UpdateOutputData();
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+auto
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::ExtractVolume(unsigned int i) const
+  -> typename VolumeImageType::Pointer
+{
+  const TimeSeriesImageType *              series = this->GetInput();
+  typename TimeSeriesImageType::RegionType region = series->GetLargestPossibleRegion();
+  region.SetIndex(ImageDimension, region.GetIndex(ImageDimension) + i);
+  region.SetSize(ImageDimension, 1);
+  if (!series->GetBufferedRegion().IsInside(region))
+  {
+    itkExceptionMacro(<< "Volume " << i << " of the time series is not buffered.");
+  }
+
+  // The volume's geometry is that of the series without its time axis, placed at the volume's time point
+  typename TimeSeriesImageType::PointType timePoint;
+  typename TimeSeriesImageType::IndexType timeIndex = region.GetIndex();
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    timeIndex[d] = 0;
+  }
+  series->TransformIndexToPhysicalPoint(timeIndex, timePoint);
+
+  typename VolumeImageType::RegionType    volumeRegion;
+  typename VolumeImageType::PointType     origin;
+  typename VolumeImageType::SpacingType   spacing;
+  typename VolumeImageType::DirectionType direction;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    volumeRegion.SetIndex(d, region.GetIndex(d));
+    volumeRegion.SetSize(d, region.GetSize(d));
+    origin[d] = timePoint[d];
+    spacing[d] = series->GetSpacing()[d];
+    for (unsigned int e = 0; e < ImageDimension; ++e)
+    {
+      direction[d][e] = series->GetDirection()[d][e];
+    }
+  }
+
+  typename VolumeImageType::Pointer volume = VolumeImageType::New();
+  volume->SetRegions(volumeRegion);
+  volume->SetOrigin(origin);
+  volume->SetSpacing(spacing);
+  volume->SetDirection(direction);
+  volume->Allocate();
+
+  ImageRegionConstIterator<TimeSeriesImageType> inputIt(series, region);
+  ImageRegionIterator<VolumeImageType>          outputIt(volume, volumeRegion);
+  for (; !outputIt.IsAtEnd(); ++inputIt, ++outputIt)
+  {
+    outputIt.Set(inputIt.Get());
+  }
+  return volume;
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::RegisterVolume(
+  unsigned int                 i,
+  const InternalImageType *    referenceImage,
+  MaskSpatialObjectType *      referenceMask,
+  const InitialTransformType * warmStartTransform)
+{
+  typename RegistrationType::Pointer registration = RegistrationType::New();
+  registration->CopyParameters(m_RegistrationSettings.GetPointer());
+  const std::string checkpointFileName = m_RegistrationSettings->GetCheckpointFileName();
+  if (!checkpointFileName.empty()) // each registration has its own checkpoint
+  {
+    registration->SetCheckpointFileName(
+      RegistrationType::MakeCheckpointFileName(checkpointFileName, std::to_string(i)));
+  }
+  registration->SetFixedImage(referenceImage); // internal pixel type, so it is not copied again
+  registration->SetFixedMask(this->GetReferenceMask());
+  registration->SetFixedMaskSpatialObject(referenceMask); // wraps the reference mask, so it is not wrapped again
+  registration->SetMovingImage(this->ExtractVolume(i));
+  if (warmStartTransform != nullptr)
+  {
+    registration->SetWarmStartTransform(warmStartTransform);
+  }
+  else if (m_RegistrationSettings->GetInitialTransformInput() != nullptr)
+  {
+    registration->SetInitialTransformInput(m_RegistrationSettings->GetInitialTransformInput());
+  }
+  registration->Update();
+
+  this->GetOutput(i)->Set(registration->GetForwardTransform());
+
+  // Each worker only writes its own element
+  const typename RegistrationType::RegistrationProfileType & profile = registration->GetRegistrationProfile();
+  for (auto stage = profile.rbegin(); stage != profile.rend(); ++stage)
+  {
+    if (!stage->Levels.empty())
+    {
+      m_MotionParameters[i].FinalMetricValue = stage->Levels.back().FinalMetricValue;
+      break;
+    }
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::ComputeLinearPart(
+  const OutputTransformType * transform,
+  const PointType &           center,
+  MatrixType &                matrix,
+  VectorType &                translation)
+{
+  using TransformPointType = typename OutputTransformType::InputPointType;
+  TransformPointType transformCenter;
+  transformCenter.CastFrom(center);
+  const TransformPointType mappedCenter = transform->TransformPoint(transformCenter);
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    translation[d] = mappedCenter[d] - center[d];
+  }
+
+  // Columns of the matrix are the images of unit steps from the center
+  for (unsigned int e = 0; e < ImageDimension; ++e)
+  {
+    TransformPointType point = transformCenter;
+    point[e] += 1.0;
+    const TransformPointType mappedPoint = transform->TransformPoint(point);
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      matrix[d][e] = mappedPoint[d] - mappedCenter[d];
+    }
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::ComputeMotionParameters(const PointType & center)
+{
+  constexpr double radius = 50.0; // mm, converts angles to displacements on a typical head, as in Power et al. 2012
+
+  for (unsigned int i = 0; i < m_MotionParameters.size(); ++i)
+  {
+    VolumeMotion & motion = m_MotionParameters[i];
+    MatrixType     matrix;
+    this->ComputeLinearPart(this->GetOutput(i)->Get(), center, matrix, motion.Translation);
+
+    // The rotation is the closest orthogonal matrix, which discards scaling and shearing
+    const vnl_svd<double> svd(matrix.GetVnlMatrix().as_matrix());
+    vnl_matrix<double>    u = svd.U();
+    if (vnl_determinant(u * svd.V().transpose()) < 0.0)
+    {
+      u.set_column(ImageDimension - 1, -u.get_column(ImageDimension - 1));
+    }
+    MatrixType rotation;
+    rotation = u * svd.V().transpose();
+
+    if constexpr (ImageDimension == 2)
+    {
+      auto euler = Euler2DTransform<double>::New();
+      euler->SetMatrix(rotation);
+      motion.Angles = { euler->GetAngle() };
+    }
+    else if constexpr (ImageDimension == 3)
+    {
+      auto euler = Euler3DTransform<double>::New();
+      euler->SetMatrix(rotation);
+      motion.Angles = { euler->GetAngleX(), euler->GetAngleY(), euler->GetAngleZ() };
+    }
+
+    motion.FramewiseDisplacement = 0.0;
+    if (i > 0)
+    {
+      const VolumeMotion & previous = m_MotionParameters[i - 1];
+      for (unsigned int d = 0; d < ImageDimension; ++d)
+      {
+        motion.FramewiseDisplacement += std::abs(motion.Translation[d] - previous.Translation[d]);
+      }
+      for (std::size_t a = 0; a < motion.Angles.size(); ++a)
+      {
+        motion.FramewiseDisplacement += radius * std::abs(motion.Angles[a] - previous.Angles[a]);
+      }
+    }
+  }
+}
+
+
+template <typename TTimeSeriesImage, typename TParametersValueType>
+void
+ANTSMotionCorrection<TTimeSeriesImage, TParametersValueType>::GenerateData()
+{
+  const unsigned int numberOfVolumes = this->GetNumberOfVolumes();
+
+  // Each worker only writes its own elements, so the vector is sized before starting them
+  m_MotionParameters.assign(numberOfVolumes, VolumeMotion{});
+
+  this->UpdateProgress(0.01);
+
+  // The reference-side work is done once: all the registrations share this image and the mask below
+  typename VolumeImageType::ConstPointer reference = this->GetReferenceImage();
+  if (reference == nullptr)
+  {
+    if (m_ReferenceVolumeIndex >= numberOfVolumes)
+    {
+      itkExceptionMacro(<< "Reference volume index " << m_ReferenceVolumeIndex << " is out of range, the series has "
+                        << numberOfVolumes << " volumes.");
+    }
+    this->RequestVolumes(m_ReferenceVolumeIndex, 1);
+    reference = this->ExtractVolume(m_ReferenceVolumeIndex);
+  }
+  const typename InternalImageType::Pointer referenceImage =
+    RegistrationType::CastImageToInternalType(reference.GetPointer());
+
+  // Motion is measured at the center of the reference, where it is least correlated with rotation
+  const typename InternalImageType::RegionType referenceRegion = referenceImage->GetLargestPossibleRegion();
+  ContinuousIndex<double, ImageDimension>      centerIndex;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    centerIndex[d] = referenceRegion.GetIndex(d) + (referenceRegion.GetSize(d) - 1) / 2.0;
+  }
+  const PointType center = referenceImage->template TransformContinuousIndexToPhysicalPoint<double>(centerIndex);
+
+  const unsigned int chunkSize = m_NumberOfVolumesPerChunk > 0 ? std::min(m_NumberOfVolumesPerChunk, numberOfVolumes)
+                                                                : numberOfVolumes;
+
+  const typename MaskSpatialObjectType::Pointer referenceMask =
+    RegistrationType::MakeMaskSpatialObject(this->GetReferenceMask());
+
+  unsigned int numberOfWorkers = m_NumberOfConcurrentRegistrations;
+  if (numberOfWorkers == 0)
+  {
+    numberOfWorkers = RegistrationType::GetDefaultNumberOfConcurrentRegistrations();
+  }
+  numberOfWorkers = std::min(numberOfWorkers, chunkSize);
+
+  // Workers are plain threads, so the registrations' own parallel sections
+  // can use ITK's thread pool without waiting on a pool thread.
+  std::atomic<unsigned int> finishedVolumes{ 0 };
+  std::atomic<bool>         failed{ false };
+  std::mutex                progressMutex;
+  std::exception_ptr        firstError;
+
+  auto registerVolume = [&](unsigned int i, const InitialTransformType * warmStartTransform) {
+    if (failed || this->GetAbortGenerateData())
+    {
+      return false;
+    }
+    try
+    {
+      this->RegisterVolume(i, referenceImage, referenceMask, warmStartTransform);
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(progressMutex);
+      if (!failed)
+      {
+        firstError = std::current_exception();
+        failed = true;
+      }
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(progressMutex);
+    this->UpdateProgress(0.01f + 0.98f * (++finishedVolumes) / numberOfVolumes);
+    return true;
+  };
+
+  for (unsigned int first = 0; first < numberOfVolumes && !failed && !this->GetAbortGenerateData(); first += chunkSize)
+  {
+    const unsigned int last = std::min(first + chunkSize, numberOfVolumes);
+    this->RequestVolumes(first, last - first);
+    const unsigned int chunkWorkers = std::min(numberOfWorkers, last - first);
+
+    std::atomic<unsigned int> nextVolume{ first };
+    auto                      worker = [&](unsigned int w) {
+      if (!m_WarmStart)
+      {
+        for (unsigned int i = nextVolume++; i < last; i = nextVolume++)
+        {
+          if (!registerVolume(i, nullptr))
+          {
+            return;
+          }
+        }
+        return;
+      }
+
+      // Each worker takes a contiguous range, so the previous volume is its own, or from an earlier chunk
+      const unsigned int begin = first + (last - first) * w / chunkWorkers;
+      const unsigned int end = first + (last - first) * (w + 1) / chunkWorkers;
+      for (unsigned int i = begin; i < end; ++i)
+      {
+        const bool previousDone = i > 0 && (i > begin || begin == first);
+        if (!registerVolume(i, previousDone ? this->GetOutput(i - 1)->Get() : nullptr))
+        {
+          return;
+        }
+      }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(chunkWorkers);
+    for (unsigned int w = 0; w < chunkWorkers; ++w)
+    {
+      workers.emplace_back(worker, w);
+    }
+    for (auto & w : workers)
+    {
+      w.join();
+    }
+  }
+
+  if (firstError)
+  {
+    std::rethrow_exception(firstError);
+  }
+  if (this->GetAbortGenerateData())
+  {
+    ProcessAborted e(__FILE__, __LINE__);
+    e.SetDescription("Motion correction aborted.");
+    throw e;
+  }
+
+  this->ComputeMotionParameters(center);
+  this->UpdateProgress(1.0);
+}
+
+} // end namespace itk
+
+#endif // itkANTSMotionCorrection_hxx
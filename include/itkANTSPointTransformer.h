@@ -0,0 +1,154 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSPointTransformer_h
+#define itkANTSPointTransformer_h
+
+#include "itkDisplacementFieldTransform.h"
+#include "itkObject.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class ANTSPointTransformer
+ *
+ * \brief Transforms large arrays of points in parallel.
+ *
+ * Calling TransformPoint() on a CompositeTransform for each point goes through a virtual call per point
+ * and per transform, and each DisplacementFieldTransform then goes through its interpolator.
+ * SetTransform() instead flattens the transform once into a list of steps:
+ * - consecutive linear transforms are composed into a single matrix and offset,
+ *   so a linear registration becomes one matrix product per point;
+ * - displacement fields with linear interpolation (the default) are interpolated inline, from the buffer;
+ * - any other transform is evaluated with its TransformPoint().
+ *
+ * TransformPoints() then applies each step to blocks of contiguous points, the blocks being processed in
+ * parallel. The results match TransformPoint() up to rounding.
+ *
+ * The steps refer to the transforms' parameters and fields, so SetTransform() must be called again
+ * after modifying the transform.
+ *
+ * \ingroup ANTsWasm
+ * \ingroup Transforms
+ *
+ */
+template <typename TParametersValueType, unsigned int VDimension>
+class ANTSPointTransformer : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_MOVE(ANTSPointTransformer);
+
+  static constexpr unsigned int Dimension = VDimension;
+
+  using ParametersValueType = TParametersValueType;
+  using TransformType = Transform<ParametersValueType, VDimension, VDimension>;
+  using DisplacementFieldTransformType = DisplacementFieldTransform<ParametersValueType, VDimension>;
+  using DisplacementFieldType = typename DisplacementFieldTransformType::DisplacementFieldType;
+
+  /** Standard class aliases. */
+  using Self = ANTSPointTransformer;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Run-time type information. */
+  itkTypeMacro(ANTSPointTransformer, Object);
+
+  /** Standard New macro. */
+  itkNewMacro(Self);
+
+  /** Set the transform, and prepare the steps which apply it. Nested composite transforms are flattened. */
+  virtual void
+  SetTransform(const TransformType * transform);
+  itkGetConstObjectMacro(Transform, TransformType);
+
+  /** Transforms numberOfPoints points, whose coordinates are stored contiguously: x0 y0 [z0] x1 y1 [z1] ...
+   * transformedPoints may be the same array as points. */
+  virtual void
+  TransformPoints(const ParametersValueType * points,
+                  ParametersValueType *       transformedPoints,
+                  SizeValueType               numberOfPoints) const;
+
+  /** Same, with the coordinates in a vector. Convenient from Python, where a NumPy array of shape
+   * (n, Dimension) can be passed flattened. */
+  virtual std::vector<ParametersValueType>
+  TransformPoints(const std::vector<ParametersValueType> & points) const;
+
+  /** Returns whether the transform reduced to a single matrix and offset. */
+  bool
+  IsAffine() const
+  {
+    return m_Steps.size() == 1 && m_Steps.front().Kind == StepEnum::Affine;
+  }
+
+  /** Set/Get the number of points transformed together by each work unit. Default is 4096. */
+  itkSetClampMacro(BlockSize, SizeValueType, 1, NumericTraits<SizeValueType>::max());
+  itkGetConstMacro(BlockSize, SizeValueType);
+
+protected:
+  ANTSPointTransformer() = default;
+  ~ANTSPointTransformer() override = default;
+
+  void
+  PrintSelf(std::ostream & os, Indent indent) const override;
+
+  using MatrixType = Matrix<double, VDimension, VDimension>;
+  using VectorType = Vector<double, VDimension>;
+
+  enum class StepEnum : uint8_t
+  {
+    Affine,
+    DisplacementField,
+    Generic
+  };
+
+  /** One step of the transform, applied to all the points of a block before the next step. */
+  struct Step
+  {
+    StepEnum                      Kind{ StepEnum::Generic };
+    MatrixType                    Linear;          // Affine: p' = Linear * p + Offset
+    VectorType                    Offset;          // Affine, or DisplacementField: the field's origin
+    MatrixType                    PhysicalToIndex; // DisplacementField: index = PhysicalToIndex * (p - Offset)
+    const DisplacementFieldType * Field{ nullptr };
+    const TransformType *         Transform{ nullptr }; // Generic
+  };
+
+  /** Appends the leaves of the transform to the list, in the order in which they are applied. */
+  static void
+  AppendLeaves(const TransformType * transform, std::vector<const TransformType *> & leaves);
+
+  /** Returns the matrix and offset of a linear transform, from its images of the origin and of the unit vectors. */
+  static void
+  ComputeLinearMap(const TransformType * transform, MatrixType & matrix, VectorType & offset);
+
+  /** Adds the displacement interpolated at p, unless p is outside of the field, like DisplacementFieldTransform. */
+  static void
+  DisplacePoint(const Step & step, double * p);
+
+  SizeValueType                        m_BlockSize{ 4096 };
+  typename TransformType::ConstPointer m_Transform;
+  std::vector<Step>                    m_Steps;
+};
+} // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#  include "itkANTSPointTransformer.hxx"
+#endif
+
+#endif // itkANTSPointTransformer_h
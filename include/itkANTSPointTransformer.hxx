@@ -0,0 +1,337 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSPointTransformer_hxx
+#define itkANTSPointTransformer_hxx
+
+#include <algorithm>
+#include <cmath>
+
+#include "itkCompositeTransform.h"
+#include "itkMatrixOffsetTransformBase.h"
+#include "itkMultiThreaderBase.h"
+#include "itkVectorLinearInterpolateImageFunction.h"
+#include "itkANTSPointTransformer.h"
+
+namespace itk
+{
+template <typename TParametersValueType, unsigned int VDimension>
+void
+ANTSPointTransformer<TParametersValueType, VDimension>::PrintSelf(std::ostream & os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "BlockSize: " << m_BlockSize << std::endl;
+  os << indent << "Transform: " << (m_Transform ? m_Transform->GetNameOfClass() : "(null)") << std::endl;
+  os << indent << "Steps:";
+  for (const Step & step : m_Steps)
+  {
+    switch (step.Kind)
+    {
+      case StepEnum::Affine:
+        os << " Affine";
+        break;
+      case StepEnum::DisplacementField:
+        os << " DisplacementField";
+        break;
+      case StepEnum::Generic:
+        os << " " << step.Transform->GetNameOfClass();
+        break;
+    }
+  }
+  os << std::endl;
+}
+
+
+template <typename TParametersValueType, unsigned int VDimension>
+void
+ANTSPointTransformer<TParametersValueType, VDimension>::SetTransform(const TransformType * transform)
+{
+  m_Transform = transform;
+  m_Steps.clear();
+  this->Modified();
+  if (transform == nullptr)
+  {
+    return;
+  }
+
+  std::vector<const TransformType *> leaves;
+  Self::AppendLeaves(transform, leaves);
+
+  using LinearInterpolatorType = VectorLinearInterpolateImageFunction<DisplacementFieldType, ParametersValueType>;
+  for (const TransformType * leaf : leaves)
+  {
+    Step step;
+    step.Transform = leaf;
+    const auto * fieldTransform = dynamic_cast<const DisplacementFieldTransformType *>(leaf);
+    if (leaf->IsLinear())
+    {
+      step.Kind = StepEnum::Affine;
+      Self::ComputeLinearMap(leaf, step.Linear, step.Offset);
+      if (!m_Steps.empty() && m_Steps.back().Kind == StepEnum::Affine)
+      {
+        // composed with the previous linear transforms, which are applied first
+        Step & previous = m_Steps.back();
+        previous.Offset = step.Linear * previous.Offset + step.Offset;
+        previous.Linear = step.Linear * previous.Linear;
+        continue;
+      }
+    }
+    else if (fieldTransform != nullptr && fieldTransform->GetDisplacementField() != nullptr &&
+             dynamic_cast<const LinearInterpolatorType *>(fieldTransform->GetInterpolator()) != nullptr)
+    {
+      step.Kind = StepEnum::DisplacementField;
+      step.Field = fieldTransform->GetDisplacementField();
+      MatrixType indexToPhysical;
+      for (unsigned int r = 0; r < VDimension; ++r)
+      {
+        for (unsigned int c = 0; c < VDimension; ++c)
+        {
+          indexToPhysical[r][c] = step.Field->GetDirection()[r][c] * step.Field->GetSpacing()[c];
+        }
+        step.Offset[r] = step.Field->GetOrigin()[r];
+      }
+      step.PhysicalToIndex = indexToPhysical.GetInverse();
+    }
+    m_Steps.push_back(step);
+  }
+}
+
+
+template <typename TParametersValueType, unsigned int VDimension>
+void
+ANTSPointTransformer<TParametersValueType, VDimension>::AppendLeaves(const TransformType *                transform,
+                                                                     std::vector<const TransformType *> & leaves)
+{
+  using CompositeTransformType = CompositeTransform<ParametersValueType, VDimension>;
+  const auto * compositeTransform = dynamic_cast<const CompositeTransformType *>(transform);
+  if (compositeTransform == nullptr)
+  {
+    leaves.push_back(transform);
+    return;
+  }
+  // a composite transform applies the last transform of its queue first
+  for (unsigned int i = compositeTransform->GetNumberOfTransforms(); i > 0; --i)
+  {
+    Self::AppendLeaves(compositeTransform->GetNthTransformConstPointer(i - 1), leaves);
+  }
+}
+
+
+template <typename TParametersValueType, unsigned int VDimension>
+void
+ANTSPointTransformer<TParametersValueType, VDimension>::ComputeLinearMap(const TransformType * transform,
+                                                                         MatrixType &          matrix,
+                                                                         VectorType &          offset)
+{
+  using MatrixOffsetTransformType = MatrixOffsetTransformBase<ParametersValueType, VDimension, VDimension>;
+  const auto * matrixOffsetTransform = dynamic_cast<const MatrixOffsetTransformType *>(transform);
+  if (matrixOffsetTransform != nullptr)
+  {
+    for (unsigned int r = 0; r < VDimension; ++r)
+    {
+      for (unsigned int c = 0; c < VDimension; ++c)
+      {
+        matrix[r][c] = matrixOffsetTransform->GetMatrix()[r][c];
+      }
+      offset[r] = matrixOffsetTransform->GetOffset()[r];
+    }
+    return;
+  }
+
+  // any other linear transform, e.g. a translation, is characterized by its images of the origin and unit vectors
+  typename TransformType::InputPointType point;
+  point.Fill(0.0);
+  const auto mappedOrigin = transform->TransformPoint(point);
+  for (unsigned int c = 0; c < VDimension; ++c)
+  {
+    point.Fill(0.0);
+    point[c] = 1.0;
+    const auto mapped = transform->TransformPoint(point);
+    for (unsigned int r = 0; r < VDimension; ++r)
+    {
+      matrix[r][c] = static_cast<double>(mapped[r]) - static_cast<double>(mappedOrigin[r]);
+    }
+  }
+  for (unsigned int r = 0; r < VDimension; ++r)
+  {
+    offset[r] = mappedOrigin[r];
+  }
+}
+
+
+template <typename TParametersValueType, unsigned int VDimension>
+void
+ANTSPointTransformer<TParametersValueType, VDimension>::DisplacePoint(const Step & step, double * p)
+{
+  const DisplacementFieldType * field = step.Field;
+  const auto &                  region = field->GetBufferedRegion();
+  const OffsetValueType *       offsetTable = field->GetOffsetTable();
+
+  // same boundary handling as VectorLinearInterpolateImageFunction, and IsInsideBuffer() of the transform
+  OffsetValueType lowerOffset[VDimension];
+  OffsetValueType upperOffset[VDimension];
+  double          fraction[VDimension];
+  for (unsigned int r = 0; r < VDimension; ++r)
+  {
+    double cindex = 0.0;
+    for (unsigned int c = 0; c < VDimension; ++c)
+    {
+      cindex += step.PhysicalToIndex[r][c] * (p[c] - step.Offset[c]);
+    }
+    const IndexValueType start = region.GetIndex(r);
+    const IndexValueType last = start + static_cast<IndexValueType>(region.GetSize(r)) - 1;
+    if (!(cindex >= start - 0.5 && cindex < last + 0.5))
+    {
+      return;
+    }
+
+    const double         floored = std::floor(cindex);
+    const IndexValueType lower = static_cast<IndexValueType>(floored);
+    fraction[r] = cindex - floored;
+    lowerOffset[r] = (std::clamp(lower, start, last) - start) * offsetTable[r];
+    upperOffset[r] = (std::clamp(lower + 1, start, last) - start) * offsetTable[r];
+  }
+
+  const auto * buffer = field->GetBufferPointer();
+  double       displacement[VDimension] = {};
+  for (unsigned int corner = 0; corner < (1u << VDimension); ++corner)
+  {
+    OffsetValueType offset = 0;
+    double          weight = 1.0;
+    for (unsigned int d = 0; d < VDimension; ++d)
+    {
+      if (corner & (1u << d))
+      {
+        offset += upperOffset[d];
+        weight *= fraction[d];
+      }
+      else
+      {
+        offset += lowerOffset[d];
+        weight *= 1.0 - fraction[d];
+      }
+    }
+    if (weight != 0.0)
+    {
+      const auto & value = buffer[offset];
+      for (unsigned int d = 0; d < VDimension; ++d)
+      {
+        displacement[d] += weight * value[d];
+      }
+    }
+  }
+  for (unsigned int d = 0; d < VDimension; ++d)
+  {
+    p[d] += displacement[d];
+  }
+}
+
+
+template <typename TParametersValueType, unsigned int VDimension>
+void
+ANTSPointTransformer<TParametersValueType, VDimension>::TransformPoints(const ParametersValueType * points,
+                                                                        ParametersValueType *       transformedPoints,
+                                                                        SizeValueType numberOfPoints) const
+{
+  if (numberOfPoints == 0)
+  {
+    return;
+  }
+  if (m_Transform == nullptr)
+  {
+    itkExceptionMacro(<< "The transform is not set.");
+  }
+
+  const SizeValueType numberOfBlocks = (numberOfPoints + m_BlockSize - 1) / m_BlockSize;
+  auto                transformBlock = [&](SizeValueType block) {
+    const SizeValueType first = block * m_BlockSize;
+    const SizeValueType count = std::min(m_BlockSize, numberOfPoints - first);
+    std::vector<double> coordinates(points + first * VDimension, points + (first + count) * VDimension);
+
+    // each step goes over the whole block, so its loop stays free of dispatch
+    for (const Step & step : m_Steps)
+    {
+      double * p = coordinates.data();
+      switch (step.Kind)
+      {
+        case StepEnum::Affine:
+          for (SizeValueType i = 0; i < count; ++i, p += VDimension)
+          {
+            double mapped[VDimension];
+            for (unsigned int r = 0; r < VDimension; ++r)
+            {
+              mapped[r] = step.Offset[r];
+              for (unsigned int c = 0; c < VDimension; ++c)
+              {
+                mapped[r] += step.Linear[r][c] * p[c];
+              }
+            }
+            std::copy(mapped, mapped + VDimension, p);
+          }
+          break;
+        case StepEnum::DisplacementField:
+          for (SizeValueType i = 0; i < count; ++i, p += VDimension)
+          {
+            Self::DisplacePoint(step, p);
+          }
+          break;
+        case StepEnum::Generic:
+          for (SizeValueType i = 0; i < count; ++i, p += VDimension)
+          {
+            typename TransformType::InputPointType point;
+            for (unsigned int d = 0; d < VDimension; ++d)
+            {
+              point[d] = static_cast<ParametersValueType>(p[d]);
+            }
+            const auto mapped = step.Transform->TransformPoint(point);
+            for (unsigned int d = 0; d < VDimension; ++d)
+            {
+              p[d] = mapped[d];
+            }
+          }
+          break;
+      }
+    }
+
+    std::transform(coordinates.begin(),
+                   coordinates.end(),
+                   transformedPoints + first * VDimension,
+                   [](double coordinate) { return static_cast<ParametersValueType>(coordinate); });
+  };
+  MultiThreaderBase::New()->ParallelizeArray(0, numberOfBlocks, transformBlock, nullptr);
+}
+
+
+template <typename TParametersValueType, unsigned int VDimension>
+auto
+ANTSPointTransformer<TParametersValueType, VDimension>::TransformPoints(
+  const std::vector<ParametersValueType> & points) const -> std::vector<ParametersValueType>
+{
+  if (points.size() % VDimension != 0)
+  {
+    itkExceptionMacro(<< "The number of coordinates, " << points.size() << ", is not a multiple of the dimension "
+                      << VDimension << ".");
+  }
+  std::vector<ParametersValueType> transformedPoints(points.size());
+  this->TransformPoints(points.data(), transformedPoints.data(), points.size() / VDimension);
+  return transformedPoints;
+}
+
+} // end namespace itk
+
+#endif // itkANTSPointTransformer_hxx
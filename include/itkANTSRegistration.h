@@ -22,8 +22,18 @@
 #include "itkImage.h"
 #include "itkCompositeTransform.h"
 #include "itkDataObjectDecorator.h"
+#include "itkImageMaskSpatialObject.h"
+#include "itkANTSPointTransformer.h"
+#include "itkANTSRegistrationProfile.h"
+#include "itkANTSStreamingResampleImageFilter.h"
+#include "itkANTSWarpImageFilter.h"
 #include "itkantsRegistrationHelper.h"
 #include "itkDisplacementFieldTransformParametersAdaptor.h"
+#include "itkMultiThreaderBase.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
 
 namespace itk
 {
@@ -37,6 +47,12 @@ namespace itk
  * There will be as many pyramid levels as there are elements in the iteration array.
  * Number of elements in shrink factor and smoothing sigma arrays (if provided) must match.
  *
+ * TParametersValueType is also the pixel type of the images and of the displacement and velocity fields
+ * which the deformable stages allocate, and these fields dominate the peak memory of 3D registrations.
+ * Using float instead of double roughly halves that peak (see the --precision option of ANTsWasmBenchmarks).
+ * The fields which the ANTs helper allocates during a stage are in the type it computes with, but the ones
+ * which this filter keeps itself can be stored in float while computing in double, see StoreFieldsInFloat.
+ *
  * \ingroup ANTsWasm
  * \ingroup Registration
  *
@@ -62,6 +78,9 @@ public:
   using OutputTransformType = CompositeTransformType;
   using DecoratedInitialTransformType = DataObjectDecorator<InitialTransformType>;
   using DecoratedOutputTransformType = DataObjectDecorator<OutputTransformType>;
+  using OutputDisplacementFieldType = Image<Vector<TParametersValueType, ImageDimension>, ImageDimension>;
+  using RegistrationHelperType = ::ants::RegistrationHelper<TParametersValueType, FixedImageType::ImageDimension>;
+  using InternalImageType = typename RegistrationHelperType::ImageType; // float or double pixels
 
   /** Standard class aliases. */
   using Self = ANTSRegistration<FixedImageType, MovingImageType, ParametersValueType>;
@@ -88,7 +107,8 @@ public:
   GetMovingImage() const;
 
   /** Get the moving image resampled onto fixed image grid.
-   * Available after a call to Update(). Computationally expensive. */
+   * Available after a call to Update(). Computationally expensive.
+   * With UseDisplacementFieldWarping, it resamples through GetForwardDisplacementField(). */
   virtual typename MovingImageType::Pointer
   GetWarpedMovingImage() const;
 
@@ -98,18 +118,99 @@ public:
   virtual typename FixedImageType::Pointer
   GetWarpedFixedImage() const;
 
+  /** Write the moving image resampled onto the fixed image grid to a file, in NumberOfWarpStreamDivisions slabs.
+   * Each slab requests only the region of the moving image which it maps into, so neither the output nor
+   * a moving image read by a streaming ImageFileReader is ever buffered as a whole.
+   * The moving image may be replaced by another image in the same physical space, e.g. the full resolution
+   * volume which was downsampled for the registration, and the grid of the output by the one of referenceImage.
+   * Streamed writing needs a format which supports it, like MetaImage or NRRD without compression;
+   * other formats are written in one piece. UseDisplacementFieldWarping is ignored, because the dense field
+   * is as large as the output. Available after a call to Update(). */
+  virtual void
+  WriteWarpedMovingImage(const std::string &               fileName,
+                         const MovingImageType *           movingImage = nullptr,
+                         const ImageBase<ImageDimension> * referenceImage = nullptr) const;
+
+  /** Write the fixed image resampled onto the moving image grid to a file, in NumberOfWarpStreamDivisions slabs,
+   * like WriteWarpedMovingImage(). This method raises an exception if inverse transform is not available. */
+  virtual void
+  WriteWarpedFixedImage(const std::string &               fileName,
+                        const FixedImageType *            fixedImage = nullptr,
+                        const ImageBase<ImageDimension> * referenceImage = nullptr) const;
+
+  /** Set/Get the number of slabs written by WriteWarpedMovingImage() and WriteWarpedFixedImage(). Default is 8.
+   * Peak memory is roughly the size of the output and the input divided by this number. */
+  itkSetClampMacro(NumberOfWarpStreamDivisions, unsigned int, 1, NumericTraits<unsigned int>::max());
+  itkGetMacro(NumberOfWarpStreamDivisions, unsigned int);
+
   /** Set/get the fixed image's mask. */
   virtual void
   SetFixedMask(const LabelImageType * mask);
   virtual const LabelImageType *
   GetFixedMask() const;
 
+  using MaskSpatialObjectType = ImageMaskSpatialObject<ImageDimension>;
+
+  /** Wraps the mask into a spatial object, whose bounding box is computed only once. */
+  static typename MaskSpatialObjectType::Pointer
+  MakeMaskSpatialObject(const LabelImageType * mask);
+
+  /** Converts the image into the pixel type used by the ANTs helper.
+   * When TImage already is InternalImageType, the returned image shares the input's buffer. */
+  template <typename TImage>
+  static typename InternalImageType::Pointer
+  CastImageToInternalType(const TImage * inputImage);
+
+  /** Returns how many registrations ANTSBatchRegistration and ANTSMotionCorrection run at the same time
+   * when their NumberOfConcurrentRegistrations is zero. The Platform multithreader starts ITK's global default
+   * number of threads in every parallel section, so it is then one. With a thread pool, the parallel sections
+   * of all the registrations share the pool, and it is half of the pool's threads: enough for the serial parts
+   * of some registrations to overlap the parallel sections of others, while each registration's images
+   * and pyramids are held only for that many registrations at a time. */
+  static unsigned int
+  GetDefaultNumberOfConcurrentRegistrations();
+
+  /** Set/get a spatial object made by MakeMaskSpatialObject() from the fixed mask.
+   * When it wraps the current fixed mask, Update() uses it instead of making its own,
+   * so registrations sharing a fixed mask can share its spatial object too. It is only read. */
+  itkSetObjectMacro(FixedMaskSpatialObject, MaskSpatialObjectType);
+  itkGetModifiableObjectMacro(FixedMaskSpatialObject, MaskSpatialObjectType);
+
   /** Set/get the moving image's mask. */
   virtual void
   SetMovingMask(const LabelImageType * mask);
   virtual const LabelImageType *
   GetMovingMask() const;
 
+  /** Adds a pair of images which is registered jointly with the fixed and moving images, e.g. T2 alongside T1,
+   * or label distance maps alongside the intensities. Each stage adds the channels' metrics to its own,
+   * in the same virtual domain (the fixed image's) and with the same pyramid, masks and sampling.
+   * The metric's value is weighted by weight (the fixed and moving images have weight 1).
+   * An empty metric means the stage's metric (AffineMetric or SynMetric). The initialization only uses
+   * the fixed and moving images. */
+  virtual void
+  AddChannel(const FixedImageType *  fixedImage,
+             const MovingImageType * movingImage,
+             double                  weight = 1.0,
+             const std::string &     metric = "");
+
+  /** Removes all the channels added by AddChannel(). */
+  virtual void
+  ClearChannels();
+
+  /** Returns the number of channels added by AddChannel(). */
+  unsigned int
+  GetNumberOfChannels() const
+  {
+    return static_cast<unsigned int>(m_Channels.size());
+  }
+
+  /** Returns the images of the i-th channel. */
+  virtual const FixedImageType *
+  GetChannelFixedImage(unsigned int i) const;
+  virtual const MovingImageType *
+  GetChannelMovingImage(unsigned int i) const;
+
   /** Set the type of transformation to be optimized. A setting defines
    * a set of transformation parameterizations that are optimized,
    * the similarity metric used, and optimization parameters.
@@ -124,6 +225,10 @@ public:
    * - "SyN": Symmetric normalization: Affine + deformable transformation, with mutual information as optimization
    * metric.
    * - "SyNCC": SyN, but with cross-correlation as the metric.
+   * - "BSpline": a single B-spline (free-form deformation) stage, see BSplineKnotSpacing.
+   * - "BSplineSyN": a single SyN stage whose update (and optionally total) fields are B-spline smoothed.
+   *   Far fewer degrees of freedom than the dense fields of "SyN", hence faster.
+   * - "BSplineDisplacementField": a single displacement field stage with B-spline smoothed fields.
    */
   itkSetStringMacro(TypeOfTransform);
   itkGetStringMacro(TypeOfTransform);
@@ -149,11 +254,61 @@ public:
   itkSetStringMacro(SynMetric);
   itkGetStringMacro(SynMetric);
 
+  /** The strategy used to pick the points where the metric of the linear stages is evaluated:
+   * "None": all the voxels of the fixed image, SamplingRate is ignored.
+   * "Regular" (default): a regular grid with SamplingRate of the voxels, each point randomly moved within its cell.
+   * "Random": SamplingRate of the voxels, drawn at random.
+   * "Stratified": like "Regular", but when the stage uses a fixed mask, the grid is made denser so that
+   *   SamplingRate of the mask's voxels (rather than of the image's) are sampled.
+   *   This makes low sampling rates (a few percent) usable with small masks.
+   * The points are drawn once per pyramid level, and reused by all its iterations. */
+  itkSetStringMacro(AffineSamplingStrategy);
+  itkGetStringMacro(AffineSamplingStrategy);
+
+  /** The sampling strategy of the deformable stages. Same values as AffineSamplingStrategy. Default is "Regular". */
+  itkSetStringMacro(SynSamplingStrategy);
+  itkGetStringMacro(SynSamplingStrategy);
+
   /** Set/Get the initial transform.
    * It transforms points from the fixed image to the moving image reference frame.
    * It is typically used to resample the moving image onto the fixed image grid. */
   itkSetGetDecoratedObjectInputMacro(InitialTransform, InitialTransformType);
 
+  /** Set/Get a previous registration result to continue from, e.g. the result for the previous time point
+   * of a longitudinal series. When set, it replaces the initial transform and the initialization.
+   * Its leading linear transforms are the starting point of the linear stages, and its deformable transforms
+   * (with their inverse fields) are resumed by the first deformable stage, which only optimizes the remaining
+   * deformation. Without a deformable stage, only the linear transforms are used.
+   * Merging the refinements into the warm-start transforms requires CollapseCompositeTransform. */
+  itkSetGetDecoratedObjectInputMacro(WarmStartTransform, InitialTransformType);
+
+  /** Set/Get how many of the coarsest pyramid levels are skipped by each stage when a warm-start transform
+   * is set, as the registration it comes from already converged at those levels.
+   * The finest level is always run. Default is 0. */
+  itkSetMacro(WarmStartLevelsToSkip, unsigned int);
+  itkGetMacro(WarmStartLevelsToSkip, unsigned int);
+
+  /** Set/Get how the registration is initialized when no initial transform is set:
+   * "None" (default): from the identity.
+   * "Moments": the centers of mass are aligned, and the principal axes too if that matches the images better.
+   * "MultiStart": like "Moments", followed by a search over a grid of rotations (2D and 3D only),
+   *   around both alignments, up to MultiStartMaxAngle in steps of MultiStartAngleStep about each axis.
+   *   The candidates are compared in parallel with the mutual information of the images
+   *   at the coarsest pyramid level, and the best one is the initial transform of the first stage.
+   * The initialization appears in the registration profile, and is cached like a stage. */
+  itkSetStringMacro(Initialization);
+  itkGetStringMacro(Initialization);
+
+  /** Set/Get the largest rotation about each axis searched by the "MultiStart" initialization, in degrees.
+   * Default is 45. */
+  itkSetClampMacro(MultiStartMaxAngle, double, 0.0, 180.0);
+  itkGetMacro(MultiStartMaxAngle, double);
+
+  /** Set/Get the step between the rotations searched by the "MultiStart" initialization, in degrees.
+   * Default is 15. */
+  itkSetClampMacro(MultiStartAngleStep, double, 1.0, 180.0);
+  itkGetMacro(MultiStartAngleStep, double);
+
   /** Returns the transform resulting from the registration process  */
   virtual const OutputTransformType *
   GetForwardTransform() const
@@ -161,13 +316,63 @@ public:
     return this->GetOutput(0)->Get();
   }
 
-  /** Returns the inverse transform resulting from the registration process, if available  */
+  /** Returns the inverse transform resulting from the registration process, if available.
+   * The inverse is computed on the first access to it (or to output 1) after Update().
+   * Several threads may call it at the same time, but not while Update() runs. */
   virtual const OutputTransformType *
   GetInverseTransform() const
   {
     return this->GetOutput(1)->Get();
   }
 
+  /** Returns the forward transform composed into one dense displacement field on the fixed image grid.
+   * It is output 2, computed in parallel on first access after Update(), and kept until the next Update().
+   * Like GetInverseTransform(), several threads may call it at the same time.
+   * Resampling through it costs the same regardless of how many transforms the forward transform holds. */
+  virtual const OutputDisplacementFieldType *
+  GetForwardDisplacementField() const;
+
+  /** Filter which warps images from the moving image's space onto the fixed image grid. */
+  using WarpImageFilterType = ANTSWarpImageFilter<MovingImageType, MovingImageType, OutputDisplacementFieldType>;
+  using InterpolationEnum = typename WarpImageFilterType::InterpolationEnum;
+
+  /** Returns a warp filter set up with the forward displacement field. Add the images to warp with
+   * AddInput(image, interpolation), each with its own interpolation, and Update() it once:
+   * the mapping of each fixed voxel is then computed once for all of them.
+   * Available after a call to Update(). */
+  virtual typename WarpImageFilterType::Pointer
+  MakeWarpImageFilter() const;
+
+  using PointTransformerType = ANTSPointTransformer<ParametersValueType, ImageDimension>;
+
+  /** Returns a point transformer set up with the forward transform, which maps points of the fixed image
+   * into the moving image, or with the inverse transform. Keep it to transform several arrays of points.
+   * Available after a call to Update(). */
+  virtual typename PointTransformerType::Pointer
+  MakePointTransformer(bool inverse = false) const;
+
+  /** Transforms numberOfPoints points, whose coordinates are stored contiguously (x0 y0 [z0] x1 y1 [z1] ...),
+   * in parallel, with the forward transform or with the inverse transform. Much faster than calling
+   * TransformPoint() of GetForwardTransform() for each point, especially for linear transforms.
+   * Available after a call to Update(). */
+  virtual void
+  TransformPoints(const ParametersValueType * points,
+                  ParametersValueType *       transformedPoints,
+                  SizeValueType               numberOfPoints,
+                  bool                        inverse = false) const;
+
+  /** Same, with the coordinates in a vector. From Python, a NumPy array of shape (n, ImageDimension)
+   * can be passed flattened. */
+  virtual std::vector<ParametersValueType>
+  TransformPoints(const std::vector<ParametersValueType> & points, bool inverse = false) const;
+
+  /** Set/Get whether GetWarpedMovingImage() resamples through the dense forward displacement field,
+   * instead of evaluating the composite transform at each voxel. Off by default.
+   * Worthwhile when several images are warped with the same registration, or for deformable transforms. */
+  itkSetMacro(UseDisplacementFieldWarping, bool);
+  itkGetMacro(UseDisplacementFieldWarping, bool);
+  itkBooleanMacro(UseDisplacementFieldWarping);
+
   /** Set/Get the gradient step size for transform optimizers that use it. */
   itkSetMacro(GradientStep, ParametersValueType);
   itkGetMacro(GradientStep, ParametersValueType);
@@ -182,6 +387,22 @@ public:
   itkSetMacro(TotalSigma, ParametersValueType);
   itkGetMacro(TotalSigma, ParametersValueType);
 
+  /** Set/Get the knot spacing of the B-spline transform types, in physical units, at the coarsest level.
+   * The mesh is computed from it on the fixed image, and the ANTs helper doubles it at each finer level.
+   * For "BSplineSyN" and "BSplineDisplacementField", this is the mesh of the update field. Default is 26. */
+  itkSetClampMacro(BSplineKnotSpacing, ParametersValueType, 1e-3, NumericTraits<ParametersValueType>::max());
+  itkGetMacro(BSplineKnotSpacing, ParametersValueType);
+
+  /** Set/Get the knot spacing of the total field of "BSplineSyN" and "BSplineDisplacementField",
+   * at the coarsest level. Zero (default) leaves the total field unsmoothed. */
+  itkSetClampMacro(BSplineTotalFieldKnotSpacing, ParametersValueType, 0.0, NumericTraits<ParametersValueType>::max());
+  itkGetMacro(BSplineTotalFieldKnotSpacing, ParametersValueType);
+
+  /** Set/Get the order of the B-splines of "BSplineSyN" and "BSplineDisplacementField". Default is 3.
+   * The ANTs helper always uses cubic B-splines for "BSpline". */
+  itkSetClampMacro(BSplineOrder, unsigned int, 1, 5);
+  itkGetMacro(BSplineOrder, unsigned int);
+
   /** Set/Get randomg sampling percentage for estimaging the metric.
    * It is normalized to 0.0-1.0 range.
    * This can impact speed but also reproducibility and/or accuracy. */
@@ -192,11 +413,92 @@ public:
   itkSetClampMacro(NumberOfBins, int, 5, NumericTraits<int>::max());
   itkGetMacro(NumberOfBins, int);
 
+  /** Set/Get the wall-clock time budget of Update(), in seconds. Zero (default) means no limit.
+   * Each stage gets a share of the time left, in proportion to its estimated work (see EstimateStageWork()),
+   * so time saved by a stage goes to the later ones. With a budget, linear stages run one pyramid level
+   * at a time, like with AdaptiveIterations, and a level gets a share of its stage's time.
+   * The budget is checked before each stage or level and after each optimizer iteration. When a share
+   * runs out, its stage or level is stopped, and the registration continues from the last completed
+   * level of a linear stage. A deformable stage runs all its levels in one go and the helper does not
+   * return a stopped stage's fields, so an interrupted deformable stage is discarded entirely: the result
+   * is that of the stages before it. Truncated is then set. AbortGenerateData() is honored at the same
+   * points, and stops Update() with a ProcessAborted exception. */
+  itkSetClampMacro(TimeBudget, double, 0.0, NumericTraits<double>::max());
+  itkGetMacro(TimeBudget, double);
+
+  /** Returns whether the last Update() ran out of its time budget before completing all the stages. */
+  itkGetMacro(Truncated, bool);
+
+  /** Set/Get the file to which the result so far is checkpointed after each completed stage.
+   * Empty (default) means no checkpoints.
+   * The composite transform is written with ITK's transform IO, so deformable stages need a format
+   * which stores displacement fields, like HDF5 (".h5"). Transform IO does not store the inverse fields
+   * of SyN-like stages, so they are written to "<name>.inverse<extension>", e.g. "checkpoint.inverse.h5".
+   * A sidecar "<CheckpointFileName>.json" lists the completed stages. All the files are written
+   * to temporary files which are then renamed, so a pre-empted Update() leaves the last complete checkpoint behind.
+   * The transforms are renamed before the sidecar, so they may hold a stage more than it lists, which is run again. */
+  itkSetStringMacro(CheckpointFileName);
+  itkGetStringMacro(CheckpointFileName);
+
+  /** Set/Get whether Update() resumes from the checkpoint in CheckpointFileName, if there is one.
+   * The completed stages whose inputs and parameters match the checkpoint are not run again, and are marked
+   * as reused in the registration profile. The first stage which does not match, and all the later ones, are run.
+   * The helper does not expose its optimizers' state, so a stage stopped midway starts over.
+   * The inverse fields of resumed deformable stages are read back, so GetInverseTransform() is available;
+   * if their file is missing or does not match the checkpoint, a warning is issued and it is not.
+   * Default is off. */
+  itkSetMacro(ResumeFromCheckpoint, bool);
+  itkGetMacro(ResumeFromCheckpoint, bool);
+  itkBooleanMacro(ResumeFromCheckpoint);
+
+  /** Returns an estimate of the peak memory of Update() in bytes, from the sizes of the inputs, TypeOfTransform,
+   * ShrinkFactors, DisplacementFieldSubsamplingFactor, CacheStageResults and the precision (ParametersValueType).
+   * It counts the inputs and their copies in the internal pixel type, the pyramid images and the fields which
+   * the deformable stages allocate, ignoring crops, so it errs on the high side.
+   * The inputs' information must be available, e.g. after their UpdateOutputInformation(). */
+  virtual SizeValueType
+  EstimatePeakMemory() const
+  {
+    return this->EstimatePeakMemory(1, m_CacheStageResults);
+  }
+
+  /** Set/Get the memory budget of Update() in bytes. Zero (default) means no limit.
+   * When the estimated peak memory exceeds the budget, the stage cache is not kept by this Update(),
+   * then the deformable stages' fields are coarsened by raising their shrink factors, up to the coarsest
+   * of ShrinkFactors. If the estimate still exceeds the budget, Update() throws before registering. */
+  itkSetMacro(MemoryBudget, SizeValueType);
+  itkGetMacro(MemoryBudget, SizeValueType);
+
+  /** Returns the smallest shrink factor of the deformable stages of the last Update(), as raised by MemoryBudget. */
+  itkGetMacro(MemoryBudgetShrinkFactor, unsigned int);
+
+  /** Returns the file name with a suffix inserted before its extension, e.g. "checkpoint.3.h5".
+   * Used to give each registration of a batch its own checkpoint. */
+  static std::string
+  MakeCheckpointFileName(const std::string & fileName, const std::string & suffix);
+
   /** Set/Get a random seed to improve reproducibility.
-   * Note: ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS should be 1 for full reproducibility. */
+   * Note: the result also depends on the number of threads, see Deterministic. */
   itkSetMacro(RandomSeed, int);
   itkGetMacro(RandomSeed, int);
 
+  /** Set/Get whether the metrics' sample points are drawn from a fixed seed when RandomSeed is 0.
+   * This makes repeated runs reproducible, but only with the same global default number of threads:
+   * the metrics which the ANTs helper creates split their values and gradients into as many work units
+   * as ITK's global default number of threads, and the sum depends on that split. This filter does not
+   * change that process-wide setting, see RequiredGlobalNumberOfThreads. Default is off. */
+  itkSetMacro(Deterministic, bool);
+  itkGetMacro(Deterministic, bool);
+  itkBooleanMacro(Deterministic);
+
+  /** Set/Get the global default number of threads which Update() requires.
+   * When it is not zero, Update() throws if ITK's global default number of threads differs, e.g. to make sure
+   * that a reproducible run is not silently different. Set the number of threads itself with
+   * MultiThreaderBase::SetGlobalDefaultNumberOfThreads() or the ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS
+   * environment variable. Zero (default) means any number of threads is accepted. */
+  itkSetClampMacro(RequiredGlobalNumberOfThreads, unsigned int, 0, ITK_MAX_THREADS);
+  itkGetMacro(RequiredGlobalNumberOfThreads, unsigned int);
+
   /** Set/Get radius used by neighborhood normalized cross correlation ("CC") metric. */
   itkSetMacro(Radius, unsigned int);
   itkGetMacro(Radius, unsigned int);
@@ -218,6 +520,32 @@ public:
   itkSetMacro(MaskAllStages, bool);
   itkGetMacro(MaskAllStages, bool);
 
+  /** Set/Get whether the fixed and moving images are cropped to the bounding boxes of their masks,
+   * enlarged by CropMargin, before the registration. All the stages then work on the cropped images,
+   * so smaller pyramids and displacement fields are used. The transforms are still expressed in physical
+   * space, and deformable ones have no displacement outside of the cropped fixed domain.
+   * An image without a mask, or whose mask is empty, is not cropped. Default is off. */
+  itkSetMacro(CropToMasks, bool);
+  itkGetMacro(CropToMasks, bool);
+  itkBooleanMacro(CropToMasks);
+
+  /** Set/Get the margin added around the masks' bounding boxes when cropping, in physical units. Default is 10. */
+  itkSetClampMacro(CropMargin, ParametersValueType, 0.0, NumericTraits<ParametersValueType>::max());
+  itkGetMacro(CropMargin, ParametersValueType);
+
+  /** Set/Get whether the deformable stages (SyN, Gaussian displacement field and time-varying velocity field)
+   * only evaluate the metric in a band around the fixed mask: the mask dilated by SparseSyNBandWidth.
+   * These stages also work on a fixed domain cropped to the band plus SparseSyNBandWidth,
+   * where the field is carried outside of the band by the regularizing smoothing only.
+   * This mode needs a fixed mask, and does not affect the linear stages. Default is off. */
+  itkSetMacro(SparseSyN, bool);
+  itkGetMacro(SparseSyN, bool);
+  itkBooleanMacro(SparseSyN);
+
+  /** Set/Get the width of the sparse SyN band around the fixed mask, in physical units. Default is 10. */
+  itkSetClampMacro(SparseSyNBandWidth, ParametersValueType, 0.0, NumericTraits<ParametersValueType>::max());
+  itkGetMacro(SparseSyNBandWidth, ParametersValueType);
+
   /** Set/Get number of iterations for each pyramid level for SyN transforms.
    * Shrink factors and smoothing sigmas for SyN are determined based on iterations. */
   itkSetMacro(SynIterations, std::vector<unsigned int>);
@@ -238,6 +566,27 @@ public:
   itkSetMacro(SmoothingSigmas, std::vector<float>);
   itkGetConstReferenceMacro(SmoothingSigmas, std::vector<float>);
 
+  /** Set/Get the number of iterations over which the convergence of a pyramid level is assessed. Default is 10.
+   * A level stops before its number of iterations once the slope of its normalized metric values,
+   * over that many iterations, falls below ConvergenceThreshold. */
+  itkSetClampMacro(ConvergenceWindowSize, unsigned int, 1, NumericTraits<unsigned int>::max());
+  itkGetMacro(ConvergenceWindowSize, unsigned int);
+
+  /** Set/Get the convergence threshold of all the pyramid levels. Default is 1e-6.
+   * Larger values stop plateauing levels sooner. */
+  itkSetMacro(ConvergenceThreshold, ParametersValueType);
+  itkGetMacro(ConvergenceThreshold, ParametersValueType);
+
+  /** Set/Get whether the pyramid levels of the linear stages are scheduled adaptively. Default is off.
+   * Each level is then run on its own, and stops on convergence as usual. The iterations which a level
+   * leaves unused, weighted by their cost relative to the next levels' (the ratio of voxel counts),
+   * are added to the next non-empty level, which uses them only if it does not converge sooner.
+   * The levels are then merged back into their stage: its registration profile entry lists each level
+   * with its iteration limit, and the levels' transforms are composed into the stage's single transform. */
+  itkSetMacro(AdaptiveIterations, bool);
+  itkGetMacro(AdaptiveIterations, bool);
+  itkBooleanMacro(AdaptiveIterations);
+
   /** Set/Get the optimizer weights. When set, this allows restricting the optimization
    * of the displacement field, translation, rigid or affine transform on a per-component basis.
    * For example, to limit the deformation or rotation of 3-D volume to the first two dimensions,
@@ -252,6 +601,57 @@ public:
   itkSetMacro(DisplacementFieldSubsamplingFactor, unsigned int);
   itkGetMacro(DisplacementFieldSubsamplingFactor, unsigned int);
 
+  /** Set/Get whether the inverse transform is made available. On by default.
+   * Even when on, it is only computed when first requested.
+   * When off, GetInverseTransform() returns nullptr, and GetWarpedFixedImage() throws. */
+  itkSetMacro(ComputeInverseTransform, bool);
+  itkGetMacro(ComputeInverseTransform, bool);
+  itkBooleanMacro(ComputeInverseTransform);
+
+  /** Set/Get whether the result of each stage is kept, to be reused by the next Update().
+   * A stage is reused when the inputs it depends on are unmodified, its parameters are unchanged,
+   * and all the stages before it were reused too. For example, tuning SynIterations or FlowSigma
+   * of "SyN" then only reruns the deformable stage. Off by default, because the cache holds
+   * one composite transform per stage, including the displacement fields. */
+  itkSetMacro(CacheStageResults, bool);
+  itkGetMacro(CacheStageResults, bool);
+  itkBooleanMacro(CacheStageResults);
+
+  /** Set/Get whether the displacement fields which this filter keeps besides its outputs are stored in float
+   * when ParametersValueType is double: the forward and inverse fields of the stage cache, and the inverse
+   * fields of the checkpoint. Without it, the cache holds a second copy of the result's fields in double.
+   * The stages still compute in ParametersValueType, and reused fields are converted back to it, so they
+   * differ from the computed ones by float's rounding. The outputs, including the dense displacement field,
+   * keep ParametersValueType. Off by default. */
+  itkSetMacro(StoreFieldsInFloat, bool);
+  itkGetMacro(StoreFieldsInFloat, bool);
+  itkBooleanMacro(StoreFieldsInFloat);
+
+  /** Releases the results kept by CacheStageResults, so the next Update() runs all the stages. */
+  virtual void
+  ClearStageCache()
+  {
+    m_StageCache.clear();
+  }
+
+  /** Telemetry of the last Update(): for each stage and each of its pyramid levels,
+   * wall time, iterations executed, final metric and convergence values, and peak resident memory. */
+  using RegistrationProfileType = ANTSRegistrationProfile;
+  virtual const RegistrationProfileType &
+  GetRegistrationProfile() const
+  {
+    return m_RegistrationProfile;
+  }
+
+  /** Returns the registration profile formatted as JSON. Convenient from Python. */
+  virtual std::string
+  GetRegistrationProfileJSON() const
+  {
+    std::ostringstream os;
+    WriteANTSRegistrationProfileJSON(m_RegistrationProfile, os);
+    return os.str();
+  }
+
   virtual DecoratedOutputTransformType *
   GetOutput(DataObjectPointerArraySizeType i);
   virtual const DecoratedOutputTransformType *
@@ -282,6 +682,11 @@ public:
   virtual void
   SetInput(unsigned index, const FixedImageType * image);
 
+  /** Copies all the registration parameters, but none of the inputs, from another registration object.
+   * The other object may have different image types, but must use the same parameters value type. */
+  template <typename TOtherFixedImage, typename TOtherMovingImage>
+  void
+  CopyParameters(const ANTSRegistration<TOtherFixedImage, TOtherMovingImage, TParametersValueType> * other);
 
 protected:
   ANTSRegistration();
@@ -291,26 +696,216 @@ protected:
   using DataObjectPointerArraySizeType = ProcessObject::DataObjectPointerArraySizeType;
   using Superclass::MakeOutput;
   DataObjectPointer MakeOutput(DataObjectPointerArraySizeType) override;
-  using RegistrationHelperType = ::ants::RegistrationHelper<TParametersValueType, FixedImageType::ImageDimension>;
-  using InternalImageType = typename RegistrationHelperType::ImageType; // float or double pixels
   using DisplacementFieldTransformType = typename RegistrationHelperType::DisplacementFieldTransformType;
   using DisplacementFieldType = typename DisplacementFieldTransformType::DisplacementFieldType;
   using DisplacementFieldTransformParametersAdaptorType =
     DisplacementFieldTransformParametersAdaptor<DisplacementFieldTransformType>;
 
-  template <typename TImage>
-  typename InternalImageType::Pointer
-  CastImageToInternalType(const TImage *);
+  /** Inputs converted once per Update() and shared by all the stages of a composite transform type.
+   * The ANTs helper is recreated for every stage, so anything derived from the inputs
+   * which does not depend on the stage's parameters belongs here. */
+  struct StageInputs
+  {
+    typename InternalImageType::Pointer     FixedImage;
+    typename InternalImageType::Pointer     MovingImage;
+    typename MaskSpatialObjectType::Pointer FixedMask;
+    typename MaskSpatialObjectType::Pointer MovingMask;
+    typename InternalImageType::Pointer     BandFixedImage; // fixed domain of the sparse SyN stages
+    typename MaskSpatialObjectType::Pointer BandFixedMask;
+    double                                  FixedMaskFraction{ 1.0 }; // fraction of the fixed domain in the mask
+    double                                  BandFixedMaskFraction{ 1.0 };
+
+    // images of the channels, cropped like the fixed and moving images
+    std::vector<typename InternalImageType::Pointer> ChannelFixedImages;
+    std::vector<typename InternalImageType::Pointer> BandChannelFixedImages;
+    std::vector<typename InternalImageType::Pointer> ChannelMovingImages;
+  };
+
+  /** Returns the image cropped to the mask's bounding box enlarged by margin, in physical units.
+   * The image itself is returned if the mask is empty or covers the whole image. */
+  static typename InternalImageType::Pointer
+  CropToMask(InternalImageType * image, const MaskSpatialObjectType * mask, ParametersValueType margin);
+
+  /** Returns the mask's foreground dilated by a ball of the given radius, in physical units. */
+  static typename LabelImageType::Pointer
+  MakeMaskBand(const LabelImageType * mask, ParametersValueType radius);
+
+  /** Returns the fraction of the image's physical extent covered by the mask's foreground, at most 1. */
+  static double
+  ComputeMaskFraction(const MaskSpatialObjectType * mask, const InternalImageType * image);
 
   void
   PrintSelf(std::ostream & os, Indent indent) const override;
 
-  /** Returns true if registration was successful. */
+  /** Human-readable name of a transform type, used in the registration profile. */
+  static std::string
+  XfrmMethodToString(typename RegistrationHelperType::XfrmMethod xfrmMethod);
+
+  /** Identifies a stage's result: the key of the previous stage (or the initial transform),
+   * the modification times of the inputs, and the parameters used by this stage. */
+  std::string
+  MakeStageKey(typename RegistrationHelperType::XfrmMethod xfrmMethod,
+               const InitialTransformType *                initialTransform,
+               bool                                        useMasks,
+               unsigned                                    nTimeSteps) const;
+
+  /** The part of a stage's key which depends on the parameters used by this stage. */
+  std::string
+  MakeStageParametersKey(typename RegistrationHelperType::XfrmMethod xfrmMethod, unsigned nTimeSteps) const;
+
+  /** Identifies a stage's result across processes, unlike MakeStageKey(): the key of the previous checkpointed
+   * stage (or the contents of the initial transform), the contents of the inputs and the stage's parameters. */
+  std::string
+  MakeCheckpointKey(typename RegistrationHelperType::XfrmMethod xfrmMethod,
+                    const InitialTransformType *                initialTransform,
+                    bool                                        useMasks,
+                    unsigned                                    nTimeSteps) const;
+
+  /** Returns the key of the contents of the input images and masks. */
+  std::string
+  MakeCheckpointInputsKey() const;
+
+  /** Estimates the peak memory with the given minimum shrink factor of the deformable stages. */
+  SizeValueType
+  EstimatePeakMemory(unsigned int deformableShrinkFactor, bool cachingStages) const;
+
+  /** Returns the stages run for TypeOfTransform, and the number of time points of "TV[n]". */
+  std::vector<typename RegistrationHelperType::XfrmMethod>
+  GetStageTransforms(unsigned int & nTimeSteps) const;
+
+  /** Returns about how many full-size vector fields a stage allocates at its finest level, 0 for linear stages. */
+  static unsigned int
+  GetNumberOfStageFields(typename RegistrationHelperType::XfrmMethod xfrmMethod, unsigned int nTimeSteps);
+
+  /** Chooses whether to keep the stage cache, and the deformable shrink factor, to stay within the memory budget. */
   void
+  ApplyMemoryBudget();
+
+  /** FNV-1a hash of a buffer, which can be chained through the initial hash. */
+  static std::uint64_t
+  HashBytes(const void * data, std::size_t size, std::uint64_t hash = 14695981039346656037ULL);
+
+  /** Appends the geometry and a hash of the pixels of an image to a key. */
+  template <typename TImage>
+  static void
+  AppendImageKey(std::ostream & key, const TImage * image);
+
+  /** Appends the type and a hash of the parameters of each transform to a key. */
+  static void
+  AppendTransformKey(std::ostream & key, const InitialTransformType * transform);
+
+  /** Appends a transform to a composite transform, flattening nested composite transforms. */
+  static void
+  FlattenTransform(const InitialTransformType * transform, OutputTransformType * flatTransform);
+
+  /** Returns the field converted to another vector type, or the field itself if its type is the same. */
+  template <typename TOutputField, typename TInputField>
+  static typename TOutputField::Pointer
+  CastField(const TInputField * field);
+
+  /** Returns the transform of a stage cache entry, converting its stored fields back if needed. */
+  typename OutputTransformType::Pointer
+  GetCachedTransform(unsigned int stageIndex);
+
+  /** Stores the fields of the stage cache's transforms in float, see StoreFieldsInFloat. */
+  void
+  ReduceStageCache();
+
+  /** Writes the inverse fields of a flat transform, with TFieldValue fields, returns false if it has none. */
+  template <typename TFieldValue>
+  bool
+  WriteCheckpointInverseFields(const OutputTransformType * flatTransform, const std::string & fileName) const;
+
+  /** Records a completed stage for the checkpoints, and writes the checkpoint if requested. */
+  void
+  RecordCheckpointStage(const std::string &                  key,
+                        const OutputTransformType *          transform,
+                        const ANTSRegistrationStageProfile & profile,
+                        bool                                 write);
+
+  /** Reads the checkpoint of CheckpointFileName into the stages to resume, if it is usable. */
+  void
+  ReadCheckpoint();
+
+  /** Thrown from the helper's log stream to stop a stage between two iterations. */
+  struct StageInterruption
+  {};
+
+  /** Returns the random seed given to the helper, 0 meaning none. */
+  int
+  GetRegistrationRandomSeed() const
+  {
+    constexpr int fixedSeed = 19650218; // the Mersenne twister's reference seed
+    return (m_RandomSeed == 0 && m_Deterministic) ? fixedSeed : m_RandomSeed;
+  }
+
+  /** Returns whether the time budget share of the running stage or level is spent. */
+  bool
+  IsTimeBudgetExhausted() const
+  {
+    return m_TimeBudget > 0.0 && std::chrono::steady_clock::now() >= m_StageDeadline;
+  }
+
+  /** Returns roughly how long a stage runs compared to others: the sum of its levels' iterations,
+   * each weighted by the fraction of the voxels used at that level, and for deformable stages by the number
+   * of fields which an iteration updates at every voxel (see GetNumberOfStageFields()). */
+  double
+  EstimateStageWork(typename RegistrationHelperType::XfrmMethod xfrmMethod, unsigned int nTimeSteps) const;
+
+  /** Sets the deadline of the next stage or level to a share of the time left until end,
+   * in proportion to its work out of the remaining work. */
+  void
+  ShareTimeBudget(double work, double remainingWork, std::chrono::steady_clock::time_point end);
+
+  /** Returns the composite transform equivalent to the given transform, used when a stage is skipped. */
+  static typename OutputTransformType::Pointer
+  MakeCompositeTransform(const InitialTransformType * transform);
+
+  /** Returns whether the transform type is handled as a low-dimensional transform (with AffineIterations). */
+  static bool
+  IsLinearTransform(typename RegistrationHelperType::XfrmMethod xfrmMethod);
+
+  /** Returns the iterations of a stage, without the levels skipped by a warm start. */
+  std::vector<unsigned int>
+  GetStageIterations(const std::vector<unsigned int> & iterations) const;
+
+  /** Splits a warm-start transform into its leading linear transforms, and the remaining ones. */
+  static void
+  SplitWarmStartTransform(const InitialTransformType * warmStartTransform,
+                          OutputTransformType *        linearTransform,
+                          OutputTransformType *        deformableTransform);
+
+  /** Runs a linear stage one pyramid level at a time, carrying over the unused iterations with AdaptiveIterations,
+   * and sharing the stage's time budget between the levels. */
+  typename OutputTransformType::Pointer
+  AdaptiveStageRegistration(typename RegistrationHelperType::XfrmMethod xfrmMethod,
+                            const InitialTransformType *                initialTransform,
+                            const StageInputs &                         inputs,
+                            bool                                        useMasks);
+
+  /** Returns whether a stage is run one pyramid level at a time by AdaptiveStageRegistration(). */
+  bool
+  RunsStageByLevel(typename RegistrationHelperType::XfrmMethod xfrmMethod) const;
+
+  /** Returns the composition of the transforms of a composite transform from firstLevel on, which are the
+   * results of the levels of a stage, or nullptr if they are not all of type TLinearTransform. */
+  template <typename TLinearTransform>
+  static typename InitialTransformType::Pointer
+  ComposeLevelTransforms(const OutputTransformType * compositeTransform, unsigned int firstLevel);
+
+  /** Computes the initial transform selected by Initialization, or reuses its cached result. */
+  typename OutputTransformType::Pointer
+  ComputeInitialTransform(const StageInputs & inputs);
+
+  /** Returns the rotations searched around each starting alignment by the "MultiStart" initialization. */
+  std::vector<Matrix<double, ImageDimension, ImageDimension>>
+  MakeRotationGrid() const;
+
+  /** Runs one stage, or reuses its cached result, and returns the composite transform of all the stages so far. */
+  typename OutputTransformType::Pointer
   SingleStageRegistration(typename RegistrationHelperType::XfrmMethod xfrmMethod,
                           const InitialTransformType *                initialTransform,
-                          typename InternalImageType::Pointer         fixedImage,
-                          typename InternalImageType::Pointer         movingImage,
+                          const StageInputs &                         inputs,
                           bool                                        useMasks,
                           unsigned                                    nTimeSteps = 4);
 
@@ -335,6 +930,22 @@ protected:
     return this->GetOutput(0)->Set(forwardTransform);
   }
 
+  /** Computes the inverse of the last forward transform, if it was requested and not computed yet. */
+  virtual void
+  UpdateInverseTransform() const;
+
+  /** Composes the forward transform into output 2, if it was requested and not computed yet. */
+  virtual void
+  UpdateForwardDisplacementField() const;
+
+  /** Resamples image through transform onto the grid of referenceImage, streaming the result into fileName. */
+  template <typename TImage>
+  void
+  WriteWarpedImage(const std::string &               fileName,
+                   const TImage *                    image,
+                   const OutputTransformType *       transform,
+                   const ImageBase<ImageDimension> * referenceImage) const;
+
   /** Sets the second output to the provided inverse transform. */
   virtual void
   SetInverseTransform(const OutputTransformType * inverseTransform)
@@ -345,28 +956,129 @@ protected:
   std::string m_TypeOfTransform{ "Affine" };
   std::string m_AffineMetric{ "Mattes" };
   std::string m_SynMetric{ "Mattes" };
+  std::string m_AffineSamplingStrategy{ "Regular" };
+  std::string m_SynSamplingStrategy{ "Regular" };
+  std::string m_Initialization{ "None" };
+  double      m_MultiStartMaxAngle{ 45.0 };
+  double      m_MultiStartAngleStep{ 15.0 };
 
   ParametersValueType m_GradientStep{ 0.2 };
   ParametersValueType m_FlowSigma{ 3.0 };
   ParametersValueType m_TotalSigma{ 0.0 };
+  ParametersValueType m_BSplineKnotSpacing{ 26.0 };
+  ParametersValueType m_BSplineTotalFieldKnotSpacing{ 0.0 };
+  unsigned int        m_BSplineOrder{ 3 };
   ParametersValueType m_SamplingRate{ 0.2 };
   int                 m_NumberOfBins{ 32 };
   int                 m_RandomSeed{ 0 };
+  bool                m_Deterministic{ false };
+  unsigned int        m_RequiredGlobalNumberOfThreads{ 0 };
   bool                m_SmoothingInPhysicalUnits{ false };
   bool                m_UseGradientFilter{ false };
   unsigned int        m_Radius{ 4 };
   bool                m_CollapseCompositeTransform{ true };
   bool                m_MaskAllStages{ false };
+  bool                m_CropToMasks{ false };
+  ParametersValueType m_CropMargin{ 10.0 };
+  bool                m_SparseSyN{ false };
+  ParametersValueType m_SparseSyNBandWidth{ 10.0 };
   unsigned int        m_DisplacementFieldSubsamplingFactor{ 2 };
 
   std::vector<unsigned int> m_SynIterations{ 40, 20, 0 };
   std::vector<unsigned int> m_AffineIterations{ 2100, 1200, 1200, 10 };
   std::vector<unsigned int> m_ShrinkFactors{ 6, 4, 2, 1 };
   std::vector<float>        m_SmoothingSigmas{ 3, 2, 1, 0 };
+  unsigned int              m_ConvergenceWindowSize{ 10 };
+  ParametersValueType       m_ConvergenceThreshold{ 1e-6 };
+  bool                      m_AdaptiveIterations{ false };
+  unsigned int              m_WarmStartLevelsToSkip{ 0 };
 
   std::vector<ParametersValueType> m_RestrictTransformation;
 
+  RegistrationProfileType m_RegistrationProfile;
+
+  bool         m_ComputeInverseTransform{ true };
+  bool         m_CacheStageResults{ false };
+  bool         m_StoreFieldsInFloat{ false };
+  bool         m_UseDisplacementFieldWarping{ false };
+  unsigned int m_NumberOfWarpStreamDivisions{ 8 };
+
+  double                                m_TimeBudget{ 0.0 };
+  bool                                  m_Truncated{ false };
+  std::chrono::steady_clock::time_point m_Deadline;      // of the running Update()
+  std::chrono::steady_clock::time_point m_StageDeadline; // of the running stage or level
+
+  std::vector<typename RegistrationHelperType::XfrmMethod> m_BudgetStages; // stages sharing the time budget
+  std::size_t                                              m_BudgetStageIndex{ 0 };
+  bool                                                     m_RunningStageLevels{ false };
+
+  /** Forward transform whose inverse has not been computed yet. */
+  mutable typename OutputTransformType::ConstPointer m_ForwardTransformToInvert;
+  /** Forward transform which has not been composed into a displacement field yet. */
+  mutable typename OutputTransformType::ConstPointer m_ForwardTransformToCompose;
+  /** Serializes the lazy computation of the inverse transform and of the displacement field by const getters. */
+  mutable std::mutex m_LazyOutputsMutex;
+
+  using ReducedFieldType = Image<Vector<float, ImageDimension>, ImageDimension>;
+
+  /** A transform of the stage cache whose fields are stored in float: either Transform, for the transforms
+   * without fields, or the fields of a displacement field transform. */
+  struct ReducedTransform
+  {
+    typename TransformType::Pointer    Transform;
+    typename ReducedFieldType::Pointer Field;
+    typename ReducedFieldType::Pointer InverseField;
+  };
+
+  struct StageCacheEntry
+  {
+    std::string                                          Key;
+    typename OutputTransformType::Pointer                Transform; // null once stored in ReducedTransforms
+    ANTSRegistrationStageProfile                         Profile;
+    std::vector<std::shared_ptr<const ReducedTransform>> ReducedTransforms; // shared with the later stages
+  };
+  std::vector<StageCacheEntry> m_StageCache;
+  StageCacheEntry              m_InitializationCache;
+  unsigned int                 m_StageIndex{ 0 }; // stage of the running Update()
+  /** Transforms converted back from the reduced ones by the running Update(), so that its stages share them. */
+  std::vector<std::pair<std::shared_ptr<const ReducedTransform>, typename TransformType::Pointer>>
+    m_ExpandedTransforms;
+
+  /** Deformable part of the warm-start transform, until the first deformable stage of the running Update(). */
+  typename OutputTransformType::Pointer m_WarmStartDeformableTransform;
+
+  struct Channel
+  {
+    double      Weight{ 1.0 };
+    std::string Metric; // empty means the stage's metric
+  };
+  std::vector<Channel> m_Channels; // their images are the "ChannelFixed<i>" and "ChannelMoving<i>" inputs
+
+  typename MaskSpatialObjectType::Pointer m_FixedMaskSpatialObject; // shared wrapper of the fixed mask, if any
+
+  SizeValueType m_MemoryBudget{ 0 };
+  unsigned int  m_MemoryBudgetShrinkFactor{ 1 };
+  bool          m_CachingStages{ false }; // CacheStageResults, unless the memory budget rules it out
+
+  std::string m_CheckpointFileName;
+  bool        m_ResumeFromCheckpoint{ false };
+
+  struct CheckpointStage
+  {
+    std::string               Key;
+    std::string               TransformType;
+    unsigned int              NumberOfTransforms{ 0 }; // flattened transforms of the stage's result
+    std::vector<unsigned int> Iterations;              // of each level, for adaptive scheduling
+  };
+  std::vector<CheckpointStage>          m_CheckpointStages; // completed stages of the running Update()
+  std::vector<CheckpointStage>          m_ResumeStages;     // read from the checkpoint
+  typename OutputTransformType::Pointer m_ResumeTransform;  // flattened result of the last checkpointed stage
+  std::string                           m_CheckpointInputsKey;
+
 private:
+  template <typename, typename, typename>
+  friend class ANTSRegistration;
+
   typename RegistrationHelperType::Pointer                          m_Helper{ RegistrationHelperType::New() };
   typename DisplacementFieldTransformParametersAdaptorType::Pointer m_DisplacementFieldAdaptor{
     DisplacementFieldTransformParametersAdaptorType::New()
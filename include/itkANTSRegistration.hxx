@@ -18,12 +18,38 @@
 #ifndef itkANTSRegistration_hxx
 #define itkANTSRegistration_hxx
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
 #include <sstream>
+#include <stdexcept>
+#include <type_traits>
 
+#include "itkAffineTransform.h"
+#include "itkBinShrinkImageFilter.h"
+#include "itkBinaryDilateImageFilter.h"
+#include "itkBinaryThresholdImageFilter.h"
 #include "itkCastImageFilter.h"
+#include "itkFlatStructuringElement.h"
+#include "itkIdentityTransform.h"
+#include "itkImageFileWriter.h"
+#include "itkImageMomentsCalculator.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkRegionOfInterestImageFilter.h"
+#include "itkTransformFileReader.h"
+#include "itkTransformFileWriter.h"
+#include "itkTransformToDisplacementFieldFilter.h"
+#include "itkTranslationTransform.h"
 #include "itkResampleImageFilter.h"
 #include "itkPrintHelper.h"
 #include "itkANTSRegistration.h"
+#include "vnl/algo/vnl_determinant.h"
+#include "itksys/SystemTools.hxx"
 
 namespace itk
 {
@@ -33,7 +59,7 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ANTSRegistrat
   ProcessObject::SetNumberOfRequiredOutputs(2);
   ProcessObject::SetNumberOfRequiredInputs(2);
   ProcessObject::SetNumberOfIndexedInputs(3);
-  ProcessObject::SetNumberOfIndexedOutputs(2);
+  ProcessObject::SetNumberOfIndexedOutputs(3);
 
   SetPrimaryInputName("FixedImage");
   AddRequiredInputName("MovingImage", 1);
@@ -43,6 +69,7 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ANTSRegistrat
 
   this->ProcessObject::SetNthOutput(0, MakeOutput(0));
   this->ProcessObject::SetNthOutput(1, MakeOutput(1));
+  this->ProcessObject::SetNthOutput(2, MakeOutput(2)); // forward displacement field
 }
 
 
@@ -59,22 +86,60 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::PrintSelf(std
   os << indent << "GradientStep: " << this->m_GradientStep << std::endl;
   os << indent << "FlowSigma: " << this->m_FlowSigma << std::endl;
   os << indent << "TotalSigma: " << this->m_TotalSigma << std::endl;
+  os << indent << "BSplineKnotSpacing: " << this->m_BSplineKnotSpacing << std::endl;
+  os << indent << "BSplineTotalFieldKnotSpacing: " << this->m_BSplineTotalFieldKnotSpacing << std::endl;
+  os << indent << "BSplineOrder: " << this->m_BSplineOrder << std::endl;
   os << indent << "SamplingRate: " << this->m_SamplingRate << std::endl;
+  os << indent << "AffineSamplingStrategy: " << this->m_AffineSamplingStrategy << std::endl;
+  os << indent << "SynSamplingStrategy: " << this->m_SynSamplingStrategy << std::endl;
+  os << indent << "Initialization: " << this->m_Initialization << std::endl;
+  os << indent << "MultiStartMaxAngle: " << this->m_MultiStartMaxAngle << std::endl;
+  os << indent << "MultiStartAngleStep: " << this->m_MultiStartAngleStep << std::endl;
   os << indent << "NumberOfBins: " << this->m_NumberOfBins << std::endl;
   os << indent << "RandomSeed: " << this->m_RandomSeed << std::endl;
+  os << indent << "Deterministic: " << (this->m_Deterministic ? "On" : "Off") << std::endl;
+  os << indent << "RequiredGlobalNumberOfThreads: " << this->m_RequiredGlobalNumberOfThreads << std::endl;
   os << indent << "SmoothingInPhysicalUnits: " << (this->m_SmoothingInPhysicalUnits ? "On" : "Off") << std::endl;
   os << indent << "UseGradientFilter: " << (this->m_UseGradientFilter ? "On" : "Off") << std::endl;
   os << indent << "Radius: " << this->m_Radius << std::endl;
   os << indent << "CollapseCompositeTransform: " << (this->m_CollapseCompositeTransform ? "On" : "Off") << std::endl;
   os << indent << "MaskAllStages: " << (this->m_MaskAllStages ? "On" : "Off") << std::endl;
+  os << indent << "CropToMasks: " << (this->m_CropToMasks ? "On" : "Off") << std::endl;
+  os << indent << "CropMargin: " << this->m_CropMargin << std::endl;
+  os << indent << "FixedMaskSpatialObject: " << (this->m_FixedMaskSpatialObject ? "Set" : "Not set") << std::endl;
+  os << indent << "SparseSyN: " << (this->m_SparseSyN ? "On" : "Off") << std::endl;
+  os << indent << "SparseSyNBandWidth: " << this->m_SparseSyNBandWidth << std::endl;
   os << indent << "DisplacementFieldSubsamplingFactor: " << this->m_DisplacementFieldSubsamplingFactor << std::endl;
 
   os << indent << "SynIterations: " << this->m_SynIterations << std::endl;
   os << indent << "AffineIterations: " << this->m_AffineIterations << std::endl;
   os << indent << "ShrinkFactors: " << this->m_ShrinkFactors << std::endl;
   os << indent << "SmoothingSigmas: " << this->m_SmoothingSigmas << std::endl;
+  os << indent << "ConvergenceWindowSize: " << this->m_ConvergenceWindowSize << std::endl;
+  os << indent << "ConvergenceThreshold: " << this->m_ConvergenceThreshold << std::endl;
+  os << indent << "AdaptiveIterations: " << (this->m_AdaptiveIterations ? "On" : "Off") << std::endl;
+  os << indent << "WarmStartLevelsToSkip: " << this->m_WarmStartLevelsToSkip << std::endl;
 
   os << indent << "RestrictTransformation: " << this->m_RestrictTransformation << std::endl;
+  os << indent << "RegistrationProfile: " << this->m_RegistrationProfile.size() << " stages" << std::endl;
+  os << indent << "ComputeInverseTransform: " << (this->m_ComputeInverseTransform ? "On" : "Off") << std::endl;
+  os << indent << "CacheStageResults: " << (this->m_CacheStageResults ? "On" : "Off") << std::endl;
+  os << indent << "StoreFieldsInFloat: " << (this->m_StoreFieldsInFloat ? "On" : "Off") << std::endl;
+  os << indent << "TimeBudget: " << this->m_TimeBudget << std::endl;
+  os << indent << "Truncated: " << (this->m_Truncated ? "On" : "Off") << std::endl;
+  os << indent << "MemoryBudget: " << this->m_MemoryBudget << std::endl;
+  os << indent << "MemoryBudgetShrinkFactor: " << this->m_MemoryBudgetShrinkFactor << std::endl;
+  os << indent << "Channels: " << this->m_Channels.size() << std::endl;
+  for (const Channel & channel : this->m_Channels)
+  {
+    os << indent.GetNextIndent() << "Weight: " << channel.Weight << " Metric: " << channel.Metric << std::endl;
+  }
+  os << indent << "CheckpointFileName: " << this->m_CheckpointFileName << std::endl;
+  os << indent << "ResumeFromCheckpoint: " << (this->m_ResumeFromCheckpoint ? "On" : "Off") << std::endl;
+  os << indent << "UseDisplacementFieldWarping: " << (this->m_UseDisplacementFieldWarping ? "On" : "Off")
+     << std::endl;
+  os << indent << "NumberOfWarpStreamDivisions: " << this->m_NumberOfWarpStreamDivisions << std::endl;
+  os << indent << "StageCache: " << this->m_StageCache.size() << " stages" << std::endl;
 
   this->m_Helper->Print(os, indent);
 }
@@ -124,6 +189,14 @@ auto
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetWarpedMovingImage() const ->
   typename MovingImageType::Pointer
 {
+  if (m_UseDisplacementFieldWarping)
+  {
+    typename WarpImageFilterType::Pointer warpFilter = this->MakeWarpImageFilter();
+    warpFilter->AddInput(this->GetMovingImage());
+    warpFilter->Update();
+    return warpFilter->GetOutput();
+  }
+
   using ResampleFilterType =
     ResampleImageFilter<MovingImageType, MovingImageType, ParametersValueType, ParametersValueType>;
   typename ResampleFilterType::Pointer resampleFilter = ResampleFilterType::New();
@@ -139,16 +212,165 @@ auto
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetWarpedFixedImage() const ->
   typename FixedImageType::Pointer
 {
+  const OutputTransformType * inverseTransform = this->GetInverseTransform();
+  if (inverseTransform == nullptr)
+  {
+    itkExceptionMacro(<< "The inverse transform is not available.");
+  }
   using ResampleFilterType =
     ResampleImageFilter<FixedImageType, FixedImageType, ParametersValueType, ParametersValueType>;
   typename ResampleFilterType::Pointer resampleFilter = ResampleFilterType::New();
   resampleFilter->SetInput(this->GetFixedImage());
-  resampleFilter->SetTransform(this->GetInverseTransform());
+  resampleFilter->SetTransform(inverseTransform);
   resampleFilter->SetOutputParametersFromImage(this->GetMovingImage());
   resampleFilter->Update();
   return resampleFilter->GetOutput();
 }
 
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakePointTransformer(bool inverse) const ->
+  typename PointTransformerType::Pointer
+{
+  const OutputTransformType * transform = inverse ? this->GetInverseTransform() : this->GetForwardTransform();
+  if (transform == nullptr)
+  {
+    itkExceptionMacro(<< "The " << (inverse ? "inverse" : "forward") << " transform is not available.");
+  }
+  typename PointTransformerType::Pointer pointTransformer = PointTransformerType::New();
+  pointTransformer->SetTransform(transform);
+  return pointTransformer;
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::TransformPoints(
+  const ParametersValueType * points,
+  ParametersValueType *       transformedPoints,
+  SizeValueType               numberOfPoints,
+  bool                        inverse) const
+{
+  this->MakePointTransformer(inverse)->TransformPoints(points, transformedPoints, numberOfPoints);
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::TransformPoints(
+  const std::vector<ParametersValueType> & points,
+  bool                                     inverse) const -> std::vector<ParametersValueType>
+{
+  return this->MakePointTransformer(inverse)->TransformPoints(points);
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::WriteWarpedMovingImage(
+  const std::string &               fileName,
+  const MovingImageType *           movingImage,
+  const ImageBase<ImageDimension> * referenceImage) const
+{
+  this->WriteWarpedImage(fileName,
+                         movingImage ? movingImage : this->GetMovingImage(),
+                         this->GetForwardTransform(),
+                         referenceImage ? referenceImage : this->GetFixedImage());
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::WriteWarpedFixedImage(
+  const std::string &               fileName,
+  const FixedImageType *            fixedImage,
+  const ImageBase<ImageDimension> * referenceImage) const
+{
+  const OutputTransformType * inverseTransform = this->GetInverseTransform();
+  if (inverseTransform == nullptr)
+  {
+    itkExceptionMacro(<< "The inverse transform is not available.");
+  }
+  this->WriteWarpedImage(fileName,
+                         fixedImage ? fixedImage : this->GetFixedImage(),
+                         inverseTransform,
+                         referenceImage ? referenceImage : this->GetMovingImage());
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TImage>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::WriteWarpedImage(
+  const std::string &               fileName,
+  const TImage *                    image,
+  const OutputTransformType *       transform,
+  const ImageBase<ImageDimension> * referenceImage) const
+{
+  if (image == nullptr || referenceImage == nullptr || transform == nullptr)
+  {
+    itkExceptionMacro(<< "The image to warp, the reference grid and the transform must all be available.");
+  }
+
+  // the reference may be the output of a reader which was not updated: only its grid is needed
+  const_cast<ImageBase<ImageDimension> *>(referenceImage)->UpdateOutputInformation();
+
+  using ResampleFilterType =
+    ANTSStreamingResampleImageFilter<TImage, TImage, ParametersValueType, ParametersValueType>;
+  typename ResampleFilterType::Pointer resampleFilter = ResampleFilterType::New();
+  resampleFilter->SetInput(image);
+  resampleFilter->SetTransform(transform);
+  resampleFilter->SetOutputParametersFromImage(referenceImage);
+
+  using WriterType = ImageFileWriter<TImage>;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(resampleFilter->GetOutput());
+  writer->SetFileName(fileName);
+  writer->SetNumberOfStreamDivisions(m_NumberOfWarpStreamDivisions);
+  writer->Update();
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetForwardDisplacementField() const
+  -> const OutputDisplacementFieldType *
+{
+  this->UpdateForwardDisplacementField();
+  return static_cast<const OutputDisplacementFieldType *>(this->ProcessObject::GetOutput(2));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeWarpImageFilter() const ->
+  typename WarpImageFilterType::Pointer
+{
+  typename WarpImageFilterType::Pointer warpFilter = WarpImageFilterType::New();
+  warpFilter->SetDisplacementField(this->GetForwardDisplacementField());
+  return warpFilter;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::UpdateForwardDisplacementField() const
+{
+  const std::lock_guard<std::mutex> lock(m_LazyOutputsMutex);
+  if (m_ForwardTransformToCompose.IsNull())
+  {
+    return;
+  }
+  typename OutputTransformType::ConstPointer forwardTransform = m_ForwardTransformToCompose;
+  m_ForwardTransformToCompose = nullptr;
+
+  using ComposeFilterType = TransformToDisplacementFieldFilter<OutputDisplacementFieldType, ParametersValueType>;
+  typename ComposeFilterType::Pointer composeFilter = ComposeFilterType::New();
+  composeFilter->SetTransform(forwardTransform);
+  composeFilter->SetReferenceImage(this->GetFixedImage());
+  composeFilter->SetUseReferenceImage(true);
+  composeFilter->Update();
+
+  auto * displacementField =
+    static_cast<OutputDisplacementFieldType *>(const_cast<DataObject *>(this->ProcessObject::GetOutput(2)));
+  displacementField->Graft(composeFilter->GetOutput());
+}
+
+
 template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
 void
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SetFixedMask(const LabelImageType * mask)
@@ -186,11 +408,70 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetMovingMask
 }
 
 
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::AddChannel(const FixedImageType *  fixedImage,
+                                                                              const MovingImageType * movingImage,
+                                                                              double                  weight,
+                                                                              const std::string &     metric)
+{
+  if (fixedImage == nullptr || movingImage == nullptr)
+  {
+    itkExceptionMacro(<< "A channel needs both a fixed and a moving image.");
+  }
+  const std::string index = std::to_string(m_Channels.size());
+  this->ProcessObject::SetInput("ChannelFixed" + index, const_cast<FixedImageType *>(fixedImage));
+  this->ProcessObject::SetInput("ChannelMoving" + index, const_cast<MovingImageType *>(movingImage));
+  m_Channels.push_back({ weight, metric });
+  this->Modified();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ClearChannels()
+{
+  if (m_Channels.empty())
+  {
+    return;
+  }
+  for (std::size_t i = 0; i < m_Channels.size(); ++i)
+  {
+    this->ProcessObject::RemoveInput("ChannelFixed" + std::to_string(i));
+    this->ProcessObject::RemoveInput("ChannelMoving" + std::to_string(i));
+  }
+  m_Channels.clear();
+  this->Modified();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetChannelFixedImage(unsigned int i) const
+  -> const FixedImageType *
+{
+  return static_cast<const FixedImageType *>(this->ProcessObject::GetInput("ChannelFixed" + std::to_string(i)));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetChannelMovingImage(unsigned int i) const
+  -> const MovingImageType *
+{
+  return static_cast<const MovingImageType *>(this->ProcessObject::GetInput("ChannelMoving" + std::to_string(i)));
+}
+
+
 template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
 auto
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetOutput(DataObjectPointerArraySizeType index)
   -> DecoratedOutputTransformType *
 {
+  if (index == 1)
+  {
+    this->UpdateInverseTransform();
+  }
   return static_cast<DecoratedOutputTransformType *>(this->ProcessObject::GetOutput(index));
 }
 
@@ -200,100 +481,2085 @@ auto
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetOutput(DataObjectPointerArraySizeType index) const
   -> const DecoratedOutputTransformType *
 {
+  if (index == 1)
+  {
+    this->UpdateInverseTransform();
+  }
   return static_cast<const DecoratedOutputTransformType *>(this->ProcessObject::GetOutput(index));
 }
 
 
-template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
-void
-ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SetInput(unsigned               index,
-                                                                            const FixedImageType * image)
-{
-  if (index == 0)
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::UpdateInverseTransform() const
+{
+  const std::lock_guard<std::mutex> lock(m_LazyOutputsMutex);
+  if (m_ForwardTransformToInvert.IsNull())
+  {
+    return;
+  }
+  typename OutputTransformType::ConstPointer forwardTransform = m_ForwardTransformToInvert;
+  m_ForwardTransformToInvert = nullptr; // attempted only once, even if the transform is not invertible
+
+  typename OutputTransformType::Pointer inverseTransform = OutputTransformType::New();
+  auto *                                decoratedInverseTransform =
+    static_cast<DecoratedOutputTransformType *>(const_cast<DataObject *>(this->ProcessObject::GetOutput(1)));
+  if (forwardTransform->GetInverse(inverseTransform))
+  {
+    decoratedInverseTransform->Set(inverseTransform);
+  }
+  else
+  {
+    decoratedInverseTransform->Set(nullptr);
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SetInput(unsigned               index,
+                                                                            const FixedImageType * image)
+{
+  if (index == 0)
+  {
+    this->SetFixedImage(image);
+  }
+  else if (index == 1)
+  {
+    this->SetMovingImage(reinterpret_cast<const MovingImageType *>(image));
+  }
+  else
+  {
+    itkExceptionMacro(<< "Invalid index: " << index << ". Expected 0 (fixed) or 1 (moving).");
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TOtherFixedImage, typename TOtherMovingImage>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::CopyParameters(
+  const ANTSRegistration<TOtherFixedImage, TOtherMovingImage, TParametersValueType> * other)
+{
+  if (other == nullptr)
+  {
+    itkExceptionMacro(<< "Cannot copy parameters from a null registration.");
+  }
+
+  m_TypeOfTransform = other->m_TypeOfTransform;
+  m_AffineMetric = other->m_AffineMetric;
+  m_SynMetric = other->m_SynMetric;
+
+  m_GradientStep = other->m_GradientStep;
+  m_FlowSigma = other->m_FlowSigma;
+  m_TotalSigma = other->m_TotalSigma;
+  m_BSplineKnotSpacing = other->m_BSplineKnotSpacing;
+  m_BSplineTotalFieldKnotSpacing = other->m_BSplineTotalFieldKnotSpacing;
+  m_BSplineOrder = other->m_BSplineOrder;
+  m_SamplingRate = other->m_SamplingRate;
+  m_AffineSamplingStrategy = other->m_AffineSamplingStrategy;
+  m_SynSamplingStrategy = other->m_SynSamplingStrategy;
+  m_Initialization = other->m_Initialization;
+  m_MultiStartMaxAngle = other->m_MultiStartMaxAngle;
+  m_MultiStartAngleStep = other->m_MultiStartAngleStep;
+  m_NumberOfBins = other->m_NumberOfBins;
+  m_RandomSeed = other->m_RandomSeed;
+  m_Deterministic = other->m_Deterministic;
+  m_RequiredGlobalNumberOfThreads = other->m_RequiredGlobalNumberOfThreads;
+  m_SmoothingInPhysicalUnits = other->m_SmoothingInPhysicalUnits;
+  m_UseGradientFilter = other->m_UseGradientFilter;
+  m_Radius = other->m_Radius;
+  m_CollapseCompositeTransform = other->m_CollapseCompositeTransform;
+  m_MaskAllStages = other->m_MaskAllStages;
+  m_CropToMasks = other->m_CropToMasks;
+  m_CropMargin = other->m_CropMargin;
+  m_SparseSyN = other->m_SparseSyN;
+  m_SparseSyNBandWidth = other->m_SparseSyNBandWidth;
+  m_DisplacementFieldSubsamplingFactor = other->m_DisplacementFieldSubsamplingFactor;
+
+  m_SynIterations = other->m_SynIterations;
+  m_AffineIterations = other->m_AffineIterations;
+  m_ShrinkFactors = other->m_ShrinkFactors;
+  m_SmoothingSigmas = other->m_SmoothingSigmas;
+  m_ConvergenceWindowSize = other->m_ConvergenceWindowSize;
+  m_ConvergenceThreshold = other->m_ConvergenceThreshold;
+  m_AdaptiveIterations = other->m_AdaptiveIterations;
+  m_WarmStartLevelsToSkip = other->m_WarmStartLevelsToSkip;
+
+  m_RestrictTransformation = other->m_RestrictTransformation;
+
+  m_ComputeInverseTransform = other->m_ComputeInverseTransform;
+  m_CacheStageResults = other->m_CacheStageResults;
+  m_StoreFieldsInFloat = other->m_StoreFieldsInFloat;
+  m_UseDisplacementFieldWarping = other->m_UseDisplacementFieldWarping;
+  m_NumberOfWarpStreamDivisions = other->m_NumberOfWarpStreamDivisions;
+  m_TimeBudget = other->m_TimeBudget;
+  m_MemoryBudget = other->m_MemoryBudget;
+  m_CheckpointFileName = other->m_CheckpointFileName;
+  m_ResumeFromCheckpoint = other->m_ResumeFromCheckpoint;
+
+  this->Modified();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::AllocateOutputs()
+{
+  const DecoratedOutputTransformType * decoratedOutputForwardTransform = this->GetOutput(0);
+  if (!decoratedOutputForwardTransform || !decoratedOutputForwardTransform->Get())
+  {
+    this->ProcessObject::SetNthOutput(0, MakeOutput(0));
+  }
+
+  // The inverse transform is null until it is requested, see UpdateInverseTransform()
+  const DecoratedOutputTransformType * decoratedOutputInverseTransform = this->GetOutput(1);
+  if (!decoratedOutputInverseTransform)
+  {
+    this->ProcessObject::SetNthOutput(1, MakeOutput(1));
+  }
+
+  // The displacement field is empty until it is requested, see UpdateForwardDisplacementField()
+  if (!this->ProcessObject::GetOutput(2))
+  {
+    this->ProcessObject::SetNthOutput(2, MakeOutput(2));
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeOutput(DataObjectPointerArraySizeType index)
+  -> DataObjectPointer
+{
+  if (index == 2)
+  {
+    return OutputDisplacementFieldType::New().GetPointer();
+  }
+  typename OutputTransformType::Pointer ptr;
+  Self::MakeOutputTransform(ptr);
+  typename DecoratedOutputTransformType::Pointer decoratedOutputTransform = DecoratedOutputTransformType::New();
+  decoratedOutputTransform->Set(ptr);
+  return decoratedOutputTransform;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TImage>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::CastImageToInternalType(const TImage * inputImage) ->
+  typename InternalImageType::Pointer
+{
+  if constexpr (std::is_same_v<TImage, InternalImageType>)
+  {
+    // No conversion is needed, so share the pixel buffer instead of copying it.
+    // The registration only reads from its images, so the input is not modified.
+    typename InternalImageType::Pointer outputImage = InternalImageType::New();
+    outputImage->Graft(inputImage);
+    return outputImage;
+  }
+  else
+  {
+    using CastFilterType = CastImageFilter<TImage, InternalImageType>;
+    typename CastFilterType::Pointer castFilter = CastFilterType::New();
+    castFilter->SetInput(inputImage);
+    castFilter->Update();
+    typename InternalImageType::Pointer outputImage = castFilter->GetOutput();
+    outputImage->DisconnectPipeline();
+    return outputImage;
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+unsigned int
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetDefaultNumberOfConcurrentRegistrations()
+{
+  if (MultiThreaderBase::GetGlobalDefaultThreader() == MultiThreaderBase::ThreaderEnum::Platform)
+  {
+    return 1; // a second registration would already run twice as many threads as the machine is set up for
+  }
+  return std::max(1u, MultiThreaderBase::GetGlobalDefaultNumberOfThreads() / 2);
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeMaskSpatialObject(const LabelImageType * mask)
+  -> typename MaskSpatialObjectType::Pointer
+{
+  if (mask == nullptr)
+  {
+    return nullptr;
+  }
+  typename MaskSpatialObjectType::Pointer maskSpatialObject = MaskSpatialObjectType::New();
+  maskSpatialObject->SetImage(mask);
+  maskSpatialObject->Update();
+  return maskSpatialObject;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::CropToMask(InternalImageType *           image,
+                                                                              const MaskSpatialObjectType * mask,
+                                                                              ParametersValueType           margin)
+  -> typename InternalImageType::Pointer
+{
+  using RegionType = typename InternalImageType::RegionType;
+  using PointType = typename InternalImageType::PointType;
+  using ContinuousIndexType = ContinuousIndex<double, ImageDimension>;
+  constexpr unsigned int numberOfCorners = 1u << ImageDimension;
+
+  const RegionType maskRegion = mask->ComputeMyBoundingBoxInIndexSpace();
+  if (maskRegion.GetNumberOfPixels() == 0)
+  {
+    return image;
+  }
+
+  // Axis-aligned physical box around the mask's voxels, whatever the directions of the images
+  PointType lower;
+  PointType upper;
+  lower.Fill(NumericTraits<double>::max());
+  upper.Fill(NumericTraits<double>::NonpositiveMin());
+  for (unsigned int corner = 0; corner < numberOfCorners; ++corner)
+  {
+    ContinuousIndexType cindex;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      cindex[d] = maskRegion.GetIndex(d) - 0.5 + ((corner >> d) & 1u) * maskRegion.GetSize(d);
+    }
+    PointType point;
+    mask->GetImage()->TransformContinuousIndexToPhysicalPoint(cindex, point);
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      lower[d] = std::min(lower[d], point[d] - margin);
+      upper[d] = std::max(upper[d], point[d] + margin);
+    }
+  }
+
+  // The image's voxels covering that box
+  typename RegionType::IndexType lowerIndex;
+  typename RegionType::IndexType upperIndex;
+  lowerIndex.Fill(NumericTraits<IndexValueType>::max());
+  upperIndex.Fill(NumericTraits<IndexValueType>::NonpositiveMin());
+  for (unsigned int corner = 0; corner < numberOfCorners; ++corner)
+  {
+    PointType point;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      point[d] = ((corner >> d) & 1u) ? upper[d] : lower[d];
+    }
+    const auto cindex = image->template TransformPhysicalPointToContinuousIndex<double>(point);
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      lowerIndex[d] = std::min(lowerIndex[d], Math::Floor<IndexValueType>(cindex[d]));
+      upperIndex[d] = std::max(upperIndex[d], Math::Ceil<IndexValueType>(cindex[d]));
+    }
+  }
+  RegionType cropRegion;
+  cropRegion.SetIndex(lowerIndex);
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    cropRegion.SetSize(d, upperIndex[d] - lowerIndex[d] + 1);
+  }
+  if (!cropRegion.Crop(image->GetLargestPossibleRegion()) || cropRegion == image->GetLargestPossibleRegion())
+  {
+    return image; // the mask is outside of the image, or the box covers all of it
+  }
+
+  using ROIFilterType = RegionOfInterestImageFilter<InternalImageType, InternalImageType>;
+  typename ROIFilterType::Pointer roiFilter = ROIFilterType::New();
+  roiFilter->SetInput(image);
+  roiFilter->SetRegionOfInterest(cropRegion);
+  roiFilter->Update();
+  typename InternalImageType::Pointer croppedImage = roiFilter->GetOutput();
+  croppedImage->DisconnectPipeline();
+  return croppedImage;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeMaskBand(const LabelImageType * mask,
+                                                                                ParametersValueType    radius)
+  -> typename LabelImageType::Pointer
+{
+  // any non-zero label is foreground, like in ImageMaskSpatialObject
+  using ThresholdFilterType = BinaryThresholdImageFilter<LabelImageType, LabelImageType>;
+  typename ThresholdFilterType::Pointer thresholdFilter = ThresholdFilterType::New();
+  thresholdFilter->SetInput(mask);
+  thresholdFilter->SetLowerThreshold(1);
+  thresholdFilter->SetInsideValue(1);
+  thresholdFilter->SetOutsideValue(0);
+
+  using StructuringElementType = FlatStructuringElement<ImageDimension>;
+  typename StructuringElementType::RadiusType ballRadius;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    ballRadius[d] = Math::Ceil<SizeValueType>(radius / mask->GetSpacing()[d]);
+  }
+  using DilateFilterType = BinaryDilateImageFilter<LabelImageType, LabelImageType, StructuringElementType>;
+  typename DilateFilterType::Pointer dilateFilter = DilateFilterType::New();
+  dilateFilter->SetInput(thresholdFilter->GetOutput());
+  dilateFilter->SetKernel(StructuringElementType::Ball(ballRadius));
+  dilateFilter->SetForegroundValue(1);
+  dilateFilter->Update();
+  return dilateFilter->GetOutput();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+double
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ComputeMaskFraction(
+  const MaskSpatialObjectType * mask,
+  const InternalImageType *     image)
+{
+  const LabelImageType * maskImage = mask->GetImage();
+  SizeValueType          foregroundVoxels = 0;
+  for (ImageRegionConstIterator<LabelImageType> it(maskImage, maskImage->GetLargestPossibleRegion()); !it.IsAtEnd();
+       ++it)
+  {
+    foregroundVoxels += (it.Get() != 0);
+  }
+
+  // compared in physical units, as the mask and the image may have different grids
+  double maskVolume = foregroundVoxels;
+  double imageVolume = image->GetLargestPossibleRegion().GetNumberOfPixels();
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    maskVolume *= maskImage->GetSpacing()[d];
+    imageVolume *= image->GetSpacing()[d];
+  }
+  return std::min(1.0, maskVolume / imageVolume);
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::string
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::XfrmMethodToString(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod)
+{
+  switch (xfrmMethod)
+  {
+    case RegistrationHelperType::Rigid:
+      return "Rigid";
+    case RegistrationHelperType::Affine:
+      return "Affine";
+    case RegistrationHelperType::CompositeAffine:
+      return "CompositeAffine";
+    case RegistrationHelperType::Similarity:
+      return "Similarity";
+    case RegistrationHelperType::Translation:
+      return "Translation";
+    case RegistrationHelperType::BSpline:
+      return "BSpline";
+    case RegistrationHelperType::GaussianDisplacementField:
+      return "GaussianDisplacementField";
+    case RegistrationHelperType::BSplineDisplacementField:
+      return "BSplineDisplacementField";
+    case RegistrationHelperType::TimeVaryingVelocityField:
+      return "TimeVaryingVelocityField";
+    case RegistrationHelperType::TimeVaryingBSplineVelocityField:
+      return "TimeVaryingBSplineVelocityField";
+    case RegistrationHelperType::SyN:
+      return "SyN";
+    case RegistrationHelperType::BSplineSyN:
+      return "BSplineSyN";
+    case RegistrationHelperType::Exponential:
+      return "Exponential";
+    case RegistrationHelperType::BSplineExponential:
+      return "BSplineExponential";
+    default:
+      return "Unknown";
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeCompositeTransform(
+  const InitialTransformType * transform) -> typename OutputTransformType::Pointer
+{
+  // results of earlier stages are already composite transforms, and are passed on as they are
+  auto * compositeTransform = dynamic_cast<const OutputTransformType *>(transform);
+  if (compositeTransform != nullptr)
+  {
+    return const_cast<OutputTransformType *>(compositeTransform);
+  }
+  typename OutputTransformType::Pointer result = OutputTransformType::New();
+  if (transform != nullptr)
+  {
+    result->AddTransform(const_cast<InitialTransformType *>(transform));
+  }
+  return result;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeRotationGrid() const
+  -> std::vector<Matrix<double, ImageDimension, ImageDimension>>
+{
+  using MatrixType = Matrix<double, ImageDimension, ImageDimension>;
+  std::vector<double> angles;
+  const double        maxAngle = m_MultiStartMaxAngle * Math::pi / 180.0;
+  const double        step = m_MultiStartAngleStep * Math::pi / 180.0;
+  for (double angle = -std::floor(maxAngle / step) * step; angle <= maxAngle + 1e-9; angle += step)
+  {
+    angles.push_back(angle);
+  }
+
+  auto planeRotation = [](unsigned int i, unsigned int j, double angle) {
+    MatrixType rotation;
+    rotation.SetIdentity();
+    rotation[i][i] = std::cos(angle);
+    rotation[i][j] = -std::sin(angle);
+    rotation[j][i] = std::sin(angle);
+    rotation[j][j] = std::cos(angle);
+    return rotation;
+  };
+
+  std::vector<MatrixType> grid;
+  if constexpr (ImageDimension == 2)
+  {
+    for (double angle : angles)
+    {
+      grid.push_back(planeRotation(0, 1, angle));
+    }
+  }
+  else if constexpr (ImageDimension == 3)
+  {
+    for (double angleX : angles)
+    {
+      for (double angleY : angles)
+      {
+        for (double angleZ : angles)
+        {
+          grid.push_back(planeRotation(1, 2, angleX) * planeRotation(2, 0, angleY) * planeRotation(0, 1, angleZ));
+        }
+      }
+    }
+  }
+  else
+  {
+    MatrixType identity;
+    identity.SetIdentity();
+    grid.push_back(identity);
+  }
+  return grid;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ComputeInitialTransform(const StageInputs & inputs)
+  -> typename OutputTransformType::Pointer
+{
+  std::string initialization = m_Initialization;
+  std::transform(initialization.begin(), initialization.end(), initialization.begin(), tolower);
+  if (initialization == "none")
+  {
+    return nullptr;
+  }
+  if (initialization != "moments" && initialization != "multistart")
+  {
+    itkExceptionMacro(<< "Unsupported initialization: " << m_Initialization
+                      << ". Expected one of: None, Moments, MultiStart.");
+  }
+  const bool         multiStart = initialization == "multistart";
+  const unsigned int shrinkFactor = m_ShrinkFactors.empty() ? 1u : std::max(1u, m_ShrinkFactors.front());
+
+  std::ostringstream key;
+  key.precision(17);
+  key << "fixed: " << this->GetFixedImage()->GetMTime() << " moving: " << this->GetMovingImage()->GetMTime()
+      << " fixedMask: " << (this->GetFixedMask() ? this->GetFixedMask()->GetMTime() : 0)
+      << " movingMask: " << (this->GetMovingMask() ? this->GetMovingMask()->GetMTime() : 0)
+      << " crop: " << (m_CropToMasks ? m_CropMargin : -1.0) << " initialization: " << initialization
+      << " angles: " << m_MultiStartMaxAngle << " " << m_MultiStartAngleStep << " shrink: " << shrinkFactor;
+  if (m_CachingStages && m_InitializationCache.Key == key.str())
+  {
+    m_RegistrationProfile.push_back(m_InitializationCache.Profile);
+    m_RegistrationProfile.back().Reused = true;
+    return m_InitializationCache.Transform;
+  }
+
+  m_RegistrationProfile.emplace_back();
+  ANTSRegistrationStageProfile & stageProfile = m_RegistrationProfile.back();
+  stageProfile.TransformType = multiStart ? "MultiStart" : "Moments";
+  stageProfile.Metric = "MI";
+  const auto start = std::chrono::steady_clock::now();
+
+  using PointType = Point<double, ImageDimension>;
+  using MatrixType = Matrix<double, ImageDimension, ImageDimension>;
+  auto computeMoments = [](const InternalImageType *     image,
+                           const MaskSpatialObjectType * mask,
+                           PointType &                   center,
+                           MatrixType &                  axes) {
+    using MomentsCalculatorType = ImageMomentsCalculator<InternalImageType>;
+    typename MomentsCalculatorType::Pointer calculator = MomentsCalculatorType::New();
+    calculator->SetImage(image);
+    if (mask != nullptr)
+    {
+      calculator->SetSpatialObjectMask(mask);
+    }
+    try
+    {
+      calculator->Compute();
+      const auto centerOfGravity = calculator->GetCenterOfGravity();
+      for (unsigned int d = 0; d < ImageDimension; ++d)
+      {
+        center[d] = centerOfGravity[d];
+      }
+      axes = calculator->GetPrincipalAxes(); // one axis per row
+    }
+    catch (const ExceptionObject &)
+    {
+      // no mass to compute moments from, so use the geometric center
+      const auto &                            region = image->GetLargestPossibleRegion();
+      ContinuousIndex<double, ImageDimension> cindex;
+      for (unsigned int d = 0; d < ImageDimension; ++d)
+      {
+        cindex[d] = region.GetIndex(d) + 0.5 * (region.GetSize(d) - 1.0);
+      }
+      image->TransformContinuousIndexToPhysicalPoint(cindex, center);
+      axes.SetIdentity();
+    }
+  };
+  PointType  fixedCenter;
+  PointType  movingCenter;
+  MatrixType fixedAxes;
+  MatrixType movingAxes;
+  computeMoments(inputs.FixedImage, inputs.FixedMask, fixedCenter, fixedAxes);
+  computeMoments(inputs.MovingImage, inputs.MovingMask, movingCenter, movingAxes);
+
+  // The rotation mapping the fixed principal axes onto the moving ones, without reflection
+  MatrixType principalRotation = MatrixType(movingAxes.GetTranspose()) * fixedAxes;
+  if (vnl_determinant(principalRotation.GetVnlMatrix()) < 0.0)
+  {
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      movingAxes[ImageDimension - 1][d] = -movingAxes[ImageDimension - 1][d];
+    }
+    principalRotation = MatrixType(movingAxes.GetTranspose()) * fixedAxes;
+  }
+  MatrixType identity;
+  identity.SetIdentity();
+  std::vector<MatrixType> candidates;
+  const std::vector<MatrixType> grid = multiStart ? this->MakeRotationGrid() : std::vector<MatrixType>{ identity };
+  for (const MatrixType & startingRotation : { identity, principalRotation })
+  {
+    for (const MatrixType & rotation : grid)
+    {
+      candidates.push_back(rotation * startingRotation);
+    }
+  }
+
+  // The candidates are compared at the coarsest pyramid level, on a subset of the fixed voxels
+  using ShrinkFilterType = BinShrinkImageFilter<InternalImageType, InternalImageType>;
+  auto shrink = [shrinkFactor](const InternalImageType * image) {
+    typename ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
+    shrinkFilter->SetInput(image);
+    shrinkFilter->SetShrinkFactors(shrinkFactor);
+    shrinkFilter->Update();
+    typename InternalImageType::Pointer shrunk = shrinkFilter->GetOutput();
+    shrunk->DisconnectPipeline();
+    return shrunk;
+  };
+  typename InternalImageType::Pointer coarseFixed = shrink(inputs.FixedImage);
+  typename InternalImageType::Pointer coarseMoving = shrink(inputs.MovingImage);
+
+  constexpr SizeValueType maxSamples = 20000;
+  const SizeValueType     stride =
+    std::max<SizeValueType>(1, coarseFixed->GetLargestPossibleRegion().GetNumberOfPixels() / maxSamples);
+  std::vector<PointType> samplePoints;
+  std::vector<double>    fixedValues;
+  SizeValueType          voxel = 0;
+  for (ImageRegionConstIteratorWithIndex<InternalImageType> it(coarseFixed, coarseFixed->GetLargestPossibleRegion());
+       !it.IsAtEnd();
+       ++it, ++voxel)
+  {
+    if (voxel % stride != 0)
+    {
+      continue;
+    }
+    PointType point;
+    coarseFixed->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+    if (inputs.FixedMask == nullptr || inputs.FixedMask->IsInsideInWorldSpace(point))
+    {
+      samplePoints.push_back(point);
+      fixedValues.push_back(it.Get());
+    }
+  }
+  if (samplePoints.empty())
+  {
+    itkExceptionMacro(<< "No fixed image voxel to compare the initial alignments with.");
+  }
+
+  constexpr unsigned int bins = 32;
+  const auto fixedRange = std::minmax_element(fixedValues.begin(), fixedValues.end());
+  const auto movingRange = std::minmax_element(coarseMoving->GetBufferPointer(),
+                                               coarseMoving->GetBufferPointer() +
+                                                 coarseMoving->GetBufferedRegion().GetNumberOfPixels());
+  const double fixedMin = *fixedRange.first;
+  const double fixedScale = (bins - 1) / std::max(*fixedRange.second - fixedMin, 1e-12);
+  const double movingMin = *movingRange.first;
+  const double movingScale = (bins - 1) / std::max(double(*movingRange.second) - movingMin, 1e-12);
+
+  using InterpolatorType = LinearInterpolateImageFunction<InternalImageType, double>;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage(coarseMoving);
+
+  // Negated mutual information of each candidate, from a joint histogram
+  std::vector<double> values(candidates.size());
+  auto                evaluateCandidate = [&](SizeValueType c) {
+    const MatrixType &  rotation = candidates[c];
+    std::vector<double> joint(bins * bins, 0.0);
+    std::size_t         count = 0;
+    for (std::size_t s = 0; s < samplePoints.size(); ++s)
+    {
+      const PointType mapped = movingCenter + rotation * (samplePoints[s] - fixedCenter);
+      const auto      cindex = coarseMoving->template TransformPhysicalPointToContinuousIndex<double>(mapped);
+      if (!interpolator->IsInsideBuffer(cindex))
+      {
+        continue;
+      }
+      const double movingValue = interpolator->EvaluateAtContinuousIndex(cindex);
+      const auto   fixedBin = static_cast<unsigned int>((fixedValues[s] - fixedMin) * fixedScale + 0.5);
+      const auto   movingBin = static_cast<unsigned int>((movingValue - movingMin) * movingScale + 0.5);
+      joint[std::min(fixedBin, bins - 1) * bins + std::min(movingBin, bins - 1)] += 1.0;
+      ++count;
+    }
+    if (count < samplePoints.size() / 10) // mostly outside of the moving image
+    {
+      values[c] = NumericTraits<double>::max();
+      return;
+    }
+    std::vector<double> fixedMarginal(bins, 0.0);
+    std::vector<double> movingMarginal(bins, 0.0);
+    for (unsigned int f = 0; f < bins; ++f)
+    {
+      for (unsigned int m = 0; m < bins; ++m)
+      {
+        fixedMarginal[f] += joint[f * bins + m];
+        movingMarginal[m] += joint[f * bins + m];
+      }
+    }
+    double mutualInformation = 0.0;
+    for (unsigned int f = 0; f < bins; ++f)
+    {
+      for (unsigned int m = 0; m < bins; ++m)
+      {
+        const double p = joint[f * bins + m];
+        if (p > 0.0)
+        {
+          mutualInformation += p / count * std::log(p * count / (fixedMarginal[f] * movingMarginal[m]));
+        }
+      }
+    }
+    values[c] = -mutualInformation;
+  };
+  MultiThreaderBase::New()->ParallelizeArray(0, candidates.size(), evaluateCandidate, nullptr);
+  const std::size_t best = std::min_element(values.begin(), values.end()) - values.begin();
+
+  using AffineTransformType = AffineTransform<ParametersValueType, ImageDimension>;
+  typename AffineTransformType::Pointer affineTransform = AffineTransformType::New();
+  typename AffineTransformType::InputPointType  center;
+  typename AffineTransformType::MatrixType      matrix;
+  typename AffineTransformType::OutputVectorType translation;
+  for (unsigned int i = 0; i < ImageDimension; ++i)
+  {
+    center[i] = fixedCenter[i];
+    translation[i] = movingCenter[i] - fixedCenter[i];
+    for (unsigned int j = 0; j < ImageDimension; ++j)
+    {
+      matrix[i][j] = candidates[best][i][j];
+    }
+  }
+  affineTransform->SetCenter(center);
+  affineTransform->SetMatrix(matrix);
+  affineTransform->SetTranslation(translation);
+  typename OutputTransformType::Pointer initializationTransform = OutputTransformType::New();
+  initializationTransform->AddTransform(affineTransform);
+
+  stageProfile.Levels.emplace_back();
+  stageProfile.Levels.back().Iterations = candidates.size();
+  stageProfile.Levels.back().IterationLimit = candidates.size();
+  stageProfile.Levels.back().FinalMetricValue = values[best];
+  stageProfile.WallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  stageProfile.ProcessPeakResidentMemory = GetANTSRegistrationPeakResidentMemory();
+  stageProfile.Levels.back().WallTime = stageProfile.WallTime;
+  stageProfile.Levels.back().ProcessPeakResidentMemory = stageProfile.ProcessPeakResidentMemory;
+  itkDebugMacro("Initialization: candidate " << best << " of " << candidates.size() << ", metric " << values[best]);
+
+  if (m_CachingStages)
+  {
+    m_InitializationCache = { key.str(), initializationTransform, stageProfile, {} };
+  }
+  return initializationTransform;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+bool
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::IsLinearTransform(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod)
+{
+  switch (xfrmMethod)
+  {
+    case RegistrationHelperType::Rigid:
+    case RegistrationHelperType::Affine:
+    case RegistrationHelperType::CompositeAffine:
+    case RegistrationHelperType::Similarity:
+    case RegistrationHelperType::Translation:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::vector<unsigned int>
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetStageIterations(
+  const std::vector<unsigned int> & iterations) const
+{
+  if (this->GetWarmStartTransform() == nullptr || m_WarmStartLevelsToSkip == 0 || iterations.size() <= 1)
+  {
+    return iterations;
+  }
+  // the shrink factors and smoothing sigmas are matched from the finest level, so they follow
+  const std::size_t skip = std::min<std::size_t>(m_WarmStartLevelsToSkip, iterations.size() - 1);
+  return { iterations.begin() + skip, iterations.end() };
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SplitWarmStartTransform(
+  const InitialTransformType * warmStartTransform,
+  OutputTransformType *        linearTransform,
+  OutputTransformType *        deformableTransform)
+{
+  auto * compositeTransform = dynamic_cast<const OutputTransformType *>(warmStartTransform);
+  if (compositeTransform != nullptr) // nested composite transforms are flattened
+  {
+    for (unsigned int i = 0; i < compositeTransform->GetNumberOfTransforms(); ++i)
+    {
+      Self::SplitWarmStartTransform(
+        compositeTransform->GetNthTransformConstPointer(i), linearTransform, deformableTransform);
+    }
+  }
+  else if (warmStartTransform->IsLinear() && deformableTransform->GetNumberOfTransforms() == 0)
+  {
+    linearTransform->AddTransform(const_cast<InitialTransformType *>(warmStartTransform));
+  }
+  else // everything after the first deformable transform, to keep the order of the transforms
+  {
+    deformableTransform->AddTransform(const_cast<InitialTransformType *>(warmStartTransform));
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetStageTransforms(unsigned int & nTimeSteps) const
+  -> std::vector<typename RegistrationHelperType::XfrmMethod>
+{
+  // Matches the stages run by GenerateData()
+  using H = RegistrationHelperType;
+  std::string whichTransform = this->GetTypeOfTransform();
+  std::transform(whichTransform.begin(), whichTransform.end(), whichTransform.begin(), tolower);
+  nTimeSteps = 0;
+  if (whichTransform == "synonly")
+  {
+    return { H::SyN };
+  }
+  if (whichTransform == "syn" || whichTransform == "syncc")
+  {
+    return { H::Affine, H::SyN };
+  }
+  if (whichTransform == "synra")
+  {
+    return { H::Rigid, H::Affine, H::SyN };
+  }
+  if (whichTransform == "elastic")
+  {
+    return { H::Affine, H::GaussianDisplacementField };
+  }
+  if (whichTransform == "quickrigid")
+  {
+    return { H::Rigid };
+  }
+  if (whichTransform == "trsaa")
+  {
+    return { H::Translation, H::Rigid, H::Similarity, H::Affine, H::Affine };
+  }
+  if (whichTransform.substr(0, 3) == "tv[" && whichTransform.size() >= 5)
+  {
+    nTimeSteps = static_cast<unsigned int>(std::strtoul(whichTransform.c_str() + 3, nullptr, 10));
+    return { H::TimeVaryingVelocityField };
+  }
+  const typename H::XfrmMethod xfrmMethod = m_Helper->StringToXfrmMethod(whichTransform);
+  if (xfrmMethod != H::UnknownXfrm)
+  {
+    return { xfrmMethod };
+  }
+  return {};
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+unsigned int
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetNumberOfStageFields(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod,
+  unsigned int                                nTimeSteps)
+{
+  switch (xfrmMethod)
+  {
+    case RegistrationHelperType::SyN:
+    case RegistrationHelperType::BSplineSyN:
+      return 8; // both half transforms and their inverses, both metric gradients, the update and the result
+    case RegistrationHelperType::Exponential:
+    case RegistrationHelperType::BSplineExponential:
+      return 6;
+    case RegistrationHelperType::TimeVaryingVelocityField:
+    case RegistrationHelperType::TimeVaryingBSplineVelocityField:
+      return 2 * nTimeSteps + 4; // the velocity field and its update, and the integrated fields
+    case RegistrationHelperType::GaussianDisplacementField:
+    case RegistrationHelperType::BSplineDisplacementField:
+      return 3;
+    case RegistrationHelperType::BSpline:
+      return 2; // the metric gradient, and the control points are small
+    default:
+      return 0;
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+SizeValueType
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::EstimatePeakMemory(
+  unsigned int deformableShrinkFactor,
+  bool         cachingStages) const
+{
+  const FixedImageType *  fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+  if (fixedImage == nullptr || movingImage == nullptr)
+  {
+    itkExceptionMacro(<< "The fixed and moving images are needed to estimate the peak memory.");
+  }
+  using InternalPixelType = typename InternalImageType::PixelType;
+  const double fixedVoxels = fixedImage->GetLargestPossibleRegion().GetNumberOfPixels();
+  const double movingVoxels = movingImage->GetLargestPossibleRegion().GetNumberOfPixels();
+  const double channels = 1.0 + m_Channels.size(); // the channels are assumed to be as large as the main images
+  const double fieldVoxelBytes = ImageDimension * sizeof(ParametersValueType);
+
+  // The inputs, and their copies in the internal pixel type
+  double inputs = fixedVoxels * sizeof(FixedPixelType) + movingVoxels * sizeof(MovingPixelType);
+  if (!std::is_same<FixedPixelType, InternalPixelType>::value)
+  {
+    inputs += fixedVoxels * sizeof(InternalPixelType);
+  }
+  if (!std::is_same<MovingPixelType, InternalPixelType>::value)
+  {
+    inputs += movingVoxels * sizeof(InternalPixelType);
+  }
+  inputs *= channels;
+
+  // The finest level of each stage dominates its memory
+  unsigned int       nTimeSteps = 0;
+  const auto         stages = this->GetStageTransforms(nTimeSteps);
+  const unsigned int finestShrinkFactor = m_ShrinkFactors.empty() ? 1u : std::max(m_ShrinkFactors.back(), 1u);
+  double             stagesPeak = 0.0;
+  double             resultFields = 0.0; // bytes of the deformable stages' results
+  for (const auto xfrmMethod : stages)
+  {
+    const unsigned int numberOfFields = Self::GetNumberOfStageFields(xfrmMethod, nTimeSteps);
+    const unsigned int shrinkFactor =
+      numberOfFields > 0 ? std::max(finestShrinkFactor, deformableShrinkFactor) : finestShrinkFactor;
+    const double levelScale = std::pow(1.0 / shrinkFactor, double(ImageDimension));
+
+    // the pyramid smooths at full resolution, then shrinks
+    double stage = (fixedVoxels + movingVoxels) * sizeof(InternalPixelType) * (1.0 + levelScale) * channels;
+    if (m_UseGradientFilter)
+    {
+      stage += (fixedVoxels + movingVoxels) * levelScale * fieldVoxelBytes * channels;
+    }
+    stage += numberOfFields * fixedVoxels * levelScale * fieldVoxelBytes;
+    stagesPeak = std::max(stagesPeak, resultFields + stage);
+    if (numberOfFields > 0)
+    {
+      resultFields += 2.0 * fixedVoxels * levelScale * fieldVoxelBytes; // forward and inverse
+    }
+  }
+
+  // After the stages: the cache keeps its own copy of the result, in float with StoreFieldsInFloat,
+  // subsampling copies the fields, and the dense displacement field of UseDisplacementFieldWarping
+  // is composed at full resolution
+  const double cacheFieldBytesRatio = m_StoreFieldsInFloat ? double(sizeof(float)) / sizeof(ParametersValueType) : 1.0;
+  double       results = resultFields * (1.0 + (cachingStages ? cacheFieldBytesRatio : 0.0));
+  if (m_DisplacementFieldSubsamplingFactor > 1)
+  {
+    results += resultFields * std::pow(1.0 / m_DisplacementFieldSubsamplingFactor, double(ImageDimension));
+  }
+  if (m_UseDisplacementFieldWarping && resultFields > 0.0)
+  {
+    results += fixedVoxels * fieldVoxelBytes;
+  }
+  return static_cast<SizeValueType>(inputs + std::max(stagesPeak, results));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ApplyMemoryBudget()
+{
+  if (m_CachingStages && this->EstimatePeakMemory(1, true) > m_MemoryBudget)
+  {
+    itkDebugMacro("Not caching the stages, to stay within the memory budget of " << m_MemoryBudget << " bytes");
+    m_CachingStages = false;
+  }
+  const unsigned int coarsestShrinkFactor =
+    m_ShrinkFactors.empty() ? 1u : *std::max_element(m_ShrinkFactors.begin(), m_ShrinkFactors.end());
+  SizeValueType estimate = this->EstimatePeakMemory(m_MemoryBudgetShrinkFactor, m_CachingStages);
+  while (estimate > m_MemoryBudget && m_MemoryBudgetShrinkFactor < coarsestShrinkFactor)
+  {
+    ++m_MemoryBudgetShrinkFactor;
+    estimate = this->EstimatePeakMemory(m_MemoryBudgetShrinkFactor, m_CachingStages);
+  }
+  if (estimate > m_MemoryBudget)
+  {
+    itkExceptionMacro(<< "The estimated peak memory of " << estimate << " bytes exceeds the memory budget of "
+                      << m_MemoryBudget << " bytes, even with the deformable fields at shrink factor "
+                      << m_MemoryBudgetShrinkFactor << ".");
+  }
+  itkDebugMacro("Estimated peak memory: " << estimate << " bytes, with the deformable fields at shrink factor "
+                                          << m_MemoryBudgetShrinkFactor);
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+double
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::EstimateStageWork(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod,
+  unsigned int                                nTimeSteps) const
+{
+  const bool                      affineType = Self::IsLinearTransform(xfrmMethod);
+  const std::vector<unsigned int> iterations =
+    this->GetStageIterations(affineType ? m_AffineIterations : m_SynIterations);
+  double work = 0.0;
+  for (std::size_t level = 0; level < iterations.size(); ++level)
+  {
+    // the shrink factors are matched from the finest level
+    const std::size_t  fromFinest = iterations.size() - 1 - level;
+    const unsigned int shrinkFactor =
+      fromFinest < m_ShrinkFactors.size() ? m_ShrinkFactors[m_ShrinkFactors.size() - 1 - fromFinest] : 1;
+    work += iterations[level] * std::pow(1.0 / std::max(1u, shrinkFactor), double(ImageDimension));
+  }
+  std::string samplingStrategy = affineType ? m_AffineSamplingStrategy : m_SynSamplingStrategy;
+  std::transform(samplingStrategy.begin(), samplingStrategy.end(), samplingStrategy.begin(), tolower);
+  if (affineType && samplingStrategy != "none") // the deformable stages update their fields at every voxel
+  {
+    work *= m_SamplingRate;
+  }
+  // A deformable iteration computes, smooths and composes several fields at every voxel,
+  // where a linear iteration only accumulates the metric's gradient
+  return work * std::max(1u, Self::GetNumberOfStageFields(xfrmMethod, nTimeSteps));
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ShareTimeBudget(
+  double                                work,
+  double                                remainingWork,
+  std::chrono::steady_clock::time_point end)
+{
+  const auto   now = std::chrono::steady_clock::now();
+  const double share = work > 0.0 && remainingWork > 0.0 ? std::min(1.0, work / remainingWork) : 1.0;
+  m_StageDeadline = end;
+  if (now < end)
+  {
+    using DurationType = std::chrono::steady_clock::duration;
+    m_StageDeadline = now + std::chrono::duration_cast<DurationType>((end - now) * share);
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::AdaptiveStageRegistration(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod,
+  const InitialTransformType *                initialTransform,
+  const StageInputs &                         inputs,
+  bool                                        useMasks) -> typename OutputTransformType::Pointer
+{
+  const std::vector<unsigned int> originalIterations = m_AffineIterations;
+  const std::vector<unsigned int> iterations = this->GetStageIterations(m_AffineIterations);
+  const std::vector<unsigned int> shrinkFactors = m_ShrinkFactors;
+  const std::vector<float>        smoothingSigmas = m_SmoothingSigmas;
+  const std::size_t               numberOfLevels = iterations.size();
+  if (shrinkFactors.size() < numberOfLevels || smoothingSigmas.size() < numberOfLevels)
+  {
+    using namespace print_helper;
+    itkExceptionMacro(<< "ShrinkFactors: " << shrinkFactors << " and SmoothingSigmas: " << smoothingSigmas
+                      << " must not be shorter than iterations: " << iterations);
+  }
+  const std::size_t shrinkOffset = shrinkFactors.size() - numberOfLevels;
+  const std::size_t sigmaOffset = smoothingSigmas.size() - numberOfLevels;
+
+  // Each level is run as a single-level stage, by temporarily replacing the pyramid parameters
+  auto restoreParameters = [&]() {
+    m_AffineIterations = originalIterations;
+    m_ShrinkFactors = shrinkFactors;
+    m_SmoothingSigmas = smoothingSigmas;
+  };
+  // one iteration costs about as much as the number of voxels at its level
+  auto levelCost = [&](std::size_t level) {
+    return std::pow(1.0 / shrinkFactors[shrinkOffset + level], double(ImageDimension));
+  };
+  double remainingWork = 0.0; // of the levels not run yet, to share the stage's time budget between them
+  for (std::size_t level = 0; level < numberOfLevels; ++level)
+  {
+    remainingWork += iterations[level] * levelCost(level);
+  }
+  const std::chrono::steady_clock::time_point stageDeadline = m_StageDeadline;
+
+  typename OutputTransformType::Pointer compositeTransform;
+  const InitialTransformType *          levelInitialTransform = initialTransform;
+  double                                spareWork = 0.0; // unused iterations, in iterations at full resolution
+  const std::size_t                     profileStart = m_RegistrationProfile.size();
+  unsigned int                          completedLevels = 0;
+  bool                                  completed = true;
+  m_RunningStageLevels = true;
+  try
+  {
+    for (std::size_t level = 0; level < numberOfLevels; ++level)
+    {
+      if (iterations[level] == 0)
+      {
+        continue;
+      }
+      if (m_TimeBudget > 0.0 && std::chrono::steady_clock::now() >= stageDeadline)
+      {
+        completed = false; // the stage's time budget ran out
+        m_Truncated = true;
+        break;
+      }
+      const double       cost = levelCost(level);
+      const unsigned int carriedOver = m_AdaptiveIterations ? static_cast<unsigned int>(spareWork / cost) : 0;
+      const unsigned int limit = iterations[level] + carriedOver;
+      spareWork -= carriedOver * cost;
+      if (m_TimeBudget > 0.0)
+      {
+        this->ShareTimeBudget(limit * cost, remainingWork + carriedOver * cost, stageDeadline);
+      }
+      remainingWork -= iterations[level] * cost;
+
+      m_AffineIterations = { limit };
+      m_ShrinkFactors = { shrinkFactors[shrinkOffset + level] };
+      m_SmoothingSigmas = { smoothingSigmas[sigmaOffset + level] };
+      const std::size_t profileSize = m_RegistrationProfile.size();
+      compositeTransform = this->SingleStageRegistration(xfrmMethod, levelInitialTransform, inputs, useMasks);
+      levelInitialTransform = compositeTransform; // the completed levels are kept if a later one is stopped
+      if (m_RegistrationProfile.size() == profileSize || m_RegistrationProfile.back().Interrupted)
+      {
+        completed = false; // skipped or stopped, so it added no transform
+        continue;
+      }
+      ++completedLevels;
+
+      const auto &       levelProfiles = m_RegistrationProfile.back().Levels;
+      const unsigned int used = levelProfiles.empty() ? limit : std::min(limit, levelProfiles.back().Iterations);
+      spareWork += (limit - used) * cost;
+      itkDebugMacro("Adaptive level " << level << " of " << Self::XfrmMethodToString(xfrmMethod) << ": " << used
+                                      << " of " << limit << " iterations used (" << carriedOver
+                                      << " carried over from coarser levels)");
+    }
+  }
+  catch (...)
+  {
+    m_RunningStageLevels = false;
+    m_StageDeadline = stageDeadline;
+    restoreParameters();
+    throw;
+  }
+  m_RunningStageLevels = false;
+  m_StageDeadline = stageDeadline;
+  restoreParameters();
+
+  if (compositeTransform.IsNull()) // no level has any iteration
+  {
+    compositeTransform = Self::MakeCompositeTransform(initialTransform);
+  }
+
+  // The levels are merged back into one stage, as if it had been run in one go
+  if (completedLevels > 1)
+  {
+    const unsigned int firstLevel = compositeTransform->GetNumberOfTransforms() - completedLevels;
+    using MatrixOffsetTransformType = MatrixOffsetTransformBase<ParametersValueType, ImageDimension, ImageDimension>;
+    typename InitialTransformType::Pointer stageTransform =
+      Self::template ComposeLevelTransforms<MatrixOffsetTransformType>(compositeTransform, firstLevel);
+    if (stageTransform.IsNull())
+    {
+      using TranslationTransformType = TranslationTransform<ParametersValueType, ImageDimension>;
+      stageTransform = Self::template ComposeLevelTransforms<TranslationTransformType>(compositeTransform, firstLevel);
+    }
+    if (stageTransform.IsNotNull())
+    {
+      typename OutputTransformType::Pointer stageCompositeTransform = OutputTransformType::New();
+      for (unsigned int i = 0; i < firstLevel; ++i)
+      {
+        stageCompositeTransform->AddTransform(compositeTransform->GetNthTransform(i));
+      }
+      stageCompositeTransform->AddTransform(stageTransform);
+      compositeTransform = stageCompositeTransform;
+    }
+    else
+    {
+      itkWarningMacro(<< "The levels' transforms of the " << Self::XfrmMethodToString(xfrmMethod)
+                      << " stage cannot be composed, so each level keeps its own transform.");
+    }
+  }
+  if (m_RegistrationProfile.size() > profileStart)
+  {
+    ANTSRegistrationStageProfile & stageProfile = m_RegistrationProfile[profileStart];
+    for (std::size_t i = profileStart + 1; i < m_RegistrationProfile.size(); ++i)
+    {
+      const ANTSRegistrationStageProfile & levelProfile = m_RegistrationProfile[i];
+      stageProfile.WallTime += levelProfile.WallTime;
+      stageProfile.ProcessPeakResidentMemory =
+        std::max(stageProfile.ProcessPeakResidentMemory, levelProfile.ProcessPeakResidentMemory);
+      stageProfile.Levels.insert(stageProfile.Levels.end(), levelProfile.Levels.begin(), levelProfile.Levels.end());
+    }
+    stageProfile.Interrupted = !completed;
+    m_RegistrationProfile.resize(profileStart + 1);
+  }
+  return compositeTransform;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+bool
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::RunsStageByLevel(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod) const
+{
+  return !m_RunningStageLevels && (m_AdaptiveIterations || m_TimeBudget > 0.0) &&
+         Self::IsLinearTransform(xfrmMethod) && m_AffineIterations.size() > 1;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TLinearTransform>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ComposeLevelTransforms(
+  const OutputTransformType * compositeTransform,
+  unsigned int                firstLevel) -> typename InitialTransformType::Pointer
+{
+  std::vector<const TLinearTransform *> levelTransforms;
+  for (unsigned int i = firstLevel; i < compositeTransform->GetNumberOfTransforms(); ++i)
+  {
+    const auto * levelTransform =
+      dynamic_cast<const TLinearTransform *>(compositeTransform->GetNthTransformConstPointer(i));
+    if (levelTransform == nullptr)
+    {
+      return nullptr;
+    }
+    levelTransforms.push_back(levelTransform);
+  }
+
+  // The last transform of a composite transform is applied first, so each level comes before the coarser ones
+  typename InitialTransformType::Pointer stageTransform = levelTransforms.front()->Clone();
+  auto * composedTransform = static_cast<TLinearTransform *>(stageTransform.GetPointer());
+  try
+  {
+    for (std::size_t level = 1; level < levelTransforms.size(); ++level)
+    {
+      composedTransform->Compose(levelTransforms[level], true);
+    }
+  }
+  catch (const ExceptionObject &)
+  {
+    return nullptr; // e.g. a rigid transform rejecting a matrix which is not orthogonal within its tolerance
+  }
+  return stageTransform;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::string
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeStageKey(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod,
+  const InitialTransformType *                initialTransform,
+  bool                                        useMasks,
+  unsigned                                    nTimeSteps) const
+{
+  std::ostringstream key;
+  key.precision(17);
+
+  // The stages are chained, so a stage is only valid if the one before it is
+  if (m_StageIndex > 0)
+  {
+    key << m_StageCache[m_StageIndex - 1].Key << "\n";
+  }
+  else if (this->GetWarmStartTransform() != nullptr)
+  {
+    // the initial transform is made from the warm-start transform by each Update()
+    key << "warm start: " << this->GetWarmStartTransform() << " " << this->GetWarmStartTransform()->GetMTime() << " "
+        << this->GetWarmStartTransformInput()->GetMTime() << " skip: " << m_WarmStartLevelsToSkip << "\n";
+  }
+  else if (initialTransform != nullptr)
+  {
+    key << "initial: " << initialTransform << " " << initialTransform->GetMTime() << " "
+        << (this->GetInitialTransformInput() ? this->GetInitialTransformInput()->GetMTime() : 0) << "\n";
+  }
+
+  key << "fixed: " << this->GetFixedImage()->GetMTime() << " moving: " << this->GetMovingImage()->GetMTime();
+  if (useMasks)
+  {
+    const LabelImageType * fixedMask = this->GetFixedMask();
+    const LabelImageType * movingMask = this->GetMovingMask();
+    key << " fixedMask: " << (fixedMask ? fixedMask->GetMTime() : 0)
+        << " movingMask: " << (movingMask ? movingMask->GetMTime() : 0);
+  }
+  for (unsigned int i = 0; i < this->GetNumberOfChannels(); ++i)
+  {
+    key << " channel: " << this->GetChannelFixedImage(i)->GetMTime() << " "
+        << this->GetChannelMovingImage(i)->GetMTime();
+  }
+  key << this->MakeStageParametersKey(xfrmMethod, nTimeSteps);
+  return key.str();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::string
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeStageParametersKey(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod,
+  unsigned                                    nTimeSteps) const
+{
+  using namespace print_helper;
+  std::ostringstream key;
+  key.precision(17);
+
+  const bool affineType = Self::IsLinearTransform(xfrmMethod);
+  key << " stage: " << Self::XfrmMethodToString(xfrmMethod);
+  if (affineType)
+  {
+    key << " metric: " << m_AffineMetric << " iterations: " << m_AffineIterations
+        << " sampling: " << m_AffineSamplingStrategy << " byLevel: " << this->RunsStageByLevel(xfrmMethod)
+        << " adaptive: " << m_AdaptiveIterations;
+  }
+  else
+  {
+    key << " metric: " << m_SynMetric << " iterations: " << m_SynIterations << " flowSigma: " << m_FlowSigma
+        << " totalSigma: " << m_TotalSigma << " timeSteps: " << nTimeSteps
+        << " band: " << (m_SparseSyN ? m_SparseSyNBandWidth : -1.0) << " sampling: " << m_SynSamplingStrategy
+        << " budgetShrink: " << m_MemoryBudgetShrinkFactor;
+    if (xfrmMethod == RegistrationHelperType::BSpline || xfrmMethod == RegistrationHelperType::BSplineSyN ||
+        xfrmMethod == RegistrationHelperType::BSplineDisplacementField)
+    {
+      key << " knotSpacing: " << m_BSplineKnotSpacing << " " << m_BSplineTotalFieldKnotSpacing
+          << " splineOrder: " << m_BSplineOrder;
+    }
+  }
+  key << " gradientStep: " << m_GradientStep << " samplingRate: " << m_SamplingRate << " bins: " << m_NumberOfBins
+      << " radius: " << m_Radius << " gradientFilter: " << m_UseGradientFilter << " shrink: " << m_ShrinkFactors
+      << " sigmas: " << m_SmoothingSigmas << " physical: " << m_SmoothingInPhysicalUnits
+      << " seed: " << this->GetRegistrationRandomSeed() << " restrict: " << m_RestrictTransformation
+      << " workUnits: " << (m_Deterministic ? MultiThreaderBase::GetGlobalDefaultNumberOfThreads() : 0u)
+      << " cropMargin: " << (m_CropToMasks ? m_CropMargin : -1.0) << " convergence: " << m_ConvergenceWindowSize
+      << " " << m_ConvergenceThreshold;
+  for (const Channel & channel : m_Channels)
+  {
+    key << " channel: " << channel.Weight << " " << channel.Metric;
+  }
+  return key.str();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::string
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeCheckpointKey(
+  typename RegistrationHelperType::XfrmMethod xfrmMethod,
+  const InitialTransformType *                initialTransform,
+  bool                                        useMasks,
+  unsigned                                    nTimeSteps) const
+{
+  std::ostringstream key;
+  key.precision(17);
+
+  // Like the stage cache, the stages are chained
+  if (!m_CheckpointStages.empty())
+  {
+    key << m_CheckpointStages.back().Key << "\n";
+  }
+  else if (this->GetWarmStartTransform() != nullptr)
+  {
+    key << "warm start: ";
+    Self::AppendTransformKey(key, this->GetWarmStartTransform());
+    key << " skip: " << m_WarmStartLevelsToSkip << "\n";
+  }
+  else
+  {
+    key << "initial: ";
+    Self::AppendTransformKey(key, initialTransform);
+    key << "\n";
+  }
+  key << m_CheckpointInputsKey << " masks: " << useMasks << this->MakeStageParametersKey(xfrmMethod, nTimeSteps);
+
+  // only the hash is kept, as the key contains the key of every previous stage
+  const std::string  fullKey = key.str();
+  std::ostringstream hash;
+  hash << std::hex << std::setw(16) << std::setfill('0') << Self::HashBytes(fullKey.data(), fullKey.size());
+  return hash.str();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::string
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeCheckpointInputsKey() const
+{
+  std::ostringstream key;
+  key.precision(17);
+  key << "fixed: ";
+  Self::AppendImageKey(key, this->GetFixedImage());
+  key << " moving: ";
+  Self::AppendImageKey(key, this->GetMovingImage());
+  if (this->GetFixedMask() != nullptr)
+  {
+    key << " fixedMask: ";
+    Self::AppendImageKey(key, this->GetFixedMask());
+  }
+  if (this->GetMovingMask() != nullptr)
+  {
+    key << " movingMask: ";
+    Self::AppendImageKey(key, this->GetMovingMask());
+  }
+  for (unsigned int i = 0; i < this->GetNumberOfChannels(); ++i)
+  {
+    key << " channel: ";
+    Self::AppendImageKey(key, this->GetChannelFixedImage(i));
+    key << " ";
+    Self::AppendImageKey(key, this->GetChannelMovingImage(i));
+  }
+  return key.str();
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::uint64_t
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::HashBytes(const void *  data,
+                                                                              std::size_t   size,
+                                                                              std::uint64_t hash)
+{
+  const auto * bytes = static_cast<const unsigned char *>(data);
+  for (std::size_t i = 0; i < size; ++i)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL; // FNV prime
+  }
+  return hash;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TImage>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::AppendImageKey(std::ostream & key,
+                                                                                   const TImage * image)
+{
+  const typename TImage::RegionType & region = image->GetBufferedRegion();
+  key << region.GetIndex() << " " << region.GetSize() << " " << image->GetOrigin() << " " << image->GetSpacing()
+      << " " << image->GetDirection() << " " << std::hex
+      << Self::HashBytes(image->GetBufferPointer(), region.GetNumberOfPixels() * sizeof(typename TImage::PixelType))
+      << std::dec;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::AppendTransformKey(
+  std::ostream &               key,
+  const InitialTransformType * transform)
+{
+  const typename OutputTransformType::Pointer flatTransform = OutputTransformType::New();
+  if (transform != nullptr)
+  {
+    Self::FlattenTransform(transform, flatTransform);
+  }
+  for (unsigned int i = 0; i < flatTransform->GetNumberOfTransforms(); ++i)
+  {
+    const InitialTransformType * leaf = flatTransform->GetNthTransformConstPointer(i);
+    const auto &                 fixedParameters = leaf->GetFixedParameters();
+    const auto &                 parameters = leaf->GetParameters();
+    key << leaf->GetTransformTypeAsString() << " " << std::hex
+        << Self::HashBytes(fixedParameters.data_block(), fixedParameters.Size() * sizeof(fixedParameters[0])) << " "
+        << Self::HashBytes(parameters.data_block(), parameters.Size() * sizeof(parameters[0])) << std::dec << "; ";
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::FlattenTransform(
+  const InitialTransformType * transform,
+  OutputTransformType *        flatTransform)
+{
+  auto * compositeTransform = dynamic_cast<const OutputTransformType *>(transform);
+  if (compositeTransform != nullptr)
+  {
+    for (unsigned int i = 0; i < compositeTransform->GetNumberOfTransforms(); ++i)
+    {
+      Self::FlattenTransform(compositeTransform->GetNthTransformConstPointer(i), flatTransform);
+    }
+  }
+  else
+  {
+    flatTransform->AddTransform(const_cast<InitialTransformType *>(transform));
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TOutputField, typename TInputField>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::CastField(const TInputField * field) ->
+  typename TOutputField::Pointer
+{
+  if (field == nullptr)
+  {
+    return nullptr;
+  }
+  if constexpr (std::is_same_v<TInputField, TOutputField>)
+  {
+    return const_cast<TOutputField *>(field);
+  }
+  else
+  {
+    using CastFilterType = CastImageFilter<TInputField, TOutputField>;
+    typename CastFilterType::Pointer castFilter = CastFilterType::New();
+    castFilter->SetInput(field);
+    castFilter->Update();
+    typename TOutputField::Pointer outputField = castFilter->GetOutput();
+    outputField->DisconnectPipeline();
+    return outputField;
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+auto
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GetCachedTransform(unsigned int stageIndex) ->
+  typename OutputTransformType::Pointer
+{
+  const StageCacheEntry & entry = m_StageCache[stageIndex];
+  if (entry.Transform.IsNotNull())
+  {
+    return entry.Transform;
+  }
+
+  typename OutputTransformType::Pointer compositeTransform = OutputTransformType::New();
+  for (const auto & reducedTransform : entry.ReducedTransforms)
+  {
+    // The stages share their earlier stages' transforms, so each one is converted back only once
+    typename TransformType::Pointer transform;
+    for (const auto & expanded : m_ExpandedTransforms)
+    {
+      if (expanded.first == reducedTransform)
+      {
+        transform = expanded.second;
+      }
+    }
+    if (transform.IsNull())
+    {
+      if (reducedTransform->Transform.IsNotNull())
+      {
+        transform = reducedTransform->Transform->Clone();
+      }
+      else
+      {
+        typename DisplacementFieldTransformType::Pointer displacementFieldTransform =
+          DisplacementFieldTransformType::New();
+        displacementFieldTransform->SetDisplacementField(
+          Self::CastField<DisplacementFieldType>(reducedTransform->Field.GetPointer()));
+        if (reducedTransform->InverseField.IsNotNull())
+        {
+          displacementFieldTransform->SetInverseDisplacementField(
+            Self::CastField<DisplacementFieldType>(reducedTransform->InverseField.GetPointer()));
+        }
+        transform = displacementFieldTransform;
+      }
+      m_ExpandedTransforms.emplace_back(reducedTransform, transform);
+    }
+    compositeTransform->AddTransform(transform);
+  }
+  return compositeTransform;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ReduceStageCache()
+{
+  // Flatten all the entries first, so that the transforms they share stay alive while they are looked up
+  std::vector<typename OutputTransformType::Pointer> flatTransforms(m_StageCache.size());
+  for (std::size_t i = 0; i < m_StageCache.size(); ++i)
+  {
+    if (m_StageCache[i].Transform.IsNotNull())
+    {
+      flatTransforms[i] = OutputTransformType::New();
+      Self::FlattenTransform(m_StageCache[i].Transform, flatTransforms[i]);
+    }
+  }
+
+  for (std::size_t i = 0; i < m_StageCache.size(); ++i)
+  {
+    if (flatTransforms[i].IsNull())
+    {
+      continue; // already reduced
+    }
+    StageCacheEntry & entry = m_StageCache[i];
+    entry.ReducedTransforms.clear();
+    for (unsigned int t = 0; t < flatTransforms[i]->GetNumberOfTransforms(); ++t)
+    {
+      typename TransformType::Pointer         transform = flatTransforms[i]->GetNthTransform(t);
+      std::shared_ptr<const ReducedTransform> reducedTransform;
+      for (const auto & expanded : m_ExpandedTransforms)
+      {
+        if (expanded.second == transform)
+        {
+          reducedTransform = expanded.first;
+        }
+      }
+      if (reducedTransform == nullptr)
+      {
+        auto   newReducedTransform = std::make_shared<ReducedTransform>();
+        auto * displacementFieldTransform = dynamic_cast<DisplacementFieldTransformType *>(transform.GetPointer());
+        if (displacementFieldTransform == nullptr)
+        {
+          newReducedTransform->Transform = transform->Clone(); // the result's transforms may be modified in place
+        }
+        else
+        {
+          newReducedTransform->Field =
+            Self::CastField<ReducedFieldType>(displacementFieldTransform->GetDisplacementField());
+          newReducedTransform->InverseField =
+            Self::CastField<ReducedFieldType>(displacementFieldTransform->GetInverseDisplacementField());
+        }
+        reducedTransform = newReducedTransform;
+        m_ExpandedTransforms.emplace_back(reducedTransform, transform);
+      }
+      entry.ReducedTransforms.push_back(reducedTransform);
+    }
+    entry.Transform = nullptr;
+  }
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+template <typename TFieldValue>
+bool
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::WriteCheckpointInverseFields(
+  const OutputTransformType * flatTransform,
+  const std::string &         fileName) const
+{
+  using FieldTransformType = DisplacementFieldTransform<TFieldValue, ImageDimension>;
+  using FieldCompositeTransformType = CompositeTransform<TFieldValue, ImageDimension>;
+  typename FieldCompositeTransformType::Pointer inverseFields = FieldCompositeTransformType::New();
+  bool                                          hasInverseFields = false;
+  for (unsigned int i = 0; i < flatTransform->GetNumberOfTransforms(); ++i)
+  {
+    auto * displacementFieldTransform =
+      dynamic_cast<const DisplacementFieldTransformType *>(flatTransform->GetNthTransformConstPointer(i));
+    if (displacementFieldTransform != nullptr && displacementFieldTransform->GetInverseDisplacementField() != nullptr)
+    {
+      typename FieldTransformType::Pointer inverseField = FieldTransformType::New();
+      inverseField->SetDisplacementField(Self::CastField<typename FieldTransformType::DisplacementFieldType>(
+        displacementFieldTransform->GetInverseDisplacementField()));
+      inverseFields->AddTransform(inverseField);
+      hasInverseFields = true;
+    }
+    else
+    {
+      inverseFields->AddTransform(IdentityTransform<TFieldValue, ImageDimension>::New());
+    }
+  }
+  if (!hasInverseFields)
+  {
+    return false;
+  }
+
+  using TransformWriterType = TransformFileWriterTemplate<TFieldValue>;
+  typename TransformWriterType::Pointer transformWriter = TransformWriterType::New();
+  transformWriter->SetInput(inverseFields);
+  transformWriter->SetFileName(fileName);
+  transformWriter->Update();
+  return true;
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+std::string
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeCheckpointFileName(const std::string & fileName,
+                                                                                           const std::string & suffix)
+{
+  const std::string::size_type directoryEnd = fileName.find_last_of("/\\");
+  const std::string::size_type extension = fileName.find_last_of('.');
+  if (extension == std::string::npos || (directoryEnd != std::string::npos && extension < directoryEnd))
+  {
+    return fileName + "." + suffix;
+  }
+  return fileName.substr(0, extension) + "." + suffix + fileName.substr(extension);
+}
+
+
+template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
+void
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::RecordCheckpointStage(
+  const std::string &                  key,
+  const OutputTransformType *          transform,
+  const ANTSRegistrationStageProfile & profile,
+  bool                                 write)
+{
+  const typename OutputTransformType::Pointer flatTransform = OutputTransformType::New();
+  Self::FlattenTransform(transform, flatTransform);
+
+  CheckpointStage stage;
+  stage.Key = key;
+  stage.TransformType = profile.TransformType;
+  stage.NumberOfTransforms = flatTransform->GetNumberOfTransforms();
+  for (const ANTSRegistrationLevelProfile & level : profile.Levels)
+  {
+    stage.Iterations.push_back(level.Iterations);
+  }
+  m_CheckpointStages.push_back(stage);
+  if (!write)
+  {
+    return;
+  }
+
+  // Each file is replaced by renaming a complete temporary file, the sidecar last
+  const std::string partialFileName = Self::MakeCheckpointFileName(m_CheckpointFileName, "partial");
+  using TransformWriterType = TransformFileWriterTemplate<ParametersValueType>;
+  typename TransformWriterType::Pointer transformWriter = TransformWriterType::New();
+
+  // Transform IO drops the inverse fields of displacement field transforms (e.g. SyN's), so they are written
+  // to their own file, with an identity in place of every transform which has none
+  const std::string inverseFileName = Self::MakeCheckpointFileName(m_CheckpointFileName, "inverse");
+  const std::string partialInverseFileName = Self::MakeCheckpointFileName(inverseFileName, "partial");
+  bool              hasInverseFields = false;
+  if (m_StoreFieldsInFloat)
+  {
+    hasInverseFields = this->WriteCheckpointInverseFields<float>(flatTransform, partialInverseFileName);
+  }
+  else
+  {
+    hasInverseFields = this->WriteCheckpointInverseFields<ParametersValueType>(flatTransform, partialInverseFileName);
+  }
+  if (hasInverseFields)
+  {
+    if (!itksys::SystemTools::RenameFile(partialInverseFileName, inverseFileName))
+    {
+      itkExceptionMacro(<< "Could not rename " << partialInverseFileName << " to " << inverseFileName);
+    }
+  }
+  else if (itksys::SystemTools::FileExists(inverseFileName, true))
+  {
+    itksys::SystemTools::RemoveFile(inverseFileName); // stale
+  }
+
+  transformWriter->SetInput(flatTransform);
+  transformWriter->SetFileName(partialFileName);
+  transformWriter->Update();
+  if (!itksys::SystemTools::RenameFile(partialFileName, m_CheckpointFileName))
   {
-    this->SetFixedImage(image);
+    itkExceptionMacro(<< "Could not rename " << partialFileName << " to " << m_CheckpointFileName);
   }
-  else if (index == 1)
+
+  const std::string sidecarFileName = m_CheckpointFileName + ".json";
+  const std::string partialSidecarFileName = Self::MakeCheckpointFileName(sidecarFileName, "partial");
   {
-    this->SetMovingImage(reinterpret_cast<const MovingImageType *>(image));
+    std::ofstream sidecar(partialSidecarFileName);
+    sidecar << "{\n  \"stages\": [";
+    for (std::size_t s = 0; s < m_CheckpointStages.size(); ++s)
+    {
+      const CheckpointStage & checkpointStage = m_CheckpointStages[s];
+      sidecar << (s ? ",\n    " : "\n    ") << "{\"transformType\": \"" << checkpointStage.TransformType
+              << "\", \"key\": \"" << checkpointStage.Key
+              << "\", \"numberOfTransforms\": " << checkpointStage.NumberOfTransforms << ", \"iterations\": [";
+      for (std::size_t level = 0; level < checkpointStage.Iterations.size(); ++level)
+      {
+        sidecar << (level ? ", " : "") << checkpointStage.Iterations[level];
+      }
+      sidecar << "]}";
+    }
+    sidecar << "\n  ]\n}\n";
+    if (!sidecar)
+    {
+      itkExceptionMacro(<< "Could not write " << partialSidecarFileName);
+    }
   }
-  else
+  if (!itksys::SystemTools::RenameFile(partialSidecarFileName, sidecarFileName))
   {
-    itkExceptionMacro(<< "Invalid index: " << index << ". Expected 0 (fixed) or 1 (moving).");
+    itkExceptionMacro(<< "Could not rename " << partialSidecarFileName << " to " << sidecarFileName);
   }
 }
 
 
 template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
 void
-ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::AllocateOutputs()
+ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::ReadCheckpoint()
 {
-  const DecoratedOutputTransformType * decoratedOutputForwardTransform = this->GetOutput(0);
-  if (!decoratedOutputForwardTransform || !decoratedOutputForwardTransform->Get())
+  m_ResumeStages.clear();
+  m_ResumeTransform = nullptr;
+  const std::string sidecarFileName = m_CheckpointFileName + ".json";
+  if (!itksys::SystemTools::FileExists(sidecarFileName, true) ||
+      !itksys::SystemTools::FileExists(m_CheckpointFileName, true))
   {
-    this->ProcessObject::SetNthOutput(0, MakeOutput(0));
+    itkDebugMacro("No checkpoint in " << m_CheckpointFileName << ", starting from the first stage");
+    return;
   }
 
-  const DecoratedOutputTransformType * decoratedOutputInverseTransform = this->GetOutput(1);
-  if (!decoratedOutputInverseTransform || !decoratedOutputInverseTransform->Get())
+  // The sidecar is written by RecordCheckpointStage(), with one stage per line
+  auto field = [](const std::string & line, const std::string & name) -> std::string {
+    const std::string::size_type start = line.find("\"" + name + "\": ");
+    if (start == std::string::npos)
+    {
+      throw std::runtime_error("missing " + name);
+    }
+    const std::string::size_type valueStart = start + name.size() + 4;
+    if (valueStart >= line.size())
+    {
+      throw std::runtime_error("missing value of " + name);
+    }
+    std::string::size_type       valueEnd = line[valueStart] == '[' ? line.find(']', valueStart) : valueStart;
+    valueEnd = line.find_first_of(",}", valueEnd);
+    std::string value = line.substr(valueStart, valueEnd - valueStart);
+    value.erase(std::remove_if(value.begin(), value.end(), [](char c) { return c == '"' || c == '[' || c == ']'; }),
+                value.end());
+    return value;
+  };
+  std::vector<CheckpointStage>          stages;
+  typename OutputTransformType::Pointer resumeTransform = OutputTransformType::New();
+  try
   {
-    this->ProcessObject::SetNthOutput(1, MakeOutput(1));
-  }
-}
+    std::ifstream sidecar(sidecarFileName);
+    std::string   line;
+    while (std::getline(sidecar, line))
+    {
+      if (line.find("\"key\"") == std::string::npos)
+      {
+        continue;
+      }
+      CheckpointStage stage;
+      stage.TransformType = field(line, "transformType");
+      stage.Key = field(line, "key");
+      stage.NumberOfTransforms = static_cast<unsigned int>(std::stoul(field(line, "numberOfTransforms")));
+      std::istringstream iterations(field(line, "iterations"));
+      std::string        levelIterations;
+      while (std::getline(iterations, levelIterations, ','))
+      {
+        stage.Iterations.push_back(static_cast<unsigned int>(std::stoul(levelIterations)));
+      }
+      stages.push_back(stage);
+    }
 
+    using TransformReaderType = TransformFileReaderTemplate<ParametersValueType>;
+    typename TransformReaderType::Pointer transformReader = TransformReaderType::New();
+    transformReader->SetFileName(m_CheckpointFileName);
+    transformReader->Update();
+    const auto *           transformList = transformReader->GetTransformList();
+    InitialTransformType * transform = nullptr;
+    if (!transformList->empty())
+    {
+      transform = dynamic_cast<InitialTransformType *>(transformList->front().GetPointer());
+    }
+    if (transform == nullptr)
+    {
+      throw std::runtime_error("no transform of the expected dimension in " + m_CheckpointFileName);
+    }
+    Self::FlattenTransform(transform, resumeTransform);
+  }
+  catch (const std::exception & error)
+  {
+    itkWarningMacro(<< "Ignoring the unreadable checkpoint " << m_CheckpointFileName << ": " << error.what());
+    return;
+  }
 
-template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
-auto
-ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::MakeOutput(DataObjectPointerArraySizeType)
-  -> DataObjectPointer
-{
-  typename OutputTransformType::Pointer ptr;
-  Self::MakeOutputTransform(ptr);
-  typename DecoratedOutputTransformType::Pointer decoratedOutputTransform = DecoratedOutputTransformType::New();
-  decoratedOutputTransform->Set(ptr);
-  return decoratedOutputTransform;
-}
+  // The transform is renamed before the sidecar, so a pre-emption between the two leaves a transform with the
+  // next stage's transforms too. They come after the ones of the sidecar's stages, which are resumed.
+  const auto beyondTransform = [&resumeTransform](const CheckpointStage & stage) {
+    return stage.NumberOfTransforms > resumeTransform->GetNumberOfTransforms();
+  };
+  if (stages.empty() || std::any_of(stages.begin(), stages.end(), beyondTransform))
+  {
+    itkWarningMacro(<< "Ignoring the incomplete checkpoint " << m_CheckpointFileName);
+    return;
+  }
+  const unsigned int numberOfTransforms = stages.back().NumberOfTransforms;
+  if (resumeTransform->GetNumberOfTransforms() > numberOfTransforms)
+  {
+    itkDebugMacro("The checkpoint's transform is ahead of its sidecar, resuming from its first "
+                  << numberOfTransforms << " transforms");
+    typename OutputTransformType::Pointer completedTransform = OutputTransformType::New();
+    for (unsigned int i = 0; i < numberOfTransforms; ++i)
+    {
+      completedTransform->AddTransform(resumeTransform->GetNthTransform(i));
+    }
+    resumeTransform = completedTransform;
+  }
 
+  // The inverse fields are put back into the displacement field transforms, if they match them
+  const std::string inverseFileName = Self::MakeCheckpointFileName(m_CheckpointFileName, "inverse");
+  if (itksys::SystemTools::FileExists(inverseFileName, true))
+  {
+    try
+    {
+      using TransformReaderType = TransformFileReaderTemplate<ParametersValueType>;
+      typename TransformReaderType::Pointer transformReader = TransformReaderType::New();
+      transformReader->SetFileName(inverseFileName);
+      transformReader->Update();
+      const auto * transformList = transformReader->GetTransformList();
+      auto *       inverseTransform =
+        transformList->empty() ? nullptr : dynamic_cast<InitialTransformType *>(transformList->front().GetPointer());
+      if (inverseTransform == nullptr)
+      {
+        throw std::runtime_error("no transform of the expected dimension");
+      }
+      typename OutputTransformType::Pointer inverseFields = OutputTransformType::New();
+      Self::FlattenTransform(inverseTransform, inverseFields);
+      // It is renamed first, so it may also be ahead of the checkpoint
+      if (inverseFields->GetNumberOfTransforms() < resumeTransform->GetNumberOfTransforms())
+      {
+        throw std::runtime_error("it has fewer transforms than the checkpoint");
+      }
+      std::vector<std::pair<DisplacementFieldTransformType *, DisplacementFieldType *>> matches;
+      for (unsigned int i = 0; i < resumeTransform->GetNumberOfTransforms(); ++i)
+      {
+        auto * displacementFieldTransform =
+          dynamic_cast<DisplacementFieldTransformType *>(resumeTransform->GetNthTransform(i).GetPointer());
+        auto * inverseField =
+          dynamic_cast<DisplacementFieldTransformType *>(inverseFields->GetNthTransform(i).GetPointer());
+        if (inverseField == nullptr)
+        {
+          continue;
+        }
+        if (displacementFieldTransform == nullptr ||
+            displacementFieldTransform->GetDisplacementField()->GetLargestPossibleRegion() !=
+              inverseField->GetDisplacementField()->GetLargestPossibleRegion())
+        {
+          throw std::runtime_error("its fields do not match the checkpoint");
+        }
+        matches.emplace_back(displacementFieldTransform, inverseField->GetModifiableDisplacementField());
+      }
+      for (const auto & match : matches)
+      {
+        match.first->SetInverseDisplacementField(match.second);
+      }
+    }
+    catch (const std::exception & error)
+    {
+      itkWarningMacro(<< "Ignoring the inverse fields " << inverseFileName << ": " << error.what());
+    }
+  }
+  for (unsigned int i = 0; i < resumeTransform->GetNumberOfTransforms(); ++i)
+  {
+    auto * displacementFieldTransform =
+      dynamic_cast<DisplacementFieldTransformType *>(resumeTransform->GetNthTransform(i).GetPointer());
+    if (displacementFieldTransform != nullptr && displacementFieldTransform->GetInverseDisplacementField() == nullptr)
+    {
+      itkWarningMacro(<< "The checkpoint " << m_CheckpointFileName << " has a displacement field without its inverse,"
+                      << " so the inverse transform is not available after resuming from it.");
+      break;
+    }
+  }
 
-template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
-template <typename TImage>
-auto
-ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::CastImageToInternalType(const TImage * inputImage) ->
-  typename InternalImageType::Pointer
-{
-  using CastFilterType = CastImageFilter<TImage, InternalImageType>;
-  typename CastFilterType::Pointer castFilter = CastFilterType::New();
-  castFilter->SetInput(inputImage);
-  castFilter->Update();
-  typename InternalImageType::Pointer outputImage = castFilter->GetOutput();
-  outputImage->DisconnectPipeline();
-  return outputImage;
+  m_ResumeStages = stages;
+  m_ResumeTransform = resumeTransform;
 }
 
 
 template <typename TFixedImage, typename TMovingImage, typename TParametersValueType>
-void
+auto
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SingleStageRegistration(
   typename RegistrationHelperType::XfrmMethod xfrmMethod,
   const InitialTransformType *                initialTransform,
-  typename InternalImageType::Pointer         fixedImage,
-  typename InternalImageType::Pointer         movingImage,
+  const StageInputs &                         inputs,
   bool                                        useMasks,
-  unsigned                                    nTimeSteps)
+  unsigned                                    nTimeSteps) -> typename OutputTransformType::Pointer
 {
+  if (m_TimeBudget > 0.0 && !m_RunningStageLevels)
+  {
+    // This stage's share of the time left, which the later stages get back if it is not used
+    const double work = this->EstimateStageWork(xfrmMethod, nTimeSteps);
+    double       remainingWork = work;
+    for (std::size_t i = m_BudgetStageIndex + 1; i < m_BudgetStages.size(); ++i)
+    {
+      remainingWork += this->EstimateStageWork(m_BudgetStages[i], nTimeSteps);
+    }
+    ++m_BudgetStageIndex;
+    this->ShareTimeBudget(work, remainingWork, m_Deadline);
+  }
+
+  // The first deformable stage resumes the deformation of the warm-start transform
+  typename OutputTransformType::Pointer warmStartedTransform;
+  if (m_WarmStartDeformableTransform.IsNotNull() && !Self::IsLinearTransform(xfrmMethod))
+  {
+    warmStartedTransform = OutputTransformType::New();
+    const typename OutputTransformType::Pointer stagesSoFar = Self::MakeCompositeTransform(initialTransform);
+    for (unsigned int i = 0; i < stagesSoFar->GetNumberOfTransforms(); ++i)
+    {
+      warmStartedTransform->AddTransform(stagesSoFar->GetNthTransform(i));
+    }
+    for (unsigned int i = 0; i < m_WarmStartDeformableTransform->GetNumberOfTransforms(); ++i)
+    {
+      warmStartedTransform->AddTransform(m_WarmStartDeformableTransform->GetNthTransform(i));
+    }
+    initialTransform = warmStartedTransform;
+    m_WarmStartDeformableTransform = nullptr;
+  }
+
+  // The levels of a stage run by AdaptiveStageRegistration() are cached and checkpointed as their stage
+  std::string checkpointKey;
+  if (!m_CheckpointFileName.empty() && !m_RunningStageLevels)
+  {
+    checkpointKey = this->MakeCheckpointKey(xfrmMethod, initialTransform, useMasks, nTimeSteps);
+    const std::size_t ordinal = m_CheckpointStages.size();
+    if (ordinal >= m_ResumeStages.size() || m_ResumeStages[ordinal].Key != checkpointKey)
+    {
+      m_ResumeStages.clear(); // the checkpoint is stale from this stage on
+      m_ResumeTransform = nullptr;
+    }
+  }
+
+  std::string stageKey;
+  if (m_CachingStages && !m_RunningStageLevels)
+  {
+    stageKey = this->MakeStageKey(xfrmMethod, initialTransform, useMasks, nTimeSteps);
+    if (m_StageIndex < m_StageCache.size() && m_StageCache[m_StageIndex].Key == stageKey)
+    {
+      typename OutputTransformType::Pointer cachedTransform = this->GetCachedTransform(m_StageIndex);
+      const StageCacheEntry &               entry = m_StageCache[m_StageIndex++];
+      m_RegistrationProfile.push_back(entry.Profile);
+      m_RegistrationProfile.back().Reused = true;
+      itkDebugMacro("Reusing the cached result of stage " << m_StageIndex - 1 << ": " << entry.Profile.TransformType);
+      if (!checkpointKey.empty())
+      {
+        this->RecordCheckpointStage(checkpointKey, cachedTransform, entry.Profile, m_ResumeStages.empty());
+      }
+      return cachedTransform;
+    }
+    m_StageCache.resize(m_StageIndex); // this stage and all the later ones are stale
+  }
+
+  if (!m_ResumeStages.empty())
+  {
+    // The checkpoint holds the result of its last stage, which starts with the results of the earlier stages
+    const CheckpointStage &               resumedStage = m_ResumeStages[m_CheckpointStages.size()];
+    typename OutputTransformType::Pointer compositeTransform = OutputTransformType::New();
+    for (unsigned int i = 0; i < resumedStage.NumberOfTransforms; ++i)
+    {
+      compositeTransform->AddTransform(m_ResumeTransform->GetNthTransform(i));
+    }
+    ANTSRegistrationStageProfile stageProfile;
+    stageProfile.TransformType = resumedStage.TransformType;
+    stageProfile.Reused = true;
+    for (unsigned int iterations : resumedStage.Iterations)
+    {
+      stageProfile.Levels.emplace_back();
+      stageProfile.Levels.back().Iterations = iterations;
+    }
+    m_RegistrationProfile.push_back(stageProfile);
+    itkDebugMacro("Resuming stage " << m_CheckpointStages.size() << " from the checkpoint: "
+                                    << resumedStage.TransformType);
+    this->RecordCheckpointStage(checkpointKey, compositeTransform, stageProfile, false);
+    if (m_CachingStages)
+    {
+      m_StageCache.push_back({ stageKey, compositeTransform, stageProfile, {} });
+      ++m_StageIndex;
+    }
+    return compositeTransform;
+  }
+
+  // Run level by level, so that the completed levels are kept if the time budget runs out
+  if (this->RunsStageByLevel(xfrmMethod))
+  {
+    const std::size_t                     profileSize = m_RegistrationProfile.size();
+    typename OutputTransformType::Pointer compositeTransform =
+      this->AdaptiveStageRegistration(xfrmMethod, initialTransform, inputs, useMasks);
+    if (m_RegistrationProfile.size() > profileSize && !m_RegistrationProfile.back().Interrupted)
+    {
+      if (m_CachingStages)
+      {
+        m_StageCache.push_back({ stageKey, compositeTransform, m_RegistrationProfile.back(), {} });
+        ++m_StageIndex;
+      }
+      if (!checkpointKey.empty())
+      {
+        this->RecordCheckpointStage(checkpointKey, compositeTransform, m_RegistrationProfile.back(), true);
+      }
+    }
+    return compositeTransform;
+  }
+
+  if (this->GetAbortGenerateData())
+  {
+    ProcessAborted e(__FILE__, __LINE__);
+    e.SetDescription("Registration aborted.");
+    throw e;
+  }
+  if (this->IsTimeBudgetExhausted())
+  {
+    itkDebugMacro("Time budget exhausted, skipping stage " << Self::XfrmMethodToString(xfrmMethod));
+    m_Truncated = true;
+    return Self::MakeCompositeTransform(initialTransform);
+  }
+
   m_Helper = RegistrationHelperType::New(); // a convenient way to reset the helper
-  std::stringstream helperLogStream;
+  m_RegistrationProfile.emplace_back();
+  ANTSRegistrationStageProfile & stageProfile = m_RegistrationProfile.back();
+  stageProfile.TransformType = Self::XfrmMethodToString(xfrmMethod);
+  ANTSRegistrationLogBuffer helperLogBuffer(stageProfile); // records telemetry as the helper logs it
+  std::ostream              helperLogStream(&helperLogBuffer);
   m_Helper->SetLogStream(helperLogStream);
+
+  // The helper exposes no way to stop its optimizers, so an exception thrown after an iteration's
+  // log line is let through the log stream, and unwinds the helper up to DoRegistration() below.
+  bool interrupted = false;
+  helperLogBuffer.SetIterationCallback([this, &interrupted](const ANTSRegistrationStageProfile &) {
+    if (this->GetAbortGenerateData() || this->IsTimeBudgetExhausted())
+    {
+      interrupted = true;
+      throw StageInterruption{};
+    }
+  });
+  helperLogStream.exceptions(std::ios::badbit);
   m_Helper->SetMovingInitialTransform(initialTransform);
 
+  // In the sparse SyN mode, the deformable stages only evaluate the metric in a band around the fixed mask
+  const bool bandStage = inputs.BandFixedMask != nullptr &&
+                         (xfrmMethod == RegistrationHelperType::SyN ||
+                          xfrmMethod == RegistrationHelperType::BSplineSyN ||
+                          xfrmMethod == RegistrationHelperType::GaussianDisplacementField ||
+                          xfrmMethod == RegistrationHelperType::BSplineDisplacementField ||
+                          xfrmMethod == RegistrationHelperType::TimeVaryingVelocityField);
+  typename InternalImageType::Pointer fixedImage = bandStage ? inputs.BandFixedImage : inputs.FixedImage;
+  if (bandStage)
+  {
+    typename MaskSpatialObjectType::Pointer bandMask = inputs.BandFixedMask;
+    m_Helper->AddFixedImageMask(bandMask);
+  }
+
   if (useMasks)
   {
-    typename LabelImageType::Pointer fixedMask(const_cast<LabelImageType *>(this->GetFixedMask()));
-    if (fixedMask != nullptr)
+    typename MaskSpatialObjectType::Pointer fixedMask = inputs.FixedMask;
+    if (fixedMask != nullptr && !bandStage)
     {
       m_Helper->AddFixedImageMask(fixedMask);
     }
-    typename LabelImageType::Pointer movingMask(const_cast<LabelImageType *>(this->GetMovingMask()));
+    typename MaskSpatialObjectType::Pointer movingMask = inputs.MovingMask;
     if (movingMask != nullptr)
     {
       m_Helper->AddMovingImageMask(movingMask);
@@ -340,16 +2606,39 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SingleStageRe
         affineType = false;
       }
       break;
-      // BSpline is not available in ANTsPy, but is easy to support here
+      // The B-spline types are not available in ANTsPy, but they are much cheaper than dense SyN
       case RegistrationHelperType::BSpline: {
-        auto meshSizeAtBaseLevel =
-          m_Helper->CalculateMeshSizeForSpecifiedKnotSpacing(fixedImage, 50, 3); // TODO: expose grid spacing?
+        // the helper's B-spline transform is cubic
+        std::vector<unsigned int> meshSizeAtBaseLevel =
+          m_Helper->CalculateMeshSizeForSpecifiedKnotSpacing(fixedImage, m_BSplineKnotSpacing, 3);
         m_Helper->AddBSplineTransform(m_GradientStep, meshSizeAtBaseLevel);
         affineType = false;
       }
-      // These are not available in ANTsPy, so we don't support them either
-      case RegistrationHelperType::BSplineDisplacementField:
+      break;
       case RegistrationHelperType::BSplineSyN:
+      case RegistrationHelperType::BSplineDisplacementField: {
+        std::vector<unsigned int> updateMeshSizeAtBaseLevel =
+          m_Helper->CalculateMeshSizeForSpecifiedKnotSpacing(fixedImage, m_BSplineKnotSpacing, m_BSplineOrder);
+        std::vector<unsigned int> totalMeshSizeAtBaseLevel(ImageDimension, 0); // zero: no smoothing
+        if (m_BSplineTotalFieldKnotSpacing > 0.0)
+        {
+          totalMeshSizeAtBaseLevel = m_Helper->CalculateMeshSizeForSpecifiedKnotSpacing(
+            fixedImage, m_BSplineTotalFieldKnotSpacing, m_BSplineOrder);
+        }
+        if (xfrmMethod == RegistrationHelperType::BSplineSyN)
+        {
+          m_Helper->AddBSplineSyNTransform(
+            m_GradientStep, updateMeshSizeAtBaseLevel, totalMeshSizeAtBaseLevel, m_BSplineOrder);
+        }
+        else
+        {
+          m_Helper->AddBSplineDisplacementFieldTransform(
+            m_GradientStep, updateMeshSizeAtBaseLevel, totalMeshSizeAtBaseLevel, m_BSplineOrder);
+        }
+        affineType = false;
+      }
+      break;
+      // These are not available in ANTsPy, so we don't support them either
       case RegistrationHelperType::TimeVaryingBSplineVelocityField:
       case RegistrationHelperType::Exponential:
       case RegistrationHelperType::BSplineExponential:
@@ -359,15 +2648,8 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SingleStageRe
     }
   }
 
-  std::vector<unsigned int> iterations;
-  if (affineType)
-  {
-    iterations = m_AffineIterations;
-  }
-  else
-  {
-    iterations = m_SynIterations;
-  }
+  const std::vector<unsigned int> iterations =
+    this->GetStageIterations(affineType ? m_AffineIterations : m_SynIterations);
 
   // set the vector-vector parameters
   m_Helper->SetIterations({ iterations });
@@ -386,36 +2668,43 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SingleStageRe
     }
     m_Helper->SetSmoothingSigmas({ { m_SmoothingSigmas.begin() + sizeDiff, m_SmoothingSigmas.end() } });
   }
-  if (iterations.size() == m_ShrinkFactors.size())
+  std::vector<unsigned int> shrinkFactors = m_ShrinkFactors;
+  if (!affineType)
+  {
+    for (unsigned int & shrinkFactor : shrinkFactors) // coarsens the fields to stay within the memory budget
+    {
+      shrinkFactor = std::max(shrinkFactor, m_MemoryBudgetShrinkFactor);
+    }
+  }
+  if (iterations.size() == shrinkFactors.size())
   {
-    m_Helper->SetShrinkFactors({ m_ShrinkFactors });
+    m_Helper->SetShrinkFactors({ shrinkFactors });
   }
   else
   {
-    int sizeDiff = m_ShrinkFactors.size() - iterations.size();
+    int sizeDiff = shrinkFactors.size() - iterations.size();
     if (sizeDiff < 0)
     {
       using namespace print_helper;
-      itkExceptionMacro(<< "ShrinkFactors vector: " << m_ShrinkFactors
-                        << " is shorter than iterations: " << iterations);
+      itkExceptionMacro(<< "ShrinkFactors vector: " << shrinkFactors << " is shorter than iterations: " << iterations);
     }
-    m_Helper->SetShrinkFactors({ { m_ShrinkFactors.begin() + sizeDiff, m_ShrinkFactors.end() } });
+    m_Helper->SetShrinkFactors({ { shrinkFactors.begin() + sizeDiff, shrinkFactors.end() } });
   }
 
   m_Helper->SetSmoothingSigmasAreInPhysicalUnits({ m_SmoothingInPhysicalUnits });
-  if (m_RandomSeed != 0)
+  if (this->GetRegistrationRandomSeed() != 0)
   {
-    m_Helper->SetRegistrationRandomSeed(m_RandomSeed);
+    m_Helper->SetRegistrationRandomSeed(this->GetRegistrationRandomSeed());
   }
   if (!m_RestrictTransformation.empty())
   {
     m_Helper->SetRestrictDeformationOptimizerWeights({ m_RestrictTransformation });
   }
 
-  // match the length of the iterations vector by these defaulted parameters
-  std::vector<unsigned int> windows(iterations.size(), 10);
+  // match the length of the iterations vector
+  std::vector<unsigned int> windows(iterations.size(), m_ConvergenceWindowSize);
   m_Helper->SetConvergenceWindowSizes({ windows });
-  std::vector<ParametersValueType> thresholds(iterations.size(), 1e-6);
+  std::vector<ParametersValueType> thresholds(iterations.size(), m_ConvergenceThreshold);
   m_Helper->SetConvergenceThresholds({ thresholds });
 
   std::string metricType;
@@ -427,24 +2716,61 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SingleStageRe
   {
     metricType = this->GetSynMetric();
   }
-  std::transform(metricType.begin(), metricType.end(), metricType.begin(), tolower);
-  if (metricType == "jhmi")
+  stageProfile.Metric = metricType;
+  auto toHelperMetric = [this](std::string metric) {
+    std::transform(metric.begin(), metric.end(), metric.begin(), tolower);
+    if (metric == "jhmi")
+    {
+      metric = "mi2"; // ANTs uses "mi" for Mattes MI, see:
+      // https://github.com/ANTsX/ANTs/blob/v2.5.1/Examples/itkantsRegistrationHelper.hxx#L145-L152
+    }
+    return m_Helper->StringToMetricType(metric);
+  };
+  typename RegistrationHelperType::MetricEnumeration currentMetric = toHelperMetric(metricType);
+
+  std::string samplingStrategy = affineType ? m_AffineSamplingStrategy : m_SynSamplingStrategy;
+  std::transform(samplingStrategy.begin(), samplingStrategy.end(), samplingStrategy.begin(), tolower);
+  typename RegistrationHelperType::SamplingStrategy helperSamplingStrategy = RegistrationHelperType::regular;
+  ParametersValueType                               samplingRate = m_SamplingRate;
+  if (samplingStrategy == "none")
+  {
+    helperSamplingStrategy = RegistrationHelperType::none;
+    samplingRate = 1.0;
+  }
+  else if (samplingStrategy == "random")
+  {
+    helperSamplingStrategy = RegistrationHelperType::random;
+  }
+  else if (samplingStrategy == "stratified")
   {
-    metricType = "mi2"; // ANTs uses "mi" for Mattes MI, see:
-    // https://github.com/ANTsX/ANTs/blob/v2.5.1/Examples/itkantsRegistrationHelper.hxx#L145-L152
+    // The points outside of the fixed mask are discarded, so the grid is refined to keep the requested density inside
+    double maskFraction = 1.0;
+    if (bandStage)
+    {
+      maskFraction = inputs.BandFixedMaskFraction;
+    }
+    else if (useMasks && inputs.FixedMask != nullptr)
+    {
+      maskFraction = inputs.FixedMaskFraction;
+    }
+    samplingRate = std::min<ParametersValueType>(1.0, m_SamplingRate / std::max(maskFraction, 1e-6));
+  }
+  else if (samplingStrategy != "regular")
+  {
+    itkExceptionMacro(<< "Unsupported sampling strategy: " << samplingStrategy
+                      << ". Expected one of: None, Regular, Random, Stratified.");
   }
-  typename RegistrationHelperType::MetricEnumeration currentMetric = m_Helper->StringToMetricType(metricType);
 
   m_Helper->AddMetric(currentMetric,
                       fixedImage,
-                      movingImage,
+                      inputs.MovingImage,
                       nullptr,
                       nullptr,
                       nullptr,
                       nullptr,
                       0u,
                       1.0,
-                      RegistrationHelperType::regular,
+                      helperSamplingStrategy,
                       m_NumberOfBins,
                       m_Radius,
                       m_UseGradientFilter,
@@ -453,18 +2779,90 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::SingleStageRe
                       50u,
                       1.1,
                       false,
-                      m_SamplingRate,
+                      samplingRate,
                       std::sqrt(5),
                       std::sqrt(5));
-  int retVal = m_Helper->DoRegistration();
+
+  // The helper combines the metrics of a stage into one multi-metric, which shares the fixed image's domain
+  for (std::size_t i = 0; i < m_Channels.size(); ++i)
+  {
+    const std::string channelMetric = m_Channels[i].Metric.empty() ? metricType : m_Channels[i].Metric;
+    stageProfile.Metric += "+" + channelMetric;
+    m_Helper->AddMetric(toHelperMetric(channelMetric),
+                        bandStage ? inputs.BandChannelFixedImages[i] : inputs.ChannelFixedImages[i],
+                        inputs.ChannelMovingImages[i],
+                        nullptr,
+                        nullptr,
+                        nullptr,
+                        nullptr,
+                        0u,
+                        m_Channels[i].Weight,
+                        helperSamplingStrategy,
+                        m_NumberOfBins,
+                        m_Radius,
+                        m_UseGradientFilter,
+                        false,
+                        1.0,
+                        50u,
+                        1.1,
+                        false,
+                        samplingRate,
+                        std::sqrt(5),
+                        std::sqrt(5));
+  }
+  int retVal = EXIT_FAILURE;
+  try
+  {
+    retVal = m_Helper->DoRegistration();
+  }
+  catch (const StageInterruption &)
+  {
+    // handled below, also in case the helper caught it
+  }
+  helperLogBuffer.SetIterationCallback(nullptr);
+  helperLogStream.clear();
+  helperLogStream.flush();
+  helperLogBuffer.Finish();
+  m_Helper->SetLogStream(std::cout); // the buffer does not outlive this function
+  for (std::size_t level = 0; level < stageProfile.Levels.size() && level < iterations.size(); ++level)
+  {
+    stageProfile.Levels[level].IterationLimit = iterations[level];
+  }
+
+  if (interrupted)
+  {
+    stageProfile.Interrupted = true;
+    if (this->GetAbortGenerateData())
+    {
+      ProcessAborted e(__FILE__, __LINE__);
+      e.SetDescription("Registration aborted.");
+      throw e;
+    }
+    itkDebugMacro("Time budget exhausted during stage " << stageProfile.TransformType);
+    m_Truncated = true;
+    // The helper does not return a stopped stage's transform, so this stage or level is discarded
+    return Self::MakeCompositeTransform(initialTransform);
+  }
   if (retVal != EXIT_SUCCESS)
   {
-    itkExceptionMacro(<< "Registration failed. Helper's accumulated output:\n " << helperLogStream.str());
+    itkExceptionMacro(<< "Registration failed. Helper's accumulated output:\n " << helperLogBuffer.GetLog());
   }
   else
   {
-    itkDebugMacro("Registration successful. Helper's accumulated output:\n " << helperLogStream.str());
+    itkDebugMacro("Registration successful. Helper's accumulated output:\n " << helperLogBuffer.GetLog());
+  }
+
+  typename OutputTransformType::Pointer compositeTransform = m_Helper->GetModifiableCompositeTransform();
+  if (m_CachingStages && !m_RunningStageLevels)
+  {
+    m_StageCache.push_back({ stageKey, compositeTransform, stageProfile, {} });
+    ++m_StageIndex;
+  }
+  if (!checkpointKey.empty())
+  {
+    this->RecordCheckpointStage(checkpointKey, compositeTransform, stageProfile, true);
   }
+  return compositeTransform;
 }
 
 
@@ -472,7 +2870,53 @@ template <typename TFixedImage, typename TMovingImage, typename TParametersValue
 void
 ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GenerateData()
 {
+  m_ForwardTransformToInvert = nullptr; // the previous results are not needed anymore
+  m_ForwardTransformToCompose = nullptr;
+  if (m_RequiredGlobalNumberOfThreads > 0 &&
+      MultiThreaderBase::GetGlobalDefaultNumberOfThreads() != m_RequiredGlobalNumberOfThreads)
+  {
+    itkExceptionMacro(<< "The registration requires ITK's global default number of threads to be "
+                      << m_RequiredGlobalNumberOfThreads << ", but it is "
+                      << MultiThreaderBase::GetGlobalDefaultNumberOfThreads() << ".");
+  }
   this->AllocateOutputs();
+  m_RegistrationProfile.clear();
+  m_StageIndex = 0;
+  m_ExpandedTransforms.clear();
+  m_Truncated = false;
+  if (m_TimeBudget > 0.0)
+  {
+    using DurationType = std::chrono::steady_clock::duration;
+    m_Deadline = std::chrono::steady_clock::now() +
+                 std::chrono::duration_cast<DurationType>(std::chrono::duration<double>(m_TimeBudget));
+    m_StageDeadline = m_Deadline;
+    unsigned int nTimeSteps = 0;
+    m_BudgetStages = this->GetStageTransforms(nTimeSteps);
+    m_BudgetStageIndex = 0;
+  }
+  m_CachingStages = m_CacheStageResults;
+  m_MemoryBudgetShrinkFactor = 1;
+  if (m_MemoryBudget > 0)
+  {
+    this->ApplyMemoryBudget();
+  }
+  if (!m_CachingStages)
+  {
+    m_StageCache.clear();
+    m_InitializationCache = {};
+  }
+  m_CheckpointStages.clear();
+  m_ResumeStages.clear();
+  m_ResumeTransform = nullptr;
+  m_CheckpointInputsKey.clear();
+  if (!m_CheckpointFileName.empty())
+  {
+    m_CheckpointInputsKey = this->MakeCheckpointInputsKey();
+    if (m_ResumeFromCheckpoint)
+    {
+      this->ReadCheckpoint();
+    }
+  }
 
   this->UpdateProgress(0.01);
 
@@ -483,99 +2927,170 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GenerateData(
     initialTransform = decoratedInitialTransform->Get();
   }
 
-  typename InternalImageType::Pointer fixedImage = this->CastImageToInternalType(this->GetFixedImage());
-  typename InternalImageType::Pointer movingImage = this->CastImageToInternalType(this->GetMovingImage());
+  // A warm start replaces the initial transform: its linear part starts the first stage
+  typename OutputTransformType::Pointer warmStartLinearTransform;
+  m_WarmStartDeformableTransform = nullptr;
+  if (this->GetWarmStartTransform() != nullptr)
+  {
+    warmStartLinearTransform = OutputTransformType::New();
+    m_WarmStartDeformableTransform = OutputTransformType::New();
+    Self::SplitWarmStartTransform(
+      this->GetWarmStartTransform(), warmStartLinearTransform, m_WarmStartDeformableTransform);
+    initialTransform = nullptr;
+    if (warmStartLinearTransform->GetNumberOfTransforms() > 0)
+    {
+      initialTransform = warmStartLinearTransform;
+    }
+    if (m_WarmStartDeformableTransform->GetNumberOfTransforms() == 0)
+    {
+      m_WarmStartDeformableTransform = nullptr;
+    }
+  }
+
+  // Everything which does not depend on the stage is prepared once, and shared by all the stages
+  StageInputs inputs;
+  inputs.FixedImage = Self::CastImageToInternalType(this->GetFixedImage());
+  inputs.MovingImage = Self::CastImageToInternalType(this->GetMovingImage());
+  if (m_FixedMaskSpatialObject != nullptr && this->GetFixedMask() != nullptr &&
+      m_FixedMaskSpatialObject->GetImage() == this->GetFixedMask())
+  {
+    inputs.FixedMask = m_FixedMaskSpatialObject;
+  }
+  else
+  {
+    inputs.FixedMask = Self::MakeMaskSpatialObject(this->GetFixedMask());
+  }
+  inputs.MovingMask = Self::MakeMaskSpatialObject(this->GetMovingMask());
+  for (unsigned int i = 0; i < this->GetNumberOfChannels(); ++i)
+  {
+    inputs.ChannelFixedImages.push_back(Self::CastImageToInternalType(this->GetChannelFixedImage(i)));
+    inputs.ChannelMovingImages.push_back(Self::CastImageToInternalType(this->GetChannelMovingImage(i)));
+  }
+  if (m_CropToMasks)
+  {
+    // the crops keep their physical location, so the transforms need no adjustment
+    if (inputs.FixedMask)
+    {
+      inputs.FixedImage = Self::CropToMask(inputs.FixedImage, inputs.FixedMask, m_CropMargin);
+      for (auto & channelImage : inputs.ChannelFixedImages)
+      {
+        channelImage = Self::CropToMask(channelImage, inputs.FixedMask, m_CropMargin);
+      }
+    }
+    if (inputs.MovingMask)
+    {
+      inputs.MovingImage = Self::CropToMask(inputs.MovingImage, inputs.MovingMask, m_CropMargin);
+      for (auto & channelImage : inputs.ChannelMovingImages)
+      {
+        channelImage = Self::CropToMask(channelImage, inputs.MovingMask, m_CropMargin);
+      }
+    }
+  }
+  if (m_SparseSyN && this->GetFixedMask() != nullptr)
+  {
+    // one band width of margin leaves room for the smoothing to carry the field out of the band
+    inputs.BandFixedMask = Self::MakeMaskSpatialObject(Self::MakeMaskBand(this->GetFixedMask(), m_SparseSyNBandWidth));
+    inputs.BandFixedImage = Self::CropToMask(inputs.FixedImage, inputs.BandFixedMask, m_SparseSyNBandWidth);
+    for (const auto & channelImage : inputs.ChannelFixedImages)
+    {
+      inputs.BandChannelFixedImages.push_back(
+        Self::CropToMask(channelImage, inputs.BandFixedMask, m_SparseSyNBandWidth));
+    }
+    inputs.BandFixedMaskFraction = Self::ComputeMaskFraction(inputs.BandFixedMask, inputs.BandFixedImage);
+  }
+  if (inputs.FixedMask != nullptr)
+  {
+    inputs.FixedMaskFraction = Self::ComputeMaskFraction(inputs.FixedMask, inputs.FixedImage);
+  }
+
+  typename OutputTransformType::Pointer initializationTransform;
+  if (initialTransform == nullptr && this->GetWarmStartTransform() == nullptr)
+  {
+    initializationTransform = this->ComputeInitialTransform(inputs);
+    initialTransform = initializationTransform;
+  }
 
   std::string whichTransform = this->GetTypeOfTransform();
   std::transform(whichTransform.begin(), whichTransform.end(), whichTransform.begin(), tolower);
   typename RegistrationHelperType::XfrmMethod xfrmMethod = m_Helper->StringToXfrmMethod(whichTransform);
 
+  typename OutputTransformType::Pointer compositeTransform;
   if (whichTransform == "synonly")
   {
-    SingleStageRegistration(RegistrationHelperType::XfrmMethod::SyN, initialTransform, fixedImage, movingImage, true);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::SyN, initialTransform, inputs, true);
   }
   else if (whichTransform == "syn") // this is Affine + deformable
   {
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Affine, initialTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Affine, initialTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.15);
-    typename OutputTransformType::Pointer intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::SyN, intermediateTransform, fixedImage, movingImage, true);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::SyN, compositeTransform, inputs, true);
   }
   else if (xfrmMethod != RegistrationHelperType::XfrmMethod::UnknownXfrm) // a plain single-stage transform
   {
-    SingleStageRegistration(xfrmMethod, initialTransform, fixedImage, movingImage, true);
+    compositeTransform = SingleStageRegistration(xfrmMethod, initialTransform, inputs, true);
   }
   else if (whichTransform == "quickrigid")
   {
     auto originalIterations = m_AffineIterations;
     m_AffineIterations = { 20, 20, 0, 0 };
-    SingleStageRegistration(RegistrationHelperType::XfrmMethod::Rigid, initialTransform, fixedImage, movingImage, true);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Rigid, initialTransform, inputs, true);
     m_AffineIterations = originalIterations;
   }
   else if (whichTransform == "trsaa")
   {
     auto originalGradientStep = m_GradientStep;
     m_GradientStep = 1.0;
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Translation, initialTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform = SingleStageRegistration(
+      RegistrationHelperType::XfrmMethod::Translation, initialTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.15);
-    typename OutputTransformType::Pointer intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Rigid, intermediateTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Rigid, compositeTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.30);
-    intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Similarity, intermediateTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform = SingleStageRegistration(
+      RegistrationHelperType::XfrmMethod::Similarity, compositeTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.45);
-    intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Affine, intermediateTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Affine, compositeTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.65);
-    intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Affine, intermediateTransform, fixedImage, movingImage, true);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Affine, compositeTransform, inputs, true);
     m_GradientStep = originalGradientStep;
   }
   else if (whichTransform == "elastic")
   {
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Affine, initialTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Affine, initialTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.15);
-    typename OutputTransformType::Pointer intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(RegistrationHelperType::XfrmMethod::GaussianDisplacementField,
-                            intermediateTransform,
-                            fixedImage,
-                            movingImage,
-                            true);
+    compositeTransform = SingleStageRegistration(
+      RegistrationHelperType::XfrmMethod::GaussianDisplacementField, compositeTransform, inputs, true);
   }
   else if (whichTransform == "synra")
   {
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Rigid, initialTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Rigid, initialTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.15);
-    typename OutputTransformType::Pointer intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Affine, intermediateTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Affine, compositeTransform, inputs, m_MaskAllStages);
     this->UpdateProgress(0.30);
-    intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::SyN, intermediateTransform, fixedImage, movingImage, true);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::SyN, compositeTransform, inputs, true);
   }
   else if (whichTransform == "syncc")
   {
     std::string originalMetric = m_AffineMetric;
     m_AffineMetric = "CC";
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::Affine, initialTransform, fixedImage, movingImage, m_MaskAllStages);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::Affine, initialTransform, inputs, m_MaskAllStages);
     m_AffineMetric = originalMetric;
     this->UpdateProgress(0.15);
     originalMetric = m_SynMetric;
     m_SynMetric = "CC";
-    typename OutputTransformType::Pointer intermediateTransform = m_Helper->GetModifiableCompositeTransform();
-    SingleStageRegistration(
-      RegistrationHelperType::XfrmMethod::SyN, intermediateTransform, fixedImage, movingImage, true);
+    compositeTransform =
+      SingleStageRegistration(RegistrationHelperType::XfrmMethod::SyN, compositeTransform, inputs, true);
     m_SynMetric = originalMetric;
   }
   else if (whichTransform.substr(0, 3) == "tv[") // TV[n]
@@ -596,20 +3111,28 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GenerateData(
       itkExceptionMacro(<< "Cannot interpret: '" << whichTransform.substr(3, tsl - 4)
                         << "' as a number. Inner exception: " << err.what());
     }
-    SingleStageRegistration(RegistrationHelperType::XfrmMethod::TimeVaryingVelocityField,
-                            initialTransform,
-                            fixedImage,
-                            movingImage,
-                            true,
-                            timePoints);
+    compositeTransform = SingleStageRegistration(
+      RegistrationHelperType::XfrmMethod::TimeVaryingVelocityField, initialTransform, inputs, true, timePoints);
   }
   else
   {
     itkExceptionMacro(<< "Unsupported transform type: " << this->GetTypeOfTransform());
   }
+  m_WarmStartDeformableTransform = nullptr; // not resumed when there is no deformable stage
   this->UpdateProgress(0.90);
 
-  typename OutputTransformType::Pointer forwardTransform = m_Helper->GetModifiableCompositeTransform();
+  typename OutputTransformType::Pointer forwardTransform = compositeTransform;
+  if (m_CachingStages && m_StoreFieldsInFloat && !std::is_same_v<ParametersValueType, float>)
+  {
+    // the cache gets its own copy of the fields in float, so the result keeps the transforms in place
+    this->ReduceStageCache();
+  }
+  else if (m_CachingStages)
+  {
+    // collapsing and subsampling below may modify the transforms in place, so keep the cached ones intact
+    forwardTransform = dynamic_cast<OutputTransformType *>(compositeTransform->Clone().GetPointer());
+  }
+  m_ExpandedTransforms.clear(); // only shared by the stages of this Update()
   if (m_CollapseCompositeTransform)
   {
     forwardTransform = m_Helper->CollapseCompositeTransform(forwardTransform);
@@ -651,15 +3174,17 @@ ANTSRegistration<TFixedImage, TMovingImage, TParametersValueType>::GenerateData(
   }
   this->UpdateProgress(0.95);
 
-  typename OutputTransformType::Pointer inverseTransform = OutputTransformType::New();
-  if (forwardTransform->GetInverse(inverseTransform))
-  {
-    this->SetInverseTransform(inverseTransform);
-  }
-  else
+  // The last stage's helper still holds the images cast to the internal pixel type, and its metrics.
+  // Releasing them keeps them out of the memory held between updates, which EstimatePeakMemory() does not count.
+  m_Helper = RegistrationHelperType::New();
+
+  // Inverting can be costly for deformable transforms, so it is deferred until the inverse is requested
+  this->SetInverseTransform(nullptr);
+  if (m_ComputeInverseTransform)
   {
-    this->SetInverseTransform(nullptr);
+    m_ForwardTransformToInvert = forwardTransform;
   }
+  m_ForwardTransformToCompose = forwardTransform; // likewise for the dense displacement field
 
   this->UpdateProgress(1.0);
 }
@@ -0,0 +1,294 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSRegistrationProfile_h
+#define itkANTSRegistrationProfile_h
+
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "itksys/SystemInformation.hxx"
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <sys/resource.h>
+#endif
+
+namespace itk
+{
+
+/** \struct ANTSRegistrationLevelProfile
+ * \brief Telemetry of one pyramid level of a registration stage.
+ * \ingroup ANTsWasm
+ */
+struct ANTSRegistrationLevelProfile
+{
+  unsigned int Iterations{ 0 };
+  unsigned int IterationLimit{ 0 }; // iterations allowed for this level
+  double       FinalMetricValue{ std::numeric_limits<double>::quiet_NaN() };
+  double       FinalConvergenceValue{ std::numeric_limits<double>::quiet_NaN() };
+  double       WallTime{ 0.0 };                // seconds
+  std::size_t  ProcessPeakResidentMemory{ 0 }; // bytes, see ANTSRegistrationStageProfile
+};
+
+/** \struct ANTSRegistrationStageProfile
+ * \brief Telemetry of one registration stage, e.g. the affine part of "SyN".
+ *
+ * ProcessPeakResidentMemory is the high-water mark of the whole process at the end of the stage or level,
+ * not the memory used by that stage: it never decreases, so the stages after the largest one repeat its value,
+ * and it includes everything else the process runs, e.g. the other registrations of ANTSBatchRegistration.
+ * \ingroup ANTsWasm
+ */
+struct ANTSRegistrationStageProfile
+{
+  std::string                               TransformType;
+  std::string                               Metric;
+  double                                    WallTime{ 0.0 };                // seconds
+  std::size_t                               ProcessPeakResidentMemory{ 0 }; // bytes
+  bool                                      Reused{ false };      // result taken from the stage cache or checkpoint
+  bool                                      Interrupted{ false }; // stopped by the time budget or an abort
+  std::vector<ANTSRegistrationLevelProfile> Levels;
+};
+
+using ANTSRegistrationProfile = std::vector<ANTSRegistrationStageProfile>;
+
+/** Returns the peak resident memory of this process in bytes.
+ * Where the peak is not available, the current usage is returned instead. */
+inline std::size_t
+GetANTSRegistrationPeakResidentMemory()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0 && usage.ru_maxrss > 0)
+  {
+#  if defined(__APPLE__)
+    return static_cast<std::size_t>(usage.ru_maxrss); // bytes
+#  else
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024; // kilobytes
+#  endif
+  }
+#endif
+  itksys::SystemInformation systemInformation;
+  const long long           usedKiB = systemInformation.GetProcMemoryUsed();
+  return usedKiB > 0 ? static_cast<std::size_t>(usedKiB) * 1024 : 0;
+}
+
+/** Writes the profile as a JSON array of stages. */
+inline void
+WriteANTSRegistrationProfileJSON(const ANTSRegistrationProfile & profile, std::ostream & os)
+{
+  auto number = [&os](double value) {
+    if (value != value || value == std::numeric_limits<double>::infinity() ||
+        value == -std::numeric_limits<double>::infinity())
+    {
+      os << "null"; // JSON has no NaN nor infinity
+    }
+    else
+    {
+      os << std::setprecision(12) << value;
+    }
+  };
+
+  os << "[";
+  for (std::size_t s = 0; s < profile.size(); ++s)
+  {
+    const ANTSRegistrationStageProfile & stage = profile[s];
+    os << (s ? ",\n " : "\n ") << "{\"transformType\": \"" << stage.TransformType << "\", \"metric\": \""
+       << stage.Metric << "\", \"wallTime\": ";
+    number(stage.WallTime);
+    os << ", \"processPeakResidentMemory\": " << stage.ProcessPeakResidentMemory
+       << ", \"reused\": " << (stage.Reused ? "true" : "false")
+       << ", \"interrupted\": " << (stage.Interrupted ? "true" : "false") << ", \"levels\": [";
+    for (std::size_t l = 0; l < stage.Levels.size(); ++l)
+    {
+      const ANTSRegistrationLevelProfile & level = stage.Levels[l];
+      os << (l ? ", " : "") << "{\"iterations\": " << level.Iterations
+         << ", \"iterationLimit\": " << level.IterationLimit << ", \"finalMetricValue\": ";
+      number(level.FinalMetricValue);
+      os << ", \"finalConvergenceValue\": ";
+      number(level.FinalConvergenceValue);
+      os << ", \"wallTime\": ";
+      number(level.WallTime);
+      os << ", \"processPeakResidentMemory\": " << level.ProcessPeakResidentMemory << "}";
+    }
+    os << "]}";
+  }
+  os << "\n]\n";
+}
+
+/** \class ANTSRegistrationLogBuffer
+ *
+ * \brief Stream buffer given to the ANTs helper as its log stream.
+ *
+ * The helper reports its progress only through its log. This buffer keeps the whole log text
+ * (for error messages), and parses each line as soon as it is written, to fill a stage profile.
+ * It relies on the "Current level = " and "<n>DIAGNOSTIC, " lines written by ANTs' observers.
+ * An optional callback is invoked after each parsed iteration, which allows acting on progress.
+ *
+ * \ingroup ANTsWasm
+ */
+class ANTSRegistrationLogBuffer : public std::streambuf
+{
+public:
+  using ClockType = std::chrono::steady_clock;
+  using IterationCallbackType = std::function<void(const ANTSRegistrationStageProfile &)>;
+
+  explicit ANTSRegistrationLogBuffer(ANTSRegistrationStageProfile & stageProfile)
+    : m_StageProfile(stageProfile)
+    , m_StageStart(ClockType::now())
+    , m_LevelStart(m_StageStart)
+  {}
+
+  /** Invoked after each iteration of the optimizer. */
+  void
+  SetIterationCallback(IterationCallbackType callback)
+  {
+    m_IterationCallback = std::move(callback);
+  }
+
+  /** Returns all the text written so far. */
+  const std::string &
+  GetLog() const
+  {
+    return m_Log;
+  }
+
+  /** Records timing and memory of the last level and of the whole stage. */
+  void
+  Finish()
+  {
+    this->ParseLine();
+    this->FinishLevel();
+    m_StageProfile.WallTime = std::chrono::duration<double>(ClockType::now() - m_StageStart).count();
+    m_StageProfile.ProcessPeakResidentMemory = GetANTSRegistrationPeakResidentMemory();
+  }
+
+protected:
+  int_type
+  overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+      this->Put(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize
+  xsputn(const char * s, std::streamsize n) override
+  {
+    for (std::streamsize i = 0; i < n; ++i)
+    {
+      this->Put(s[i]);
+    }
+    return n;
+  }
+
+  void
+  Put(char c)
+  {
+    m_Log.push_back(c);
+    if (c == '\n')
+    {
+      this->ParseLine();
+    }
+    else
+    {
+      m_Line.push_back(c);
+    }
+  }
+
+  void
+  FinishLevel()
+  {
+    if (m_StageProfile.Levels.empty() || m_LevelFinished)
+    {
+      return;
+    }
+    ANTSRegistrationLevelProfile & level = m_StageProfile.Levels.back();
+    level.WallTime = std::chrono::duration<double>(ClockType::now() - m_LevelStart).count();
+    level.ProcessPeakResidentMemory = GetANTSRegistrationPeakResidentMemory();
+    m_LevelFinished = true;
+  }
+
+  void
+  ParseLine()
+  {
+    if (m_Line.find("Current level = ") != std::string::npos)
+    {
+      this->FinishLevel();
+      m_StageProfile.Levels.emplace_back();
+      m_LevelStart = ClockType::now();
+      m_LevelFinished = false;
+    }
+    else
+    {
+      // Iteration lines look like: " 1DIAGNOSTIC,     5, -3.1e-01, 2.5e-03, 1.2e+00, 2.1e-02, "
+      // while the header line starts with "XDIAGNOSTIC" and is skipped.
+      const std::string::size_type pos = m_Line.find("DIAGNOSTIC,");
+      if (pos != std::string::npos && pos > 0 && std::isdigit(static_cast<unsigned char>(m_Line[pos - 1])) &&
+          !m_StageProfile.Levels.empty())
+      {
+        std::istringstream fields(m_Line.substr(pos + 11));
+        std::string        iteration, metricValue, convergenceValue;
+        std::getline(fields, iteration, ',');
+        std::getline(fields, metricValue, ',');
+        std::getline(fields, convergenceValue, ',');
+        ANTSRegistrationLevelProfile & level = m_StageProfile.Levels.back();
+        try
+        {
+          level.Iterations = std::stoul(iteration);
+          level.FinalMetricValue = std::stod(metricValue);
+          level.FinalConvergenceValue = std::stod(convergenceValue);
+        }
+        catch (const std::exception &)
+        {
+          // not an iteration line after all
+        }
+        m_Line.clear();
+        if (m_IterationCallback)
+        {
+          m_IterationCallback(m_StageProfile);
+        }
+        return;
+      }
+    }
+    m_Line.clear();
+  }
+
+private:
+  ANTSRegistrationStageProfile & m_StageProfile;
+  IterationCallbackType          m_IterationCallback;
+  std::string                    m_Log;
+  std::string                    m_Line;
+  ClockType::time_point          m_StageStart;
+  ClockType::time_point          m_LevelStart;
+  bool                           m_LevelFinished{ false };
+};
+
+} // namespace itk
+
+#endif // itkANTSRegistrationProfile_h
@@ -0,0 +1,86 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSStreamingResampleImageFilter_h
+#define itkANTSStreamingResampleImageFilter_h
+
+#include "itkResampleImageFilter.h"
+
+namespace itk
+{
+
+/** \class ANTSStreamingResampleImageFilter
+ *
+ * \brief ResampleImageFilter which requests only the part of its input needed by each output region.
+ *
+ * ResampleImageFilter requests the whole input for non-linear transforms, so streaming its output
+ * (e.g. with ImageFileWriter::SetNumberOfStreamDivisions()) still reads and buffers all of the input.
+ * This filter maps the faces of the output's requested region through the transform, and requests their
+ * bounding box in the input, padded by the interpolator's radius. With an input which streams too,
+ * like an ImageFileReader of a MetaImage or NRRD file, peak memory is then bounded by the size of a slab.
+ *
+ * The bounding box of the faces contains the mapping of the whole region when the transform is
+ * a homeomorphism, which holds for the linear and diffeomorphic transforms produced by ANTSRegistration.
+ *
+ * \ingroup ANTsWasm
+ * \ingroup GeometricTransform
+ *
+ */
+template <typename TInputImage,
+          typename TOutputImage,
+          typename TInterpolatorPrecisionType = double,
+          typename TTransformPrecisionType = TInterpolatorPrecisionType>
+class ANTSStreamingResampleImageFilter
+  : public ResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>
+{
+public:
+  ITK_DISALLOW_COPY_AND_MOVE(ANTSStreamingResampleImageFilter);
+
+  static constexpr unsigned int ImageDimension = TOutputImage::ImageDimension;
+
+  using InputImageType = TInputImage;
+  using OutputImageType = TOutputImage;
+  using InputImageRegionType = typename InputImageType::RegionType;
+  using OutputImageRegionType = typename OutputImageType::RegionType;
+
+  /** Standard class aliases. */
+  using Self = ANTSStreamingResampleImageFilter;
+  using Superclass =
+    ResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Run-time type information. */
+  itkTypeMacro(ANTSStreamingResampleImageFilter, ResampleImageFilter);
+
+  /** Standard New macro. */
+  itkNewMacro(Self);
+
+protected:
+  ANTSStreamingResampleImageFilter() = default;
+  ~ANTSStreamingResampleImageFilter() override = default;
+
+  void
+  GenerateInputRequestedRegion() override;
+};
+} // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#  include "itkANTSStreamingResampleImageFilter.hxx"
+#endif
+
+#endif // itkANTSStreamingResampleImageFilter_h
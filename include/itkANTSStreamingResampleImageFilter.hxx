@@ -0,0 +1,126 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSStreamingResampleImageFilter_hxx
+#define itkANTSStreamingResampleImageFilter_hxx
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+#include "itkImageRegionIndexRange.h"
+#include "itkMultiThreaderBase.h"
+#include "itkANTSStreamingResampleImageFilter.h"
+
+namespace itk
+{
+template <typename TInputImage,
+          typename TOutputImage,
+          typename TInterpolatorPrecisionType,
+          typename TTransformPrecisionType>
+void
+ANTSStreamingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>::
+  GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  auto *                        input = const_cast<InputImageType *>(this->GetInput());
+  const auto *                  transform = this->GetTransform();
+  const OutputImageType *       output = this->GetOutput();
+  const OutputImageRegionType & outputRegion = output->GetRequestedRegion();
+  if (input == nullptr || transform == nullptr || outputRegion.GetNumberOfPixels() == 0)
+  {
+    return;
+  }
+
+  // Bounding box, in continuous input indices, of the mapped faces of the output region
+  ContinuousIndex<double, ImageDimension> lower;
+  ContinuousIndex<double, ImageDimension> upper;
+  lower.Fill(std::numeric_limits<double>::max());
+  upper.Fill(std::numeric_limits<double>::lowest());
+  std::mutex boundsMutex;
+  auto       boundFace = [&](const OutputImageRegionType & region) {
+    ContinuousIndex<double, ImageDimension>            regionLower;
+    ContinuousIndex<double, ImageDimension>            regionUpper;
+    typename Superclass::TransformType::InputPointType point;
+    regionLower.Fill(std::numeric_limits<double>::max());
+    regionUpper.Fill(std::numeric_limits<double>::lowest());
+    for (const auto & index : ImageRegionIndexRange<ImageDimension>(region))
+    {
+      output->TransformIndexToPhysicalPoint(index, point);
+      const auto mapped = transform->TransformPoint(point);
+      const auto cindex = input->template TransformPhysicalPointToContinuousIndex<double>(mapped);
+      for (unsigned int d = 0; d < ImageDimension; ++d)
+      {
+        regionLower[d] = std::min(regionLower[d], cindex[d]);
+        regionUpper[d] = std::max(regionUpper[d], cindex[d]);
+      }
+    }
+    const std::lock_guard<std::mutex> lock(boundsMutex);
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      lower[d] = std::min(lower[d], regionLower[d]);
+      upper[d] = std::max(upper[d], regionUpper[d]);
+    }
+  };
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    OutputImageRegionType face = outputRegion;
+    face.SetSize(d, 1);
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(face, boundFace, nullptr);
+    if (outputRegion.GetSize(d) > 1)
+    {
+      face.SetIndex(d, outputRegion.GetIndex(d) + static_cast<IndexValueType>(outputRegion.GetSize(d)) - 1);
+      this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(face, boundFace, nullptr);
+    }
+  }
+
+  // The interpolator reads up to its radius around each point, and one more voxel covers rounding
+  typename InputImageType::SizeType radius;
+  radius.Fill(1);
+  if (this->GetInterpolator() != nullptr)
+  {
+    radius = this->GetInterpolator()->GetRadius();
+  }
+  const InputImageRegionType & largestRegion = input->GetLargestPossibleRegion();
+  InputImageRegionType         inputRegion;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    // clamped to just outside of the input, so that far away points do not overflow the indices
+    const auto   margin = static_cast<IndexValueType>(radius[d]) + 1;
+    const double start = static_cast<double>(largestRegion.GetIndex(d)) - 1.0;
+    const double end = start + static_cast<double>(largestRegion.GetSize(d)) + 1.0;
+    const auto   first = static_cast<IndexValueType>(std::floor(std::clamp(lower[d], start, end))) - margin;
+    const auto   last = static_cast<IndexValueType>(std::ceil(std::clamp(upper[d], start, end))) + margin;
+    inputRegion.SetIndex(d, first);
+    inputRegion.SetSize(d, static_cast<SizeValueType>(last - first + 1));
+  }
+
+  // A slab which maps entirely outside of the input only gets default pixels, but the input must still be
+  // buffered, so one voxel of it is requested
+  if (!inputRegion.Crop(largestRegion))
+  {
+    inputRegion.SetIndex(largestRegion.GetIndex());
+    inputRegion.SetSize(InputImageType::SizeType::Filled(1));
+  }
+  input->SetRequestedRegion(inputRegion);
+}
+
+} // end namespace itk
+
+#endif // itkANTSStreamingResampleImageFilter_hxx
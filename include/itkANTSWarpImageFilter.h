@@ -0,0 +1,179 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSWarpImageFilter_h
+#define itkANTSWarpImageFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkLabelImageGaussianInterpolateImageFunction.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class ANTSWarpImageFilter
+ *
+ * \brief Resamples one or more images through a dense displacement field defined on the output grid.
+ *
+ * The outputs have the grid of the displacement field, and output_i(x) = input_i(x + field(x)).
+ * Unlike WarpImageFilter, the field is never interpolated, and it is read only once per output voxel
+ * for all the inputs: each scanline is walked once, mapping every voxel to its physical point,
+ * which is then interpolated in each of the inputs. This makes warping many images with one registration
+ * (other contrasts, label maps, probability maps) much cheaper than resampling each one through
+ * a composite transform.
+ *
+ * Each input has its own interpolation, set with SetInterpolation(i, ...):
+ * - Linear (default): N-linear interpolation, inlined.
+ * - NearestNeighbor: for label maps whose labels must not be blended.
+ * - MultiLabel: LabelImageGaussianInterpolateImageFunction, with sigma equal to the input's spacing
+ *   and MultiLabelAlpha, like "MultiLabel" in antsApplyTransforms. Smoother labels, but much slower.
+ *
+ * Input i produces output i. Points which fall outside of an input get DefaultPixelValue.
+ * Inputs may have different grids, but must all be of the same type, with scalar pixels.
+ *
+ * \ingroup ANTsWasm
+ * \ingroup GeometricTransform
+ *
+ */
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+class ANTSWarpImageFilter : public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  ITK_DISALLOW_COPY_AND_MOVE(ANTSWarpImageFilter);
+
+  static constexpr unsigned int ImageDimension = TInputImage::ImageDimension;
+
+  using InputImageType = TInputImage;
+  using OutputImageType = TOutputImage;
+  using DisplacementFieldType = TDisplacementField;
+  using OutputPixelType = typename OutputImageType::PixelType;
+  using RealType = typename NumericTraits<typename InputImageType::PixelType>::RealType;
+  using OutputImageRegionType = typename OutputImageType::RegionType;
+
+  /** Standard class aliases. */
+  using Self = ANTSWarpImageFilter;
+  using Superclass = ImageToImageFilter<TInputImage, TOutputImage>;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Run-time type information. */
+  itkTypeMacro(ANTSWarpImageFilter, ImageToImageFilter);
+
+  /** Standard New macro. */
+  itkNewMacro(Self);
+
+  enum class InterpolationEnum : uint8_t
+  {
+    Linear,
+    NearestNeighbor,
+    MultiLabel
+  };
+
+  /** Set the i-th image to warp. Output i is created if needed. */
+  using Superclass::SetInput;
+  void
+  SetInput(unsigned int i, const InputImageType * image) override;
+
+  /** Appends an image to warp, with the given interpolation. Returns its index, which is also its output's. */
+  unsigned int
+  AddInput(const InputImageType * image, InterpolationEnum interpolation = InterpolationEnum::Linear);
+
+  /** Returns the number of images to warp. */
+  unsigned int
+  GetNumberOfImages() const
+  {
+    return this->GetNumberOfIndexedInputs();
+  }
+
+  /** Set/Get the interpolation of the i-th image. */
+  void
+  SetInterpolation(unsigned int i, InterpolationEnum interpolation);
+  InterpolationEnum
+  GetInterpolation(unsigned int i) const;
+
+  /** Set/Get the displacement field. It also defines the output grid. */
+  itkSetInputMacro(DisplacementField, DisplacementFieldType);
+  itkGetInputMacro(DisplacementField, DisplacementFieldType);
+
+  /** Set/Get the value of output pixels which map outside of their input. */
+  itkSetMacro(DefaultPixelValue, OutputPixelType);
+  itkGetConstReferenceMacro(DefaultPixelValue, OutputPixelType);
+
+  /** Set/Get the alpha of the MultiLabel interpolation: the Gaussian's support, in sigmas. Default is 4. */
+  itkSetMacro(MultiLabelAlpha, double);
+  itkGetMacro(MultiLabelAlpha, double);
+
+protected:
+  ANTSWarpImageFilter();
+  ~ANTSWarpImageFilter() override = default;
+
+  void
+  PrintSelf(std::ostream & os, Indent indent) const override;
+
+  /** The inputs and the displacement field usually have different grids, so they are not checked against each
+   * other. */
+  void
+  VerifyInputInformation() ITKv5_CONST override
+  {}
+
+  void
+  GenerateOutputInformation() override;
+
+  void
+  GenerateInputRequestedRegion() override;
+
+  void
+  BeforeThreadedGenerateData() override;
+
+  void
+  DynamicThreadedGenerateData(const OutputImageRegionType & outputRegionForThread) override;
+
+  /** Interpolates the image at a continuous index. Returns false if the index is outside of the image. */
+  static bool
+  InterpolateLinear(const InputImageType *                         image,
+                    const ContinuousIndex<double, ImageDimension> & cindex,
+                    RealType &                                     value);
+  static bool
+  InterpolateNearestNeighbor(const InputImageType *                         image,
+                             const ContinuousIndex<double, ImageDimension> & cindex,
+                             RealType &                                     value);
+
+  using LabelInterpolatorType = LabelImageGaussianInterpolateImageFunction<InputImageType, double>;
+
+  /** Per-input data, prepared before the threaded part. */
+  struct InputMapping
+  {
+    const InputImageType *                         Image{ nullptr };
+    InterpolationEnum                              Interpolation{ InterpolationEnum::Linear };
+    Matrix<double, ImageDimension, ImageDimension> PhysicalToIndex; // index = PhysicalToIndex * (p - Origin)
+    Point<double, ImageDimension>                  Origin;
+    typename LabelInterpolatorType::Pointer        LabelInterpolator;
+  };
+
+  OutputPixelType                m_DefaultPixelValue{};
+  double                         m_MultiLabelAlpha{ 4.0 };
+  std::vector<InterpolationEnum> m_Interpolations;
+  std::vector<InputMapping>      m_InputMappings;
+};
+} // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#  include "itkANTSWarpImageFilter.hxx"
+#endif
+
+#endif // itkANTSWarpImageFilter_h
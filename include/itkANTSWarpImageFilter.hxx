@@ -0,0 +1,376 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSWarpImageFilter_hxx
+#define itkANTSWarpImageFilter_hxx
+
+#include <algorithm>
+#include <cmath>
+
+#include "itkImageScanlineIterator.h"
+#include "itkANTSWarpImageFilter.h"
+
+namespace itk
+{
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::ANTSWarpImageFilter()
+{
+  this->AddRequiredInputName("DisplacementField");
+  this->DynamicMultiThreadingOn();
+  this->ThreaderUpdateProgressOff();
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::PrintSelf(std::ostream & os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "DefaultPixelValue: " << static_cast<typename NumericTraits<OutputPixelType>::PrintType>(
+                                             this->m_DefaultPixelValue)
+     << std::endl;
+  os << indent << "MultiLabelAlpha: " << this->m_MultiLabelAlpha << std::endl;
+  os << indent << "Interpolations:";
+  for (InterpolationEnum interpolation : this->m_Interpolations)
+  {
+    os << " " << static_cast<int>(interpolation);
+  }
+  os << std::endl;
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::SetInput(unsigned int           i,
+                                                                             const InputImageType * image)
+{
+  Superclass::SetInput(i, image);
+  for (unsigned int o = this->GetNumberOfIndexedOutputs(); o <= i; ++o)
+  {
+    this->SetNthOutput(o, this->MakeOutput(o));
+  }
+  if (m_Interpolations.size() <= i)
+  {
+    m_Interpolations.resize(i + 1, InterpolationEnum::Linear);
+  }
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+unsigned int
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::AddInput(const InputImageType * image,
+                                                                             InterpolationEnum      interpolation)
+{
+  // the first input may already be set through SetInput(image)
+  const unsigned int i = this->GetInput(0) == nullptr ? 0 : this->GetNumberOfIndexedInputs();
+  this->SetInput(i, image);
+  this->SetInterpolation(i, interpolation);
+  return i;
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::SetInterpolation(unsigned int      i,
+                                                                                     InterpolationEnum interpolation)
+{
+  if (m_Interpolations.size() <= i)
+  {
+    m_Interpolations.resize(i + 1, InterpolationEnum::Linear);
+  }
+  if (m_Interpolations[i] != interpolation)
+  {
+    m_Interpolations[i] = interpolation;
+    this->Modified();
+  }
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+auto
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::GetInterpolation(unsigned int i) const
+  -> InterpolationEnum
+{
+  return i < m_Interpolations.size() ? m_Interpolations[i] : InterpolationEnum::Linear;
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  // all the outputs have the displacement field's grid
+  const DisplacementFieldType * field = this->GetDisplacementField();
+  for (unsigned int i = 0; i < this->GetNumberOfIndexedOutputs(); ++i)
+  {
+    OutputImageType * output = this->GetOutput(i);
+    output->SetLargestPossibleRegion(field->GetLargestPossibleRegion());
+    output->SetSpacing(field->GetSpacing());
+    output->SetOrigin(field->GetOrigin());
+    output->SetDirection(field->GetDirection());
+  }
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  // any part of the inputs may be needed
+  for (unsigned int i = 0; i < this->GetNumberOfIndexedInputs(); ++i)
+  {
+    auto * input = const_cast<InputImageType *>(this->GetInput(i));
+    if (input)
+    {
+      input->SetRequestedRegionToLargestPossibleRegion();
+    }
+  }
+
+  // the field is needed exactly where the outputs are
+  auto * field = const_cast<DisplacementFieldType *>(this->GetDisplacementField());
+  if (field)
+  {
+    field->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
+  }
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::BeforeThreadedGenerateData()
+{
+  m_InputMappings.clear();
+  for (unsigned int i = 0; i < this->GetNumberOfIndexedInputs(); ++i)
+  {
+    InputMapping mapping;
+    mapping.Image = this->GetInput(i);
+    if (mapping.Image == nullptr)
+    {
+      itkExceptionMacro(<< "Input " << i << " is not set.");
+    }
+    mapping.Interpolation = this->GetInterpolation(i);
+
+    Matrix<double, ImageDimension, ImageDimension> indexToPhysical;
+    for (unsigned int r = 0; r < ImageDimension; ++r)
+    {
+      for (unsigned int c = 0; c < ImageDimension; ++c)
+      {
+        indexToPhysical[r][c] = mapping.Image->GetDirection()[r][c] * mapping.Image->GetSpacing()[c];
+      }
+    }
+    mapping.PhysicalToIndex = indexToPhysical.GetInverse();
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      mapping.Origin[d] = mapping.Image->GetOrigin()[d];
+    }
+
+    if (mapping.Interpolation == InterpolationEnum::MultiLabel)
+    {
+      mapping.LabelInterpolator = LabelInterpolatorType::New();
+      mapping.LabelInterpolator->SetInputImage(mapping.Image);
+      typename LabelInterpolatorType::ArrayType sigma;
+      for (unsigned int d = 0; d < ImageDimension; ++d)
+      {
+        sigma[d] = mapping.Image->GetSpacing()[d];
+      }
+      mapping.LabelInterpolator->SetSigma(sigma);
+      mapping.LabelInterpolator->SetAlpha(m_MultiLabelAlpha);
+    }
+    m_InputMappings.push_back(mapping);
+  }
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+bool
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::InterpolateLinear(
+  const InputImageType *                         image,
+  const ContinuousIndex<double, ImageDimension> & cindex,
+  RealType &                                     value)
+{
+  const auto &            region = image->GetBufferedRegion();
+  const OffsetValueType * offsetTable = image->GetOffsetTable();
+
+  // same boundary handling as LinearInterpolateImageFunction
+  OffsetValueType lowerOffset[ImageDimension];
+  OffsetValueType upperOffset[ImageDimension];
+  double          fraction[ImageDimension];
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    const IndexValueType start = region.GetIndex(d);
+    const IndexValueType last = start + static_cast<IndexValueType>(region.GetSize(d)) - 1;
+    if (!(cindex[d] >= start - 0.5 && cindex[d] < last + 0.5))
+    {
+      return false;
+    }
+
+    const double         floored = std::floor(cindex[d]);
+    const IndexValueType lower = static_cast<IndexValueType>(floored);
+    fraction[d] = cindex[d] - floored;
+    lowerOffset[d] = (std::clamp(lower, start, last) - start) * offsetTable[d];
+    upperOffset[d] = (std::clamp(lower + 1, start, last) - start) * offsetTable[d];
+  }
+
+  const auto * buffer = image->GetBufferPointer();
+  value = RealType{};
+  for (unsigned int corner = 0; corner < (1u << ImageDimension); ++corner)
+  {
+    OffsetValueType offset = 0;
+    double          weight = 1.0;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      if (corner & (1u << d))
+      {
+        offset += upperOffset[d];
+        weight *= fraction[d];
+      }
+      else
+      {
+        offset += lowerOffset[d];
+        weight *= 1.0 - fraction[d];
+      }
+    }
+    if (weight != 0.0)
+    {
+      value += static_cast<RealType>(buffer[offset]) * weight;
+    }
+  }
+  return true;
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+bool
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::InterpolateNearestNeighbor(
+  const InputImageType *                         image,
+  const ContinuousIndex<double, ImageDimension> & cindex,
+  RealType &                                     value)
+{
+  const auto &            region = image->GetBufferedRegion();
+  const OffsetValueType * offsetTable = image->GetOffsetTable();
+
+  OffsetValueType offset = 0;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    const IndexValueType start = region.GetIndex(d);
+    const IndexValueType last = start + static_cast<IndexValueType>(region.GetSize(d)) - 1;
+    if (!(cindex[d] >= start - 0.5 && cindex[d] < last + 0.5))
+    {
+      return false;
+    }
+    const IndexValueType nearest = Math::RoundHalfIntegerUp<IndexValueType>(cindex[d]);
+    offset += (std::clamp(nearest, start, last) - start) * offsetTable[d];
+  }
+  value = static_cast<RealType>(image->GetBufferPointer()[offset]);
+  return true;
+}
+
+
+template <typename TInputImage, typename TOutputImage, typename TDisplacementField>
+void
+ANTSWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>::DynamicThreadedGenerateData(
+  const OutputImageRegionType & outputRegionForThread)
+{
+  if (outputRegionForThread.GetNumberOfPixels() == 0)
+  {
+    return;
+  }
+
+  const unsigned int numberOfImages = static_cast<unsigned int>(m_InputMappings.size());
+  OutputImageType *  output = this->GetOutput();
+
+  // The physical step for one voxel along a scanline
+  typename OutputImageType::PointType lineStart;
+  output->TransformIndexToPhysicalPoint(outputRegionForThread.GetIndex(), lineStart);
+  typename OutputImageType::IndexType nextIndex = outputRegionForThread.GetIndex();
+  ++nextIndex[0];
+  typename OutputImageType::PointType next;
+  output->TransformIndexToPhysicalPoint(nextIndex, next);
+  const Vector<double, ImageDimension> step = next - lineStart;
+
+  ImageScanlineConstIterator<DisplacementFieldType>   fieldIt(this->GetDisplacementField(), outputRegionForThread);
+  std::vector<ImageScanlineIterator<OutputImageType>> outIts;
+  outIts.reserve(numberOfImages);
+  for (unsigned int i = 0; i < numberOfImages; ++i)
+  {
+    outIts.emplace_back(this->GetOutput(i), outputRegionForThread);
+  }
+
+  while (!fieldIt.IsAtEnd())
+  {
+    output->TransformIndexToPhysicalPoint(fieldIt.GetIndex(), lineStart);
+
+    // each voxel's point is computed from its position in the line, so rounding does not add up along it
+    for (unsigned int column = 0; !fieldIt.IsAtEndOfLine(); ++column)
+    {
+      // the mapping of this voxel is computed once, for all the images
+      const auto &                  displacement = fieldIt.Get();
+      Point<double, ImageDimension> mappedPoint;
+      for (unsigned int d = 0; d < ImageDimension; ++d)
+      {
+        mappedPoint[d] = lineStart[d] + column * step[d] + displacement[d];
+      }
+
+      for (unsigned int i = 0; i < numberOfImages; ++i)
+      {
+        const InputMapping &                    mapping = m_InputMappings[i];
+        const Vector<double, ImageDimension>    index = mapping.PhysicalToIndex * (mappedPoint - mapping.Origin);
+        ContinuousIndex<double, ImageDimension> cindex;
+        for (unsigned int d = 0; d < ImageDimension; ++d)
+        {
+          cindex[d] = index[d];
+        }
+
+        RealType value{};
+        bool     inside = false;
+        switch (mapping.Interpolation)
+        {
+          case InterpolationEnum::Linear:
+            inside = Self::InterpolateLinear(mapping.Image, cindex, value);
+            break;
+          case InterpolationEnum::NearestNeighbor:
+            inside = Self::InterpolateNearestNeighbor(mapping.Image, cindex, value);
+            break;
+          case InterpolationEnum::MultiLabel:
+            inside = mapping.LabelInterpolator->IsInsideBuffer(cindex);
+            if (inside)
+            {
+              value = static_cast<RealType>(mapping.LabelInterpolator->EvaluateAtContinuousIndex(cindex));
+            }
+            break;
+        }
+        outIts[i].Set(inside ? static_cast<OutputPixelType>(value) : m_DefaultPixelValue);
+        ++outIts[i];
+      }
+
+      ++fieldIt;
+    }
+    fieldIt.NextLine();
+    for (auto & outIt : outIts)
+    {
+      outIt.NextLine();
+    }
+  }
+}
+
+} // end namespace itk
+
+#endif // itkANTSWarpImageFilter_hxx
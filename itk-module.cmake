@@ -12,9 +12,14 @@ itk_module(ANTsWasm
     ITKIOImageBase
     ITKImageLabel
     ITKBinaryMathematicalMorphology
+    ITKThresholding
     ITKTransformFactory
     ITKIOTransformBase
     ITKImageGrid
+    ITKSpatialObjects
+    ITKDisplacementField
+    ITKImageFunction
+    ITKImageStatistics
   TEST_DEPENDS
     ITKTestKernel
     ITKMetaIO
@@ -0,0 +1,638 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+// Times registrations of synthetic phantoms with a known warp, and writes the results as JSON.
+// Everything is generated in memory, so this runs without any downloaded data.
+
+#include "itkANTSRegistration.h"
+
+#include "itkAffineTransform.h"
+#include "itkCompositeTransform.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMultiThreaderBase.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+struct BenchmarkOptions
+{
+  unsigned int              Dimension{ 3 };
+  unsigned int              Size{ 64 };
+  std::string               Warp{ "deformable" }; // or "affine"
+  std::vector<std::string>  Presets{ "Translation", "Rigid", "Similarity", "Affine",  "QuickRigid", "TRSAA",
+                                    "SyNOnly",     "SyN",   "SyNRA",      "SyNCC",   "Elastic",    "TV[2]",
+                                    "BSplineSyN" };
+  std::vector<std::string>  Metrics{ "MeanSquares", "Mattes", "CC", "GC", "JHMI" };
+  std::vector<unsigned int> Threads{ 0 }; // 0 means ITK's default
+  unsigned int              Repeats{ 1 };
+  std::string               Sampling{ "Regular" }; // of the linear stages
+  double                    SamplingRate{ 0.2 };
+  bool                      Quick{ false };
+  bool                      Adaptive{ false }; // adaptive scheduling of the linear stages' levels
+  std::vector<std::string>  Precisions{ "double" }; // "double", "float", or "mixed": double with float stored fields
+  bool                      Cache{ false }; // CacheStageResults, whose fields "mixed" stores in float
+  unsigned int              Points{ 100000 }; // transformed one at a time, and batched; 0 skips this
+  std::string               Output{ "ANTsWasmBenchmarks.json" };
+};
+
+
+std::vector<std::string>
+splitList(const std::string & list)
+{
+  std::vector<std::string> items;
+  std::istringstream       stream(list);
+  std::string              item;
+  while (std::getline(stream, item, ','))
+  {
+    if (!item.empty())
+    {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+
+std::string
+escapeJSON(const std::string & text)
+{
+  std::string escaped;
+  for (char c : text)
+  {
+    switch (c)
+    {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) >= 0x20)
+        {
+          escaped += c;
+        }
+    }
+  }
+  return escaped;
+}
+
+
+// On Linux, the peak resident memory can be reset between runs, so each run reports its own peak.
+// Elsewhere, it is the process' high-water mark, which includes the previous runs. Returns whether it was reset.
+bool
+resetPeakMemory()
+{
+#if defined(__linux__)
+  std::ofstream clearRefs("/proc/self/clear_refs");
+  clearRefs << "5";
+  clearRefs.flush();
+  return clearRefs.good();
+#else
+  return false;
+#endif
+}
+
+
+// The current resident memory on Linux, or 0.
+std::size_t
+readResidentMemory()
+{
+#if defined(__linux__)
+  std::ifstream status("/proc/self/status");
+  std::string   line;
+  while (std::getline(status, line))
+  {
+    if (line.compare(0, 6, "VmRSS:") == 0)
+    {
+      return std::stoull(line.substr(6)) * 1024; // reported in kB
+    }
+  }
+#endif
+  return 0;
+}
+
+
+std::size_t
+readPeakMemory(const itk::ANTSRegistrationProfile & profile)
+{
+#if defined(__linux__)
+  std::ifstream status("/proc/self/status");
+  std::string   line;
+  while (std::getline(status, line))
+  {
+    if (line.compare(0, 6, "VmHWM:") == 0)
+    {
+      return std::stoull(line.substr(6)) * 1024; // reported in kB
+    }
+  }
+#endif
+  std::size_t peak = 0;
+  for (const auto & stage : profile)
+  {
+    peak = std::max(peak, stage.ProcessPeakResidentMemory);
+  }
+  return peak;
+}
+
+
+// Smooth ellipsoid plus off-center blobs, so that no rotation or reflection is a symmetry.
+template <unsigned int VDimension>
+double
+phantom(const itk::Point<double, VDimension> & p, double extent)
+{
+  double r2 = 0.0;
+  for (unsigned int d = 0; d < VDimension; ++d)
+  {
+    const double semiAxis = (0.35 - 0.05 * d) * extent;
+    const double c = p[d] - 0.5 * extent;
+    r2 += c * c / (semiAxis * semiAxis);
+  }
+  double       value = 100.0 / (1.0 + std::exp((r2 - 1.0) * 8.0));
+  const double blobSigma = 0.06 * extent;
+  for (unsigned int b = 0; b < 3; ++b)
+  {
+    double q2 = 0.0;
+    for (unsigned int d = 0; d < VDimension; ++d)
+    {
+      const double c = p[d] - extent * (0.35 + 0.15 * ((b + d) % 3));
+      q2 += c * c;
+    }
+    value += 60.0 * std::exp(-q2 / (2.0 * blobSigma * blobSigma));
+  }
+  return value;
+}
+
+
+template <unsigned int VDimension>
+class Benchmark
+{
+public:
+  using ImageType = itk::Image<float, VDimension>;
+  using PointType = itk::Point<double, VDimension>;
+  using CompositeTransformType = itk::CompositeTransform<double, VDimension>;
+
+  explicit Benchmark(const BenchmarkOptions & options)
+    : m_Options(options)
+    , m_Extent(options.Size)
+  {
+    this->MakeKnownWarp();
+    // The moving image is the phantom itself, and the fixed image is the phantom seen through the warp.
+    // So the forward transform (fixed to moving) is expected to match the known warp.
+    m_MovingImage = this->MakeImage(nullptr);
+    m_FixedImage = this->MakeImage(m_KnownWarp);
+  }
+
+  void
+  Run(std::ostream & json)
+  {
+    bool first = true;
+    for (unsigned int threads : m_Options.Threads)
+    {
+      if (threads > 0)
+      {
+        itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(threads);
+      }
+      for (const std::string & preset : m_Options.Presets)
+      {
+        for (const std::string & metric : m_Options.Metrics)
+        {
+          std::size_t doublePeakMemory = 0; // to report the other precisions relative to double
+          for (const std::string & precision : m_Options.Precisions)
+          {
+            json << (first ? "\n    " : ",\n    ");
+            first = false;
+            if (precision == "float")
+            {
+              this->RunOne<float>(preset, metric, threads, precision, doublePeakMemory, json);
+            }
+            else if (precision == "mixed")
+            {
+              this->RunOne<double>(preset, metric, threads, precision, doublePeakMemory, json);
+            }
+            else
+            {
+              doublePeakMemory = this->RunOne<double>(preset, metric, threads, precision, 0, json);
+            }
+          }
+        }
+      }
+    }
+  }
+
+private:
+  void
+  MakeKnownWarp()
+  {
+    PointType center;
+    center.Fill(0.5 * m_Extent);
+
+    using AffineType = itk::AffineTransform<double, VDimension>;
+    typename AffineType::Pointer affine = AffineType::New();
+    affine->SetCenter(center);
+    affine->Rotate(0, 1, 0.08);
+    affine->Scale(1.04);
+    typename AffineType::OutputVectorType translation;
+    translation.Fill(0.02 * m_Extent);
+    affine->Translate(translation);
+
+    m_KnownWarp = CompositeTransformType::New();
+    m_KnownWarp->AddTransform(affine);
+
+    if (m_Options.Warp == "deformable")
+    {
+      using FieldTransformType = itk::DisplacementFieldTransform<double, VDimension>;
+      using FieldType = typename FieldTransformType::DisplacementFieldType;
+      typename FieldType::Pointer field = FieldType::New();
+      typename FieldType::SizeType size;
+      size.Fill(m_Options.Size);
+      field->SetRegions(size);
+      field->Allocate();
+
+      const double                                    amplitude = 0.02 * m_Extent;
+      itk::ImageRegionIteratorWithIndex<FieldType> it(field, field->GetLargestPossibleRegion());
+      for (; !it.IsAtEnd(); ++it)
+      {
+        PointType p;
+        field->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+        typename FieldType::PixelType displacement;
+        for (unsigned int d = 0; d < VDimension; ++d)
+        {
+          displacement[d] = amplitude * std::sin(2.0 * itk::Math::pi * p[(d + 1) % VDimension] / m_Extent);
+        }
+        it.Set(displacement);
+      }
+
+      typename FieldTransformType::Pointer fieldTransform = FieldTransformType::New();
+      fieldTransform->SetDisplacementField(field);
+      m_KnownWarp->AddTransform(fieldTransform); // applied first
+    }
+  }
+
+  typename ImageType::Pointer
+  MakeImage(const CompositeTransformType * warp) const
+  {
+    typename ImageType::Pointer image = ImageType::New();
+    typename ImageType::SizeType size;
+    size.Fill(m_Options.Size);
+    image->SetRegions(size);
+    image->Allocate();
+
+    itk::ImageRegionIteratorWithIndex<ImageType> it(image, image->GetLargestPossibleRegion());
+    for (; !it.IsAtEnd(); ++it)
+    {
+      PointType p;
+      image->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+      if (warp != nullptr)
+      {
+        p = warp->TransformPoint(p);
+      }
+      it.Set(phantom<VDimension>(p, m_Extent));
+    }
+    return image;
+  }
+
+  // Mean and maximum distance between the recovered and the known warp, inside the phantom.
+  template <typename TTransform>
+  void
+  MeasureError(const TTransform * recovered, double & meanError, double & maxError) const
+  {
+    const unsigned int stride = std::max(1u, m_Options.Size / 16);
+    double             sum = 0.0;
+    std::size_t        count = 0;
+    maxError = 0.0;
+
+    itk::ImageRegionIteratorWithIndex<ImageType> it(m_FixedImage, m_FixedImage->GetLargestPossibleRegion());
+    for (; !it.IsAtEnd(); ++it)
+    {
+      const auto & index = it.GetIndex();
+      bool         sampled = it.Get() > 10.0f;
+      for (unsigned int d = 0; d < VDimension; ++d)
+      {
+        sampled = sampled && index[d] % stride == 0;
+      }
+      if (!sampled)
+      {
+        continue;
+      }
+      PointType p;
+      m_FixedImage->TransformIndexToPhysicalPoint(index, p);
+      typename TTransform::InputPointType q;
+      q.CastFrom(p);
+      PointType recoveredPoint;
+      recoveredPoint.CastFrom(recovered->TransformPoint(q));
+      const double error = recoveredPoint.EuclideanDistanceTo(m_KnownWarp->TransformPoint(p));
+      sum += error;
+      maxError = std::max(maxError, error);
+      ++count;
+    }
+    meanError = count > 0 ? sum / count : 0.0;
+  }
+
+  // Times transforming points one at a time with TransformPoint(), and in one batch with TransformPoints().
+  template <typename TRegistration>
+  void
+  MeasurePoints(const TRegistration * registration, std::ostream & json) const
+  {
+    using ValueType = typename TRegistration::ParametersValueType;
+    const auto *           transform = registration->GetForwardTransform();
+    std::vector<ValueType> points(std::size_t(m_Options.Points) * VDimension);
+    for (std::size_t i = 0; i < points.size(); ++i)
+    {
+      // scattered over the phantom, so that the fields are not read in order
+      points[i] = static_cast<ValueType>(m_Extent * double((i * 2654435761u) % 1000) / 1000.0);
+    }
+
+    std::vector<ValueType> loopPoints(points.size());
+    auto                   start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < points.size(); i += VDimension)
+    {
+      typename TRegistration::OutputTransformType::InputPointType point;
+      std::copy(points.begin() + i, points.begin() + i + VDimension, point.begin());
+      const auto mapped = transform->TransformPoint(point);
+      std::copy(mapped.begin(), mapped.end(), loopPoints.begin() + i);
+    }
+    const double loopTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<ValueType> batchedPoints(points.size());
+    start = std::chrono::steady_clock::now();
+    registration->TransformPoints(points.data(), batchedPoints.data(), m_Options.Points);
+    const double batchedTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double maxDifference = 0.0;
+    for (std::size_t i = 0; i < points.size(); ++i)
+    {
+      maxDifference = std::max(maxDifference, std::abs(double(batchedPoints[i]) - double(loopPoints[i])));
+    }
+    std::cout << "  " << m_Options.Points << " points: loop " << loopTime << " s, batched " << batchedTime << " s"
+              << std::endl;
+    json << ", \"points\": {\"count\": " << m_Options.Points << ", \"loopTime\": " << loopTime
+         << ", \"batchedTime\": " << batchedTime << ", \"speedup\": " << loopTime / std::max(batchedTime, 1e-9)
+         << ", \"maxDifference\": " << maxDifference << "}";
+  }
+
+  // Returns the peak resident memory, or 0 on error.
+  template <typename TParametersValueType>
+  std::size_t
+  RunOne(const std::string & preset,
+         const std::string & metric,
+         unsigned int        threads,
+         const std::string & precision,
+         std::size_t         doublePeakMemory,
+         std::ostream &      json)
+  {
+    using RegistrationType = itk::ANTSRegistration<ImageType, ImageType, TParametersValueType>;
+    std::cout << VDimension << "D " << m_Options.Size << "^" << VDimension << " " << preset << " " << metric
+              << " threads=" << threads << " " << precision << std::endl;
+    json << "{\"preset\": \"" << escapeJSON(preset) << "\", \"metric\": \"" << escapeJSON(metric)
+         << "\", \"threads\": " << itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads()
+         << ", \"precision\": \"" << precision << "\"";
+
+    double      bestTime = std::numeric_limits<double>::max();
+    std::size_t peakMemory = 0;
+    std::size_t residentMemory = 0;     // after Update(), including the stage cache
+    bool        peakMemoryReset = true; // whether peakMemory excludes the earlier runs
+    try
+    {
+      typename RegistrationType::Pointer registration;
+      for (unsigned int r = 0; r < std::max(1u, m_Options.Repeats); ++r)
+      {
+        registration = RegistrationType::New();
+        registration->SetFixedImage(m_FixedImage);
+        registration->SetMovingImage(m_MovingImage);
+        registration->SetTypeOfTransform(preset);
+        registration->SetAffineMetric(metric);
+        registration->SetSynMetric(metric);
+        registration->SetRandomSeed(30101983);
+        registration->SetAffineSamplingStrategy(m_Options.Sampling);
+        registration->SetSamplingRate(m_Options.SamplingRate);
+        registration->SetAdaptiveIterations(m_Options.Adaptive);
+        registration->SetCacheStageResults(m_Options.Cache);
+        registration->SetStoreFieldsInFloat(precision == "mixed");
+        if (m_Options.Quick)
+        {
+          registration->SetAffineIterations({ 20, 10 });
+          registration->SetSynIterations({ 10, 5 });
+          registration->SetShrinkFactors({ 2, 1 });
+          registration->SetSmoothingSigmas({ 1, 0 });
+        }
+
+        peakMemoryReset = resetPeakMemory() && peakMemoryReset;
+        const auto start = std::chrono::steady_clock::now();
+        registration->Update();
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bestTime = std::min(bestTime, elapsed);
+        peakMemory = std::max(peakMemory, readPeakMemory(registration->GetRegistrationProfile()));
+        residentMemory = readResidentMemory();
+      }
+
+      double meanError = 0.0;
+      double maxError = 0.0;
+      this->MeasureError(registration->GetForwardTransform(), meanError, maxError);
+      if (m_Options.Points > 0)
+      {
+        this->MeasurePoints(registration.GetPointer(), json);
+      }
+      json << ", \"wallTime\": " << bestTime << ", \"peakResidentMemory\": " << peakMemory;
+      if (residentMemory > 0)
+      {
+        json << ", \"residentMemoryAfterUpdate\": " << residentMemory;
+      }
+      if (doublePeakMemory > 0 && peakMemoryReset) // otherwise, the double run's peak is included
+      {
+        const double relativePeakMemory = double(peakMemory) / double(doublePeakMemory);
+        std::cout << "  peak memory relative to double: " << relativePeakMemory << std::endl;
+        json << ", \"peakResidentMemoryRelativeToDouble\": " << relativePeakMemory;
+      }
+      json << ", \"meanError\": " << meanError << ", \"maxError\": " << maxError
+           << ", \"profile\": " << registration->GetRegistrationProfileJSON() << "}";
+      return peakMemory;
+    }
+    catch (const std::exception & error)
+    {
+      std::cerr << error.what() << std::endl;
+      json << ", \"error\": \"" << escapeJSON(error.what()) << "\"}";
+    }
+    return 0;
+  }
+
+  const BenchmarkOptions &                    m_Options;
+  const double                                m_Extent;
+  typename CompositeTransformType::Pointer    m_KnownWarp;
+  typename ImageType::Pointer                 m_FixedImage;
+  typename ImageType::Pointer                 m_MovingImage;
+};
+
+
+void
+printUsage(const char * executable)
+{
+  std::cerr << "Usage: " << executable << " [--dimension 2|3] [--size N] [--warp affine|deformable]"
+            << " [--presets Affine,SyN,...] [--metrics Mattes,CC,...] [--threads 1,2,4,...]"
+            << " [--repeats N] [--sampling None|Regular|Random|Stratified] [--sampling-rate R]"
+            << " [--adaptive] [--precision double,float,mixed] [--cache] [--points N] [--quick]"
+            << " [--output results.json]"
+            << std::endl;
+}
+} // namespace
+
+
+int
+main(int argc, char * argv[])
+{
+  BenchmarkOptions options;
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string argument = argv[i];
+    const bool        hasValue = i + 1 < argc;
+    if (argument == "--help")
+    {
+      printUsage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (argument == "--quick")
+    {
+      options.Quick = true;
+    }
+    else if (argument == "--adaptive")
+    {
+      options.Adaptive = true;
+    }
+    else if (argument == "--cache")
+    {
+      options.Cache = true;
+    }
+    else if (argument == "--dimension" && hasValue)
+    {
+      options.Dimension = std::stoul(argv[++i]);
+    }
+    else if (argument == "--size" && hasValue)
+    {
+      options.Size = std::stoul(argv[++i]);
+    }
+    else if (argument == "--warp" && hasValue)
+    {
+      options.Warp = argv[++i];
+    }
+    else if (argument == "--presets" && hasValue)
+    {
+      options.Presets = splitList(argv[++i]);
+    }
+    else if (argument == "--metrics" && hasValue)
+    {
+      options.Metrics = splitList(argv[++i]);
+    }
+    else if (argument == "--threads" && hasValue)
+    {
+      options.Threads.clear();
+      for (const std::string & threads : splitList(argv[++i]))
+      {
+        options.Threads.push_back(std::stoul(threads));
+      }
+    }
+    else if (argument == "--repeats" && hasValue)
+    {
+      options.Repeats = std::stoul(argv[++i]);
+    }
+    else if (argument == "--sampling" && hasValue)
+    {
+      options.Sampling = argv[++i];
+    }
+    else if (argument == "--sampling-rate" && hasValue)
+    {
+      options.SamplingRate = std::stod(argv[++i]);
+    }
+    else if (argument == "--precision" && hasValue)
+    {
+      options.Precisions = splitList(argv[++i]);
+      for (const std::string & precision : options.Precisions)
+      {
+        if (precision != "double" && precision != "float" && precision != "mixed")
+        {
+          std::cerr << "Unsupported precision: " << precision << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    }
+    else if (argument == "--points" && hasValue)
+    {
+      options.Points = std::stoul(argv[++i]);
+    }
+    else if (argument == "--output" && hasValue)
+    {
+      options.Output = argv[++i];
+    }
+    else
+    {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::ofstream json(options.Output);
+  if (!json)
+  {
+    std::cerr << "Cannot write: " << options.Output << std::endl;
+    return EXIT_FAILURE;
+  }
+  json << "{\n  \"dimension\": " << options.Dimension << ",\n  \"size\": " << options.Size << ",\n  \"warp\": \""
+       << escapeJSON(options.Warp) << "\",\n  \"sampling\": \"" << escapeJSON(options.Sampling)
+       << "\",\n  \"samplingRate\": " << options.SamplingRate
+       << ",\n  \"adaptive\": " << (options.Adaptive ? "true" : "false")
+       << ",\n  \"cache\": " << (options.Cache ? "true" : "false")
+       << ",\n  \"quick\": " << (options.Quick ? "true" : "false") << ",\n  \"precisions\": [";
+  for (std::size_t p = 0; p < options.Precisions.size(); ++p)
+  {
+    json << (p ? ", \"" : "\"") << options.Precisions[p] << "\"";
+  }
+  json << "],\n  \"results\": [";
+
+  switch (options.Dimension)
+  {
+    case 2:
+      Benchmark<2>(options).Run(json);
+      break;
+    case 3:
+      Benchmark<3>(options).Run(json);
+      break;
+    default:
+      std::cerr << "Unsupported dimension: " << options.Dimension << std::endl;
+      return EXIT_FAILURE;
+  }
+
+  json << "\n  ]\n}\n";
+  std::cout << "Results written to: " << options.Output << std::endl;
+  return EXIT_SUCCESS;
+}
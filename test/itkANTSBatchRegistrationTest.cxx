@@ -0,0 +1,88 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkANTSBatchRegistration.h"
+
+#include "itkSimpleFilterWatcher.h"
+#include "itkTestingMacros.h"
+#include "itkANTSTestHelpers.h"
+
+#include <cmath>
+
+using namespace ANTsWasmTesting;
+
+
+int
+itkANTSBatchRegistrationTest(int, char *[])
+{
+  using FilterType = itk::ANTSBatchRegistration<ImageType, ImageType>;
+  FilterType::Pointer filter = FilterType::New();
+  ITK_EXERCISE_BASIC_OBJECT_METHODS(filter, ANTSBatchRegistration, ProcessObject);
+
+  LabelImageType::Pointer fixedMask = makeRectangle(0);
+  filter->SetFixedImage(makeSDF(fixedMask));
+  filter->SetFixedMask(fixedMask);
+
+  const std::vector<int> shifts{ 3, -4, 6, 0, 5 };
+  for (int shift : shifts)
+  {
+    filter->AddMovingImage(makeSDF(makeRectangle(shift)));
+  }
+  ITK_TEST_EXPECT_EQUAL(filter->GetNumberOfMovingImages(), shifts.size());
+
+  auto settings = filter->GetModifiableRegistrationSettings();
+  settings->SetTypeOfTransform("Translation");
+  settings->SetAffineMetric("MeanSquares");
+  settings->SetRandomSeed(30101983);
+
+  // The Platform multithreader starts threads in every parallel section, so registrations run one at a time
+  using RegistrationType = itk::ANTSRegistration<ImageType, ImageType>;
+  const auto defaultThreader = itk::MultiThreaderBase::GetGlobalDefaultThreader();
+  itk::MultiThreaderBase::SetGlobalDefaultThreader(itk::MultiThreaderBase::ThreaderEnum::Platform);
+  ITK_TEST_EXPECT_EQUAL(RegistrationType::GetDefaultNumberOfConcurrentRegistrations(), 1u);
+  itk::MultiThreaderBase::SetGlobalDefaultThreader(defaultThreader);
+  ITK_TEST_EXPECT_TRUE(RegistrationType::GetDefaultNumberOfConcurrentRegistrations() >= 1);
+
+  filter->SetNumberOfConcurrentRegistrations(2);
+  ITK_TEST_SET_GET_VALUE(2, filter->GetNumberOfConcurrentRegistrations());
+
+  itk::SimpleFilterWatcher watcher(filter, "ANTs batch registration");
+  ITK_TRY_EXPECT_NO_EXCEPTION(filter->Update());
+
+  int result = EXIT_SUCCESS;
+  for (unsigned i = 0; i < shifts.size(); ++i)
+  {
+    itk::Point<double, Dimension> zeroPoint{ { 0, 0 } };
+    auto                          forwardPoint = filter->GetForwardTransform(i)->TransformPoint(zeroPoint);
+    auto                          inversePoint = filter->GetInverseTransform(i)->TransformPoint(zeroPoint);
+    std::cout << "Moving image " << i << " forward: " << forwardPoint << " inverse: " << inversePoint << std::endl;
+    if (std::abs(forwardPoint[0] - shifts[i]) > 0.5 || std::abs(forwardPoint[1]) > 0.5)
+    {
+      std::cerr << "Forward translation of moving image " << i << " should be " << shifts[i] << std::endl;
+      result = EXIT_FAILURE;
+    }
+    if (std::abs(inversePoint[0] + shifts[i]) > 0.5 || std::abs(inversePoint[1]) > 0.5)
+    {
+      std::cerr << "Inverse translation of moving image " << i << " should be " << -shifts[i] << std::endl;
+      result = EXIT_FAILURE;
+    }
+  }
+
+  std::cout << "Test finished." << std::endl;
+  return result;
+}
@@ -0,0 +1,138 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkANTSMotionCorrection.h"
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIterator.h"
+#include "itkSimpleFilterWatcher.h"
+#include "itkTestingMacros.h"
+#include "itkANTSTestHelpers.h"
+
+#include <cmath>
+
+using namespace ANTsWasmTesting;
+
+namespace
+{
+using TimeSeriesImageType = itk::Image<float, Dimension + 1>;
+
+// Stacks the rectangles' distance maps along the last axis
+TimeSeriesImageType::Pointer
+makeTimeSeries(const std::vector<int> & shifts)
+{
+  TimeSeriesImageType::Pointer series = TimeSeriesImageType::New();
+  series->SetRegions(TimeSeriesImageType::SizeType{ { 64, 32, static_cast<itk::SizeValueType>(shifts.size()) } });
+  series->Allocate();
+
+  itk::ImageRegionIterator<TimeSeriesImageType> seriesIt(series, series->GetLargestPossibleRegion());
+  for (int shift : shifts)
+  {
+    ImageType::Pointer                  volume = makeSDF(makeRectangle(shift));
+    itk::ImageRegionIterator<ImageType> volumeIt(volume, volume->GetLargestPossibleRegion());
+    for (; !volumeIt.IsAtEnd(); ++volumeIt, ++seriesIt)
+    {
+      seriesIt.Set(volumeIt.Get());
+    }
+  }
+  return series;
+}
+} // namespace
+
+
+int
+itkANTSMotionCorrectionTest(int argc, char * argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "Missing parameters." << std::endl;
+    std::cerr << "Usage: " << itkNameOfTestExecutableMacro(argv);
+    std::cerr << " outputDirectory" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string outDir = argv[1];
+
+  using FilterType = itk::ANTSMotionCorrection<TimeSeriesImageType>;
+  FilterType::Pointer filter = FilterType::New();
+  ITK_EXERCISE_BASIC_OBJECT_METHODS(filter, ANTSMotionCorrection, ProcessObject);
+
+  // The series is read back from a file, so that the chunks are streamed from the reader
+  const std::vector<int> shifts{ 0, 2, 3, -1, 4, 5 };
+  const std::string      seriesFileName = outDir + "/MotionCorrectionSeries.mha";
+  ITK_TRY_EXPECT_NO_EXCEPTION(itk::WriteImage(makeTimeSeries(shifts), seriesFileName));
+  using ReaderType = itk::ImageFileReader<TimeSeriesImageType>;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(seriesFileName);
+  reader->UseStreamingOn();
+  filter->SetInput(reader->GetOutput());
+  ITK_TRY_EXPECT_NO_EXCEPTION(reader->UpdateOutputInformation());
+  filter->SetReferenceMask(makeRectangle(0));
+  ITK_TEST_SET_GET_VALUE(0, filter->GetReferenceVolumeIndex());
+  ITK_TEST_EXPECT_EQUAL(filter->GetNumberOfVolumes(), shifts.size());
+
+  auto settings = filter->GetModifiableRegistrationSettings();
+  ITK_TEST_EXPECT_EQUAL(std::string(settings->GetTypeOfTransform()), "Rigid");
+  settings->SetAffineMetric("MeanSquares");
+  settings->SetRandomSeed(30101983);
+
+  filter->SetNumberOfConcurrentRegistrations(2);
+  filter->WarmStartOn();
+  ITK_TEST_SET_GET_VALUE(true, filter->GetWarmStart());
+  filter->SetNumberOfVolumesPerChunk(4);
+  ITK_TEST_SET_GET_VALUE(4, filter->GetNumberOfVolumesPerChunk());
+
+  itk::SimpleFilterWatcher watcher(filter, "ANTs motion correction");
+  ITK_TRY_EXPECT_NO_EXCEPTION(filter->Update());
+
+  // Only the last chunk of volumes remains buffered
+  const TimeSeriesImageType::RegionType bufferedRegion = reader->GetOutput()->GetBufferedRegion();
+  std::cout << "Buffered region of the series: " << bufferedRegion << std::endl;
+  ITK_TEST_EXPECT_TRUE(bufferedRegion.GetSize(Dimension) < shifts.size());
+  ITK_TEST_EXPECT_EQUAL(bufferedRegion.GetIndex(Dimension), 4);
+
+  const FilterType::MotionParametersType & motion = filter->GetMotionParameters();
+  ITK_TEST_EXPECT_EQUAL(motion.size(), shifts.size());
+  std::cout << filter->GetMotionParametersCSV();
+
+  int result = EXIT_SUCCESS;
+  for (unsigned i = 0; i < shifts.size(); ++i)
+  {
+    itk::Point<double, Dimension> zeroPoint{ { 0, 0 } };
+    auto                          forwardPoint = filter->GetForwardTransform(i)->TransformPoint(zeroPoint);
+    if (std::abs(forwardPoint[0] - shifts[i]) > 0.5 || std::abs(forwardPoint[1]) > 0.5)
+    {
+      std::cerr << "Forward translation of volume " << i << " should be " << shifts[i] << std::endl;
+      result = EXIT_FAILURE;
+    }
+    if (std::abs(motion[i].Translation[0] - shifts[i]) > 0.5 || std::abs(motion[i].Angles[0]) > 0.02)
+    {
+      std::cerr << "Motion of volume " << i << " should be a translation by " << shifts[i] << std::endl;
+      result = EXIT_FAILURE;
+    }
+    const double displacement = i > 0 ? std::abs(shifts[i] - shifts[i - 1]) : 0.0;
+    if (std::abs(motion[i].FramewiseDisplacement - displacement) > 1.5)
+    {
+      std::cerr << "Framewise displacement of volume " << i << " should be about " << displacement << std::endl;
+      result = EXIT_FAILURE;
+    }
+  }
+
+  std::cout << "Test finished." << std::endl;
+  return result;
+}
@@ -19,12 +19,23 @@
 #include "itkANTSRegistration.h"
 
 #include "itkCommand.h"
+#include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkSimpleFilterWatcher.h"
 #include "itkImageRegionIterator.h"
 #include "itkSignedMaurerDistanceMapImageFilter.h"
+#include "itkCastImageFilter.h"
+#include "itkLabelImageGaussianInterpolateImageFunction.h"
+#include "itkResampleImageFilter.h"
+#include "itkHDF5TransformIOFactory.h"
 #include "itkTxtTransformIOFactory.h"
 #include "itkTestingMacros.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <type_traits>
 
 namespace
 {
@@ -128,7 +139,9 @@ testFilter(std::string outDir, std::string transformType)
   filter->SetCollapseCompositeTransform(true);
   filter->SetMaskAllStages(true);
   filter->SetSamplingRate(0.2);
+  filter->SetAffineSamplingStrategy(transformType == "TRSAA" ? "Stratified" : "Regular");
   filter->SetRandomSeed(30101983);
+  filter->SetCacheStageResults(transformType == "SyNRA");
 
   auto initialTransform = itk::TranslationTransform<double, Dimension>::New();
   using VectorType = itk::Vector<double, Dimension>;
@@ -139,6 +152,22 @@ testFilter(std::string outDir, std::string transformType)
   filter->DebugOn();
   filter->Update();
 
+  std::cout << "\nRegistration profile: " << filter->GetRegistrationProfileJSON() << std::endl;
+  const auto & profile = filter->GetRegistrationProfile();
+  if (profile.empty())
+  {
+    std::cerr << "Registration profile should have at least one stage" << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (const auto & stage : profile)
+  {
+    if (stage.Levels.empty() || stage.WallTime <= 0.0)
+    {
+      std::cerr << "Stage " << stage.TransformType << " has no pyramid levels or wall time in the profile" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
   auto forwardTransform = filter->GetForwardTransform();
 
   itk::TransformFileWriter::Pointer transformWriter = itk::TransformFileWriter::New();
@@ -149,6 +178,131 @@ testFilter(std::string outDir, std::string transformType)
   typename MovingImageType::Pointer movingResampled = filter->GetWarpedMovingImage();
   itk::WriteImage(movingResampled, outDir + "/SyntheticMovingResampled.nrrd");
 
+  // Streaming the warped image into a file, slab by slab, should give the same image
+  const std::string streamedFileName = outDir + "/SyntheticMovingStreamed.mha";
+  filter->SetNumberOfWarpStreamDivisions(4);
+  filter->WriteWarpedMovingImage(streamedFileName);
+  typename MovingImageType::Pointer movingStreamed = itk::ReadImage<MovingImageType>(streamedFileName);
+  ITK_TEST_EXPECT_EQUAL(movingStreamed->GetLargestPossibleRegion(), movingResampled->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<MovingImageType> streamedIt(movingStreamed, movingStreamed->GetBufferedRegion());
+  itk::ImageRegionConstIterator<MovingImageType> wholeIt(movingResampled, movingResampled->GetBufferedRegion());
+  for (; !streamedIt.IsAtEnd(); ++streamedIt, ++wholeIt)
+  {
+    if (std::abs(double(streamedIt.Get()) - double(wholeIt.Get())) > 1e-3)
+    {
+      std::cerr << "Streamed warping differs at " << streamedIt.GetIndex() << ": " << streamedIt.Get()
+                << " instead of " << wholeIt.Get() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Warping through the dense displacement field should match warping through the composite transform
+  filter->SetUseDisplacementFieldWarping(true);
+  ITK_TEST_EXPECT_TRUE(filter->GetForwardDisplacementField() != nullptr);
+  typename MovingImageType::Pointer movingFieldWarped = filter->GetWarpedMovingImage();
+  filter->SetUseDisplacementFieldWarping(false);
+  itk::ImageRegionConstIterator<MovingImageType> resampledIt(movingResampled, movingResampled->GetBufferedRegion());
+  itk::ImageRegionConstIterator<MovingImageType> fieldWarpedIt(movingFieldWarped,
+                                                               movingFieldWarped->GetBufferedRegion());
+  // both truncate to integer pixels, where a rounding difference just below an integer changes the pixel by one
+  const double warpTolerance = std::is_integral_v<MovingPixelType> ? 1.0 : 1e-3;
+  for (; !resampledIt.IsAtEnd(); ++resampledIt, ++fieldWarpedIt)
+  {
+    if (std::abs(double(resampledIt.Get()) - double(fieldWarpedIt.Get())) > warpTolerance)
+    {
+      std::cerr << "Warping through the displacement field differs at " << resampledIt.GetIndex() << ": "
+                << fieldWarpedIt.Get() << " instead of " << resampledIt.Get() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Several images warped in one pass, each with its own interpolation
+  auto               warpFilter = filter->MakeWarpImageFilter();
+  const unsigned int linearIndex = warpFilter->AddInput(movingImage);
+  const unsigned int nearestIndex = warpFilter->AddInput(movingImage, FilterType::InterpolationEnum::NearestNeighbor);
+  ITK_TEST_EXPECT_EQUAL(warpFilter->GetNumberOfImages(), 2);
+  warpFilter->Update();
+  itk::ImageRegionConstIterator<MovingImageType> linearIt(warpFilter->GetOutput(linearIndex),
+                                                          movingFieldWarped->GetBufferedRegion());
+  itk::ImageRegionConstIterator<MovingImageType> nearestIt(warpFilter->GetOutput(nearestIndex),
+                                                           movingFieldWarped->GetBufferedRegion());
+  for (fieldWarpedIt.GoToBegin(); !fieldWarpedIt.IsAtEnd(); ++fieldWarpedIt, ++linearIt, ++nearestIt)
+  {
+    // the distance map changes by at most one per voxel, so nearest neighbor stays close to linear
+    if (linearIt.Get() != fieldWarpedIt.Get() || std::abs(double(nearestIt.Get()) - double(linearIt.Get())) > 2.0)
+    {
+      std::cerr << "Multi-image warping differs at " << linearIt.GetIndex() << ": linear " << linearIt.Get()
+                << ", nearest " << nearestIt.Get() << ", expected " << fieldWarpedIt.Get() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The MultiLabel interpolation matches resampling with the same label interpolator, up to ties in the votes.
+  // Its support spans 9 voxels along each dimension, so it is only checked up to 3D.
+  if constexpr (Dimension <= 3)
+  {
+    using LabelCastType = itk::CastImageFilter<LabelImageType, MovingImageType>;
+    typename LabelCastType::Pointer labelCast = LabelCastType::New();
+    labelCast->SetInput(movingMask);
+    labelCast->Update();
+    auto               labelWarpFilter = filter->MakeWarpImageFilter();
+    const unsigned int labelIndex =
+      labelWarpFilter->AddInput(labelCast->GetOutput(), FilterType::InterpolationEnum::MultiLabel);
+    labelWarpFilter->Update();
+
+    using LabelInterpolatorType = itk::LabelImageGaussianInterpolateImageFunction<MovingImageType, double>;
+    typename LabelInterpolatorType::Pointer   labelInterpolator = LabelInterpolatorType::New();
+    typename LabelInterpolatorType::ArrayType sigma;
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      sigma[d] = labelCast->GetOutput()->GetSpacing()[d];
+    }
+    labelInterpolator->SetSigma(sigma);
+    labelInterpolator->SetAlpha(labelWarpFilter->GetMultiLabelAlpha());
+    using LabelResampleType = itk::ResampleImageFilter<MovingImageType, MovingImageType>;
+    typename LabelResampleType::Pointer labelResample = LabelResampleType::New();
+    labelResample->SetInput(labelCast->GetOutput());
+    labelResample->SetTransform(filter->GetForwardTransform());
+    labelResample->SetInterpolator(labelInterpolator);
+    labelResample->SetOutputParametersFromImage(fixedImage);
+    labelResample->Update();
+
+    itk::ImageRegionConstIterator<MovingImageType> labelIt(labelWarpFilter->GetOutput(labelIndex),
+                                                           labelWarpFilter->GetOutput(labelIndex)->GetBufferedRegion());
+    itk::ImageRegionConstIterator<MovingImageType> expectedLabelIt(labelResample->GetOutput(),
+                                                                   labelResample->GetOutput()->GetBufferedRegion());
+    std::size_t differentLabels = 0;
+    std::size_t foregroundLabels = 0;
+    std::size_t numberOfLabels = 0;
+    for (; !labelIt.IsAtEnd(); ++labelIt, ++expectedLabelIt, ++numberOfLabels)
+    {
+      differentLabels += labelIt.Get() != expectedLabelIt.Get();
+      foregroundLabels += labelIt.Get() == 1;
+    }
+    if (foregroundLabels == 0 || differentLabels * 1000 > numberOfLabels)
+    {
+      std::cerr << "MultiLabel warping differs from resampling at " << differentLabels << " of " << numberOfLabels
+                << " voxels, with " << foregroundLabels << " foreground voxels" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The inverse is computed on first access, so concurrent first accesses must all get the same transform
+  std::vector<const typename FilterType::OutputTransformType *> concurrentInverses(4, nullptr);
+  std::vector<std::thread>                                      readers;
+  for (std::size_t i = 0; i < concurrentInverses.size(); ++i)
+  {
+    readers.emplace_back([&concurrentInverses, &filter, i] { concurrentInverses[i] = filter->GetInverseTransform(); });
+  }
+  for (auto & reader : readers)
+  {
+    reader.join();
+  }
+  for (const auto * concurrentInverse : concurrentInverses)
+  {
+    ITK_TEST_EXPECT_TRUE(concurrentInverse != nullptr && concurrentInverse == concurrentInverses.front());
+  }
+
   auto inverseTransform = filter->GetInverseTransform(); // This should be invertible
   transformWriter->SetFileName(outDir + "/SyntheticInverseTransform.tfm");
   transformWriter->SetInput(inverseTransform);
@@ -191,6 +345,433 @@ testFilter(std::string outDir, std::string transformType)
     ITK_TEST_EXPECT_EQUAL(forwardTransform->GetNumberOfTransforms(), 1);
   }
 
+  // Batched point transformation should match transforming the points one at a time, both ways
+  std::vector<double> points;
+  for (unsigned int i = 0; i < 1000; ++i)
+  {
+    for (unsigned int d = 0; d < Dimension; ++d)
+    {
+      points.push_back(double((i * 7 + d * 13) % 60) - 20.0 + 0.25 * d);
+    }
+  }
+  for (bool inverse : { false, true })
+  {
+    const auto *              transform = inverse ? inverseTransform : forwardTransform;
+    const std::vector<double> transformedPoints = filter->TransformPoints(points, inverse);
+    ITK_TEST_EXPECT_EQUAL(transformedPoints.size(), points.size());
+    ITK_TEST_EXPECT_EQUAL(filter->MakePointTransformer(inverse)->IsAffine(), transform->IsLinear());
+    for (std::size_t i = 0; i < points.size(); i += Dimension)
+    {
+      PointType point;
+      std::copy(points.begin() + i, points.begin() + i + Dimension, point.begin());
+      const PointType expected = transform->TransformPoint(point);
+      for (unsigned int d = 0; d < Dimension; ++d)
+      {
+        if (std::abs(transformedPoints[i + d] - expected[d]) > 1e-6)
+        {
+          std::cerr << "Batched " << (inverse ? "inverse" : "forward") << " transformation of " << point << " gives "
+                    << transformedPoints[i + d] << " instead of " << expected[d] << " at dimension " << d << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    }
+  }
+
+  if (filter->GetCacheStageResults())
+  {
+    // Only the deformable stage depends on SynIterations, so the rigid and affine stages are reused
+    filter->SetSynIterations({ 20, 10, 0 });
+    filter->Update();
+    std::cout << "\nRegistration profile after changing SynIterations: " << filter->GetRegistrationProfileJSON();
+    const auto & rerunProfile = filter->GetRegistrationProfile();
+    ITK_TEST_EXPECT_EQUAL(rerunProfile.size(), 3);
+    ITK_TEST_EXPECT_TRUE(rerunProfile[0].Reused && rerunProfile[1].Reused);
+    ITK_TEST_EXPECT_TRUE(!rerunProfile[2].Reused);
+
+    // The inverse is not part of any stage, so the registration is not rerun
+    ITK_TEST_SET_GET_BOOLEAN(filter, ComputeInverseTransform, false);
+    filter->Update();
+    ITK_TEST_EXPECT_TRUE(filter->GetRegistrationProfile()[2].Reused);
+    ITK_TEST_EXPECT_TRUE(filter->GetInverseTransform() == nullptr);
+    ITK_TRY_EXPECT_EXCEPTION(filter->GetWarpedFixedImage());
+
+    // The sparse mode only changes the deformable stage, whose field is limited to the band's surroundings
+    ITK_TEST_SET_GET_BOOLEAN(filter, SparseSyN, true);
+    filter->SetSparseSyNBandWidth(2.0);
+    ITK_TEST_SET_GET_VALUE(2.0, filter->GetSparseSyNBandWidth());
+    filter->Update();
+    const auto & sparseProfile = filter->GetRegistrationProfile();
+    ITK_TEST_EXPECT_TRUE(sparseProfile[0].Reused && sparseProfile[1].Reused && !sparseProfile[2].Reused);
+    transformedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint); // outside of the band's crop
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(transformedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Sparse SyN does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    ITK_TEST_SET_GET_BOOLEAN(filter, SparseSyN, false);
+
+    // A resumed SyN stage gets its inverse field back from the checkpoint, so the inverse stays available.
+    // With StoreFieldsInFloat, the checkpoint's inverse fields and the cached fields are stored in float.
+    ITK_TEST_SET_GET_BOOLEAN(filter, ComputeInverseTransform, true);
+    ITK_TEST_SET_GET_BOOLEAN(filter, StoreFieldsInFloat, true);
+    const std::string synCheckpointFileName = outDir + "/SyntheticSyNCheckpoint.h5";
+    filter->SetCheckpointFileName(synCheckpointFileName);
+    filter->Update(); // the stages are reused from the cache, and checkpointed
+    ITK_TEST_EXPECT_TRUE(
+      itksys::SystemTools::FileExists(FilterType::MakeCheckpointFileName(synCheckpointFileName, "inverse"), true));
+    typename FilterType::Pointer resumedSyN = FilterType::New();
+    resumedSyN->CopyParameters(filter.GetPointer());
+    resumedSyN->SetFixedImage(fixedImage);
+    resumedSyN->SetMovingImage(movingImage);
+    resumedSyN->SetFixedMask(fixedMask);
+    resumedSyN->SetMovingMask(movingMask);
+    resumedSyN->SetInitialTransform(initialTransform.GetPointer());
+    resumedSyN->ResumeFromCheckpointOn();
+    resumedSyN->Update();
+    for (const auto & stage : resumedSyN->GetRegistrationProfile())
+    {
+      ITK_TEST_EXPECT_TRUE(stage.Reused);
+    }
+    const auto * resumedInverse = resumedSyN->GetInverseTransform();
+    ITK_TEST_EXPECT_TRUE(resumedInverse != nullptr);
+    if (resumedInverse == nullptr)
+    {
+      return EXIT_FAILURE;
+    }
+    for (const PointType & point : { PointType{ { 0, 0 } }, PointType{ { 10, 5 } }, PointType{ { -5, 10 } } })
+    {
+      const PointType resumedPoint = resumedInverse->TransformPoint(point);
+      const PointType originalPoint = filter->GetInverseTransform()->TransformPoint(point);
+      if (resumedPoint.EuclideanDistanceTo(originalPoint) > 1e-4)
+      {
+        std::cerr << "Resumed inverse maps " << point << " to " << resumedPoint << " instead of " << originalPoint
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    ITK_TRY_EXPECT_NO_EXCEPTION(resumedSyN->GetWarpedFixedImage());
+    filter->SetCheckpointFileName("");
+
+    // The stages reused from the fields stored in float match the ones computed in double up to float's rounding
+    const PointType computedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    const PointType computedInversePoint = filter->GetInverseTransform()->TransformPoint(zeroPoint);
+    filter->Modified();
+    filter->Update();
+    for (const auto & stage : filter->GetRegistrationProfile())
+    {
+      ITK_TEST_EXPECT_TRUE(stage.Reused);
+    }
+    ITK_TEST_EXPECT_TRUE(filter->GetInverseTransform() != nullptr);
+    if (filter->GetForwardTransform()->TransformPoint(zeroPoint).EuclideanDistanceTo(computedPoint) > 1e-3 ||
+        filter->GetInverseTransform()->TransformPoint(zeroPoint).EuclideanDistanceTo(computedInversePoint) > 1e-3)
+    {
+      std::cerr << "The stages reused from the fields stored in float differ from the computed ones" << std::endl;
+      return EXIT_FAILURE;
+    }
+    ITK_TEST_SET_GET_BOOLEAN(filter, StoreFieldsInFloat, false);
+
+    // Continuing from the previous result, the coarse levels are skipped and the result is kept
+    typename FilterType::OutputTransformType::ConstPointer previousTransform = filter->GetForwardTransform();
+    filter->SetWarmStartTransform(previousTransform);
+    filter->SetWarmStartLevelsToSkip(2);
+    ITK_TEST_SET_GET_VALUE(2, filter->GetWarmStartLevelsToSkip());
+    filter->Update();
+    std::cout << "\nWarm-started registration profile: " << filter->GetRegistrationProfileJSON();
+    for (const auto & stage : filter->GetRegistrationProfile())
+    {
+      ITK_TEST_EXPECT_TRUE(!stage.Reused && stage.Levels.size() <= 2);
+    }
+    transformedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(transformedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Warm-started registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    filter->SetWarmStartTransform(nullptr);
+
+    // Within a budget equal to the estimate, nothing changes; a tiny budget cannot be met, and throws early
+    const itk::SizeValueType estimate = filter->EstimatePeakMemory();
+    std::cout << "\nEstimated peak memory: " << estimate << " bytes" << std::endl;
+    ITK_TEST_EXPECT_TRUE(estimate > 0);
+    filter->SetMemoryBudget(estimate);
+    ITK_TEST_SET_GET_VALUE(estimate, filter->GetMemoryBudget());
+    ITK_TRY_EXPECT_NO_EXCEPTION(filter->Update());
+    ITK_TEST_EXPECT_EQUAL(filter->GetMemoryBudgetShrinkFactor(), 1);
+    filter->SetMemoryBudget(1);
+    ITK_TRY_EXPECT_EXCEPTION(filter->Update());
+    filter->SetMemoryBudget(0);
+
+    // The B-spline types refine the previous result with far fewer parameters than SyN
+    filter->SetInitialTransform(previousTransform.GetPointer());
+    filter->SetBSplineKnotSpacing(20.0);
+    ITK_TEST_SET_GET_VALUE(20.0, filter->GetBSplineKnotSpacing());
+    ITK_TEST_SET_GET_VALUE(3u, filter->GetBSplineOrder());
+    for (const std::string bsplineType : { "BSpline", "BSplineSyN", "BSplineDisplacementField" })
+    {
+      filter->SetTypeOfTransform(bsplineType);
+      ITK_TRY_EXPECT_NO_EXCEPTION(filter->Update());
+      ITK_TEST_EXPECT_EQUAL(filter->GetRegistrationProfile().back().TransformType, bsplineType);
+      transformedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+      for (unsigned d = 0; d < Dimension; ++d)
+      {
+        if (std::abs(transformedPoint[d] - expectedPoint[d]) > 1.0)
+        {
+          std::cerr << bsplineType << " registration does not match expectation at dimension " << d << std::endl;
+          std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    }
+    filter->SetTypeOfTransform(transformType);
+    filter->SetInitialTransform(initialTransform.GetPointer());
+  }
+
+  if (transformType == "Similarity")
+  {
+    // With a fixed seed, runs with the same global number of threads give the same result,
+    // and a run with another number of threads is refused rather than silently different
+    ITK_TEST_SET_GET_BOOLEAN(filter, Deterministic, true);
+    const itk::ThreadIdType globalThreads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    filter->SetRequiredGlobalNumberOfThreads(globalThreads);
+    ITK_TEST_SET_GET_VALUE(globalThreads, filter->GetRequiredGlobalNumberOfThreads());
+    itk::Point<double, Dimension> point;
+    point.Fill(10.0);
+    filter->Update();
+    const auto deterministicPoint = filter->GetForwardTransform()->TransformPoint(point);
+
+    const itk::ThreadIdType otherThreads = globalThreads > 1 ? 1 : 4;
+    itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(otherThreads);
+    filter->Modified();
+    ITK_TRY_EXPECT_EXCEPTION(filter->Update());
+    ITK_TEST_EXPECT_EQUAL(itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads(), otherThreads); // untouched
+    filter->SetRequiredGlobalNumberOfThreads(otherThreads);
+    ITK_TRY_EXPECT_NO_EXCEPTION(filter->Update());
+    const auto otherThreadsPoint = filter->GetForwardTransform()->TransformPoint(point);
+    std::cout << "Result with " << globalThreads << " threads: " << deterministicPoint << ", with "
+              << otherThreads << " threads: " << otherThreadsPoint << std::endl;
+
+    itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(globalThreads);
+    filter->SetRequiredGlobalNumberOfThreads(globalThreads);
+    filter->Update();
+    const auto rerunPoint = filter->GetForwardTransform()->TransformPoint(point);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      ITK_TEST_EXPECT_EQUAL(rerunPoint[d], deterministicPoint[d]);
+    }
+    filter->SetRequiredGlobalNumberOfThreads(0);
+
+    // Cropping to the masks leaves the transform in physical space
+    ITK_TEST_SET_GET_BOOLEAN(filter, CropToMasks, true);
+    filter->SetCropMargin(5.0);
+    ITK_TEST_SET_GET_VALUE(5.0, filter->GetCropMargin());
+    filter->Update();
+    const auto croppedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(croppedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Cropped registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << croppedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    // Without an initial transform, the multi-start initialization finds the translation
+    filter->SetInitialTransform(nullptr);
+    filter->SetInitialization("MultiStart");
+    ITK_TEST_SET_GET_VALUE(std::string("MultiStart"), filter->GetInitialization());
+    filter->Update();
+    ITK_TEST_EXPECT_EQUAL(filter->GetRegistrationProfile().front().TransformType, std::string("MultiStart"));
+    const auto initializedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(initializedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Initialized registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << initializedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  if (transformType == "Rigid")
+  {
+    // Adaptive scheduling runs each level on its own, within its reported iteration limit,
+    // and merges the levels back into their stage, with a single transform
+    filter->SetConvergenceThreshold(1e-5);
+    ITK_TEST_SET_GET_VALUE(1e-5, filter->GetConvergenceThreshold());
+    filter->SetCollapseCompositeTransform(false);
+    filter->Update();
+    const auto numberOfStageTransforms = filter->GetForwardTransform()->GetNumberOfTransforms();
+    ITK_TEST_SET_GET_BOOLEAN(filter, AdaptiveIterations, true);
+    filter->Update();
+    std::cout << "\nAdaptive registration profile: " << filter->GetRegistrationProfileJSON() << std::endl;
+    ITK_TEST_EXPECT_EQUAL(filter->GetForwardTransform()->GetNumberOfTransforms(), numberOfStageTransforms);
+    const auto &   adaptiveProfile = filter->GetRegistrationProfile();
+    const auto &   affineIterations = filter->GetAffineIterations();
+    const unsigned nonEmptyLevels = std::count_if(
+      affineIterations.begin(), affineIterations.end(), [](unsigned int iterations) { return iterations > 0; });
+    ITK_TEST_EXPECT_EQUAL(adaptiveProfile.size(), 1);
+    ITK_TEST_EXPECT_EQUAL(adaptiveProfile.front().Levels.size(), nonEmptyLevels);
+    for (const auto & level : adaptiveProfile.front().Levels)
+    {
+      ITK_TEST_EXPECT_TRUE(level.Iterations <= level.IterationLimit);
+    }
+    transformedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(transformedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Adaptive registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    ITK_TEST_SET_GET_BOOLEAN(filter, AdaptiveIterations, false);
+    filter->SetCollapseCompositeTransform(true);
+
+    // A channel with its own metric is registered jointly with the fixed and moving images
+    filter->AddChannel(fixedImage, movingImage, 0.5, "Mattes");
+    ITK_TEST_EXPECT_EQUAL(filter->GetNumberOfChannels(), 1);
+    filter->Update();
+    ITK_TEST_EXPECT_EQUAL(filter->GetRegistrationProfile().front().Metric, std::string("MeanSquares+Mattes"));
+    transformedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(transformedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Multi-channel registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    filter->ClearChannels();
+    ITK_TEST_EXPECT_EQUAL(filter->GetNumberOfChannels(), 0);
+
+    // A new registration object resumes from the checkpoint of a completed registration, without rerunning it
+    const std::string checkpointFileName = outDir + "/SyntheticRigidCheckpoint.tfm";
+    filter->SetCheckpointFileName(checkpointFileName);
+    ITK_TEST_SET_GET_VALUE(checkpointFileName, std::string(filter->GetCheckpointFileName()));
+    filter->Update();
+    ITK_TEST_EXPECT_TRUE(itksys::SystemTools::FileExists(checkpointFileName + ".json", true));
+    typename FilterType::Pointer resumedFilter = FilterType::New();
+    resumedFilter->CopyParameters(filter.GetPointer());
+    resumedFilter->SetFixedImage(fixedImage);
+    resumedFilter->SetMovingImage(movingImage);
+    resumedFilter->SetFixedMask(fixedMask);
+    resumedFilter->SetMovingMask(movingMask);
+    resumedFilter->SetInitialTransform(initialTransform.GetPointer());
+    ITK_TEST_SET_GET_BOOLEAN(resumedFilter, ResumeFromCheckpoint, true);
+    resumedFilter->Update();
+    std::cout << "\nResumed registration profile: " << resumedFilter->GetRegistrationProfileJSON() << std::endl;
+    ITK_TEST_EXPECT_TRUE(!resumedFilter->GetRegistrationProfile().empty());
+    for (const auto & stage : resumedFilter->GetRegistrationProfile())
+    {
+      ITK_TEST_EXPECT_TRUE(stage.Reused);
+    }
+    transformedPoint = resumedFilter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(transformedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Resumed registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    // A pre-emption between the renames of the transform and of the sidecar leaves the transform a stage ahead:
+    // the stages of the sidecar are resumed from the start of the transform, and the last one is run again
+    std::vector<std::string> sidecarLines;
+    {
+      std::ifstream sidecar(checkpointFileName + ".json");
+      std::string   line;
+      while (std::getline(sidecar, line))
+      {
+        sidecarLines.push_back(line);
+      }
+    }
+    std::vector<size_t> stageLines;
+    for (size_t i = 0; i < sidecarLines.size(); ++i)
+    {
+      if (sidecarLines[i].find("\"key\"") != std::string::npos)
+      {
+        stageLines.push_back(i);
+      }
+    }
+    if (stageLines.size() > 1)
+    {
+      sidecarLines.erase(sidecarLines.begin() + stageLines.back());
+      std::string & lastStageLine = sidecarLines[stageLines[stageLines.size() - 2]];
+      if (!lastStageLine.empty() && lastStageLine.back() == ',')
+      {
+        lastStageLine.pop_back();
+      }
+      {
+        std::ofstream sidecar(checkpointFileName + ".json");
+        for (const auto & line : sidecarLines)
+        {
+          sidecar << line << '\n';
+        }
+      }
+      resumedFilter->Modified();
+      resumedFilter->Update();
+      const auto & aheadProfile = resumedFilter->GetRegistrationProfile();
+      ITK_TEST_EXPECT_EQUAL(aheadProfile.size(), stageLines.size());
+      for (size_t s = 0; s < aheadProfile.size(); ++s)
+      {
+        ITK_TEST_EXPECT_EQUAL(aheadProfile[s].Reused, s + 1 < aheadProfile.size());
+      }
+    }
+    filter->SetCheckpointFileName("");
+
+    // A spent time budget skips all the stages, which leaves only the initial transform
+    ITK_TEST_EXPECT_TRUE(!filter->GetTruncated());
+    filter->SetTimeBudget(1e-9);
+    filter->Update();
+    ITK_TEST_EXPECT_TRUE(filter->GetTruncated());
+    ITK_TEST_EXPECT_TRUE(filter->GetRegistrationProfile().empty());
+    itk::Point<double, Dimension> origin;
+    origin.Fill(0.0);
+    const auto mappedOrigin = filter->GetForwardTransform()->TransformPoint(origin);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      ITK_TEST_EXPECT_TRUE(itk::Math::FloatAlmostEqual(mappedOrigin[d], translation[d]));
+    }
+
+    // With a budget, a linear stage runs one level at a time, so that the completed levels are kept
+    filter->SetTimeBudget(1e6);
+    filter->Update();
+    ITK_TEST_EXPECT_TRUE(!filter->GetTruncated());
+    ITK_TEST_EXPECT_EQUAL(filter->GetRegistrationProfile().size(), 1);
+    ITK_TEST_EXPECT_EQUAL(filter->GetRegistrationProfile().front().Levels.size(), nonEmptyLevels);
+    transformedPoint = filter->GetForwardTransform()->TransformPoint(zeroPoint);
+    for (unsigned d = 0; d < Dimension; ++d)
+    {
+      if (std::abs(transformedPoint[d] - expectedPoint[d]) > 0.5)
+      {
+        std::cerr << "Budgeted registration does not match expectation at dimension " << d << std::endl;
+        std::cerr << "Expected: " << expectedPoint[d] << ", got: " << transformedPoint[d] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    filter->SetTimeBudget(0.0);
+
+    // Aborting stops the registration before the next stage or iteration
+    const unsigned long abortTag = filter->AddObserver(
+      itk::ProgressEvent(), [&filter](const itk::EventObject &) { filter->AbortGenerateDataOn(); });
+    ITK_TRY_EXPECT_EXCEPTION(filter->Update());
+    filter->RemoveObserver(abortTag);
+  }
+
   return EXIT_SUCCESS;
 }
 } // namespace
@@ -209,6 +790,7 @@ itkANTSRegistrationBasicTests(int argc, char * argv[])
   }
 
   itk::TxtTransformIOFactory::RegisterOneFactory();
+  itk::HDF5TransformIOFactory::RegisterOneFactory();
 
   int overallSuccess = EXIT_SUCCESS;
   int retVal = EXIT_SUCCESS;
@@ -0,0 +1,64 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkANTSTestHelpers_h
+#define itkANTSTestHelpers_h
+
+#include "itkImage.h"
+#include "itkImageRegionIterator.h"
+#include "itkSignedMaurerDistanceMapImageFilter.h"
+
+// Synthetic 2D images shared by the tests of the filters which run several registrations
+namespace ANTsWasmTesting
+{
+constexpr unsigned Dimension = 2;
+using LabelImageType = itk::Image<unsigned char, Dimension>;
+using ImageType = itk::Image<float, Dimension>;
+
+// A rectangle whose lower corner is at index (20 + shift, 10)
+inline LabelImageType::Pointer
+makeRectangle(int shift)
+{
+  LabelImageType::Pointer mask = LabelImageType::New();
+  mask->SetRegions(LabelImageType::SizeType{ { 64, 32 } });
+  mask->Allocate();
+  mask->FillBuffer(0);
+
+  LabelImageType::RegionType region({ { 20 + shift, 10 } }, { { 24, 12 } });
+  itk::ImageRegionIterator<LabelImageType> it(mask, region);
+  for (; !it.IsAtEnd(); ++it)
+  {
+    it.Set(1);
+  }
+  return mask;
+}
+
+inline ImageType::Pointer
+makeSDF(const LabelImageType * mask)
+{
+  using DistanceMapFilterType = itk::SignedMaurerDistanceMapImageFilter<LabelImageType, ImageType>;
+  DistanceMapFilterType::Pointer distanceMapFilter = DistanceMapFilterType::New();
+  distanceMapFilter->SetInput(mask);
+  distanceMapFilter->SetSquaredDistance(false);
+  distanceMapFilter->SetUseImageSpacing(true);
+  distanceMapFilter->SetInsideIsPositive(true);
+  distanceMapFilter->Update();
+  return distanceMapFilter->GetOutput();
+}
+} // namespace ANTsWasmTesting
+
+#endif // itkANTSTestHelpers_h
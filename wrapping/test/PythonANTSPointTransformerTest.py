@@ -0,0 +1,55 @@
+# ==========================================================================
+#
+#   Copyright NumFOCUS
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#          https://www.apache.org/licenses/LICENSE-2.0.txt
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+# ==========================================================================*/
+
+import itk
+import numpy as np
+
+Dimension = 2
+number_of_points = 1000
+
+# a translation followed by an affine transform, which the point transformer composes into one matrix
+translation = itk.TranslationTransform[itk.D, Dimension].New()
+translation.SetOffset([3.0, -2.0])
+affine = itk.AffineTransform[itk.D, Dimension].New()
+parameters = affine.GetParameters()
+for i, value in enumerate([1.05, -0.3, 0.25, 0.9, -5.0, 7.5]):  # matrix, then translation
+    parameters.SetElement(i, value)
+affine.SetParameters(parameters)
+composite = itk.CompositeTransform[itk.D, Dimension].New()
+composite.AddTransform(affine)
+composite.AddTransform(translation)  # applied first
+
+transformer = itk.ANTSPointTransformer[itk.D, Dimension].New()
+transformer.SetTransform(composite)
+transformer.SetBlockSize(64)  # several blocks, so that the parallel path is used
+assert transformer.IsAffine()
+
+# a NumPy array of shape (n, Dimension) is passed flattened
+points = np.random.default_rng(0).uniform(-50.0, 50.0, (number_of_points, Dimension))
+points_copy = points.copy()
+transformed = np.asarray(transformer.TransformPoints(points.ravel()))
+assert transformed.shape == (number_of_points * Dimension,), transformed.shape
+transformed = transformed.reshape(-1, Dimension)
+
+expected = np.array([composite.TransformPoint([float(c) for c in p]) for p in points])
+assert expected.shape == transformed.shape
+max_error = np.abs(transformed - expected).max()
+assert max_error < 1e-9, max_error
+
+# the result is a copy, the input is left untouched
+assert np.array_equal(points, points_copy)
@@ -0,0 +1,61 @@
+# ==========================================================================
+#
+#   Copyright NumFOCUS
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#          https://www.apache.org/licenses/LICENSE-2.0.txt
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+# ==========================================================================*/
+
+import json
+
+import itk
+import numpy as np
+
+Dimension = 2
+ImageType = itk.Image[itk.F, Dimension]
+
+
+# a smooth blob, so that the metric has a gradient everywhere
+def make_blob(center):
+    y, x = np.mgrid[0:64, 0:64]
+    array = np.exp(-((x - center[0]) ** 2 + (y - center[1]) ** 2) / (2.0 * 8.0**2))
+    return itk.image_from_array(array.astype(np.float32))
+
+
+fixed_image = make_blob((30.0, 32.0))
+moving_image = make_blob((34.0, 29.0))
+
+registration = itk.ANTSRegistration[ImageType, ImageType, itk.D].New()
+registration.SetFixedImage(fixed_image)
+registration.SetMovingImage(moving_image)
+registration.SetTypeOfTransform("Affine")
+registration.SetAffineMetric("MeanSquares")
+registration.SetRandomSeed(30101983)
+registration.Update()
+
+profile = json.loads(registration.GetRegistrationProfileJSON())
+assert isinstance(profile, list) and len(profile) > 0, profile
+for stage in profile:
+    assert stage["transformType"], stage
+    assert stage["wallTime"] > 0.0, stage
+    assert not stage["reused"] and not stage["interrupted"], stage
+    assert len(stage["levels"]) > 0, stage
+    for level in stage["levels"]:
+        assert 0 <= level["iterations"] <= level["iterationLimit"], level
+        assert level["wallTime"] >= 0.0, level
+assert any(level["iterations"] > 0 for stage in profile for level in stage["levels"]), profile
+
+# the registration found the blob's shift
+forward_transform = registration.GetForwardTransform()
+mapped = forward_transform.TransformPoint([30.0, 32.0])
+assert abs(mapped[0] - 34.0) < 1.0 and abs(mapped[1] - 29.0) < 1.0, mapped